@@ -0,0 +1,167 @@
+/*
+* Checks that the steady-state programming loop of IceBoard-Programmer does not allocate on the heap
+* operator new is replaced by one that counts its calls, then the simulated flash is programmed, validated and diffed in single and in quad mode
+* Every step runs once to warm up and then again while the allocations are counted, the check fails if that second run allocated anything
+*/
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <cstdlib>
+#include <new>
+#include <atomic>
+#include "ftd2xx.h"
+#include "LibFT4222.h"
+#include "IceBoard.h"
+#include "SimulatedFlash.h"
+
+const int CHECK_IMAGE_SIZE = 100000;        // Bytes of the programmed image, 25 sectors with a partly filled last one
+const int CHECK_CHANGED_SECTORS[] = { 3, 4, 17 };   // Sectors that differ between the two images the diff switches between
+
+static std::atomic<size_t> allocationCount = 0;
+
+void* operator new(size_t size)
+{
+    allocationCount++;
+    void* memory = std::malloc(size != 0 ? size : 1);
+    if (memory == nullptr)
+        throw std::bad_alloc();
+    return memory;
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+    std::free(memory);
+}
+
+/*
+* Runs step twice and stores the number of allocations of the second run in allocations
+* Returns the status of the first run that failed
+*/
+template <typename Step>
+FT4222_STATUS CountAllocations(Step step, size_t* allocations)
+{
+    FT4222_STATUS status = step();
+    if (status != FT4222_OK)
+        return status;
+
+    const size_t before = allocationCount;
+    status = step();
+    *allocations = allocationCount - before;
+    return status;
+}
+
+/*
+* Programs, validates and diffs the images on board in the read and program modes set up by the caller, and prints the allocations of every step
+* isAllocating is set to true if any step allocated
+*/
+FT4222_STATUS CheckProgrammingLoop(IceBoard* board, const std::string& modeName, std::span<const uint8> image, std::span<const uint8> changedImage, bool* isAllocating)
+{
+    FT4222_STATUS status;
+
+    struct NamedStep
+    {
+        const char* name;
+        FT4222_STATUS(*run)(IceBoard* board, std::span<const uint8> image, std::span<const uint8> changedImage);
+    };
+
+    const NamedStep steps[] =
+    {
+        { "program", [](IceBoard* board, std::span<const uint8> image, std::span<const uint8>)
+            {
+                FT4222_STATUS status = EraseRangeFlash(board, 0, (int)image.size(), true);
+                if (status != FT4222_OK)
+                    return status;
+                return ProgramFlash(board, image);
+            } },
+        { "validate", [](IceBoard* board, std::span<const uint8> image, std::span<const uint8>)
+            {
+                return ValidateFlash(board, image);
+            } },
+        { "hash validate", [](IceBoard* board, std::span<const uint8> image, std::span<const uint8>)
+            {
+                return HashValidateFlash(board, image);
+            } },
+        { "diff", [](IceBoard* board, std::span<const uint8> image, std::span<const uint8> changedImage)
+            {
+                // Switches to the changed image and back, so every run finds the same sectors changed
+                int changedSectorCount;
+                FT4222_STATUS status = DiffProgramFlash(board, changedImage, &changedSectorCount);
+                if (status != FT4222_OK)
+                    return status;
+                return DiffProgramFlash(board, image, &changedSectorCount);
+            } },
+    };
+
+    for (const NamedStep& step : steps)
+    {
+        size_t allocations;
+        status = CountAllocations([&]() { return step.run(board, image, changedImage); }, &allocations);
+        if (status != FT4222_OK)
+            return status;
+
+        std::cout << modeName << " " << step.name << ": " << allocations << " allocations" << std::endl;
+        if (allocations != 0)
+            *isAllocating = true;
+    }
+
+    return FT4222_OK;
+}
+
+int main()
+{
+    FT4222_STATUS status;
+
+    SimulatedFlashConfig config;
+    config.usbLatencyUs = 0;
+    config.usbRequestUs = 0;
+
+    IceBoard board;
+    status = (FT4222_STATUS)InitSimulatedBoard(&board, config, "SIMULATED", 1, DEFAULT_USB_TUNING);
+
+    FlashDescriptor flashDescriptor = DefaultFlashDescriptor();
+    if (status == FT4222_OK)
+        status = WakeUpFlash(&board);
+    if (status == FT4222_OK)
+        status = DetectFlash(&board, &flashDescriptor);
+    if (status == FT4222_OK)
+        SetFlashDescriptor(&board, flashDescriptor);
+
+    std::vector<uint8> image(CHECK_IMAGE_SIZE);
+    for (size_t i = 0; i < image.size(); i++)
+        image[i] = (uint8)(i * 7 + i / 251);
+    std::vector<uint8> changedImage = image;
+    for (int sectorIndex : CHECK_CHANGED_SECTORS)
+        changedImage[sectorIndex * flashDescriptor.sectorSize + 5] ^= 0x5A;
+
+    bool isAllocating = false;
+    if (status == FT4222_OK)
+        status = CheckProgrammingLoop(&board, "single", image, changedImage, &isAllocating);
+
+    if (status == FT4222_OK)
+        status = SetFlashReadMode(&board, QuadIOReadMode, flashDescriptor.quadEnable);
+    if (status == FT4222_OK)
+        status = SetFlashProgramMode(&board, QuadInputProgramMode, flashDescriptor.quadEnable);
+    if (status == FT4222_OK)
+        status = CheckProgrammingLoop(&board, "quad", image, changedImage, &isAllocating);
+
+    if (status != FT4222_OK)
+    {
+        std::cout << statusMessages[status] << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (isAllocating)
+    {
+        std::cout << "FAILED: the programming loop allocated on the heap" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "OK: the programming loop did not allocate" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,509 @@
+/*
+* Microbenchmarks of the building blocks of IceBoard-Programmer, measured in isolation
+* Every measurement is repeated and the fastest run is reported, which is the most stable number between runs on a busy machine
+* Transfers are timed one by one, their minimum and median latency are reported, the median is what a programming run sees
+* The transport benchmarks run against the simulated flash unless a board is selected, so they also run on a machine without one
+*/
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include "ftd2xx.h"
+#include "LibFT4222.h"
+#include "IceBoard.h"
+#include "SimulatedFlash.h"
+#include "Manifest.h"
+#include "CompareKernel.h"
+
+const int BENCHMARK_REPEATS = 7;                    // Runs of every measurement, the fastest one is reported
+const size_t BENCHMARK_BYTES_PER_RUN = 64 << 20;    // Bytes processed by one run, enough to make the timer resolution irrelevant
+const size_t COMPARE_BLOCK_SIZE = 256;              // Block size of the mismatch bitmap, the page size of the flash
+const size_t COMPARE_SIZES[] = { 256, 4096, 65535, 1 << 20 };   // A page, a sector, one read transfer and a large image
+const size_t HASH_SIZES[] = { 256, 4096, 1 << 20 };                 // A page, a sector and a large image
+const int TRANSFER_SIZES[] = { 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768, MAX_READ_SIZE };
+const int TRANSFER_SAMPLES = 32;                    // Transfers timed for every size, every status poll length and every page program step
+const int STATUS_POLL_READS[] = { 1, 16, 256 };     // Status register values read in one transfer, a single read up to the long polls of an erase
+const int PAGE_PROGRAM_ERASE_CYCLES = 2;            // Times the scratch sector is erased and programmed page by page
+const int READ_CHUNK_SIZES[] = { 512, 1024, 2048, 4096, 8192, 16384, 32768, MAX_READ_SIZE };    // Read chunk sizes besides the one TuneUsb picks
+const DWORD USB_IN_TRANSFER_SIZES[] = { DEFAULT_USB_IN_TRANSFER_SIZE, DEFAULT_USB_TUNING.inTransferSize };  // The driver default and the tuned size
+const int READ_CURVE_BYTES = 131072;                // Bytes read by ReadFlash for every point of the read curve
+const int READ_CURVE_SAMPLES = 3;                   // Reads timed for every point of the read curve
+
+struct BenchmarkOptions
+{
+    bool isHardware = false;
+    std::string serialNumber;                   // Board used with --hardware, the first one found if empty
+    int scratchSectorIndex = -1;                // Sector overwritten by the page program benchmark, on a board it only runs if one is given
+    SimulatedFlashConfig simulatedFlash;
+};
+
+// Minimum and median of the samples of one measurement
+struct LatencyStats
+{
+    double minUs = 0;
+    double medianUs = 0;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+/*
+* Returns the throughput in MB/s of the fastest of BENCHMARK_REPEATS runs of run, which processes bytesPerCall bytes every call
+*/
+template <typename Function>
+double MeasureThroughput(size_t bytesPerCall, Function run)
+{
+    const size_t calls = std::max(BENCHMARK_BYTES_PER_RUN / bytesPerCall, (size_t)1);
+    double bestSeconds = 1e30;
+
+    for (int repeat = 0; repeat < BENCHMARK_REPEATS; repeat++)
+    {
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < calls; i++)
+            run();
+        bestSeconds = std::min(bestSeconds, std::chrono::duration<double>(Clock::now() - start).count());
+    }
+
+    return calls * bytesPerCall / bestSeconds / 1e6;
+}
+
+/*
+* Times TRANSFER_SAMPLES calls of run, which returns the status of the transfers it made, and fills stats with their latency
+*/
+template <typename Function>
+FT4222_STATUS MeasureLatency(Function run, LatencyStats* stats)
+{
+    std::vector<double> samples;
+
+    for (int i = 0; i < TRANSFER_SAMPLES; i++)
+    {
+        Clock::time_point start = Clock::now();
+        FT4222_STATUS status = run();
+        if (status != FT4222_OK)
+            return status;
+        samples.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+    }
+
+    std::sort(samples.begin(), samples.end());
+    stats->minUs = samples.front();
+    stats->medianUs = samples[samples.size() / 2];
+    return FT4222_OK;
+}
+
+void PrintLatency(const LatencyStats& stats)
+{
+    std::cout << std::fixed << std::setprecision(1) << std::setw(12) << stats.minUs << std::setw(12) << stats.medianUs;
+}
+
+/*
+* Opens the board selected by options, or a simulated one, and detects its flash the way the programmer does
+*/
+FT4222_STATUS OpenBenchmarkBoard(const BenchmarkOptions& options, IceBoard* board)
+{
+    FT4222_STATUS status;
+
+    if (options.isHardware)
+    {
+        std::string serialNumber = options.serialNumber;
+        if (serialNumber.empty())
+        {
+            std::vector<IceBoardInfo> boards;
+            status = (FT4222_STATUS)FindBoards(&boards);
+            if (status != FT4222_OK)
+                return status;
+            if (boards.empty())
+                return (FT4222_STATUS)FT_DEVICE_NOT_FOUND;
+            serialNumber = boards[0].serialNumber;
+        }
+        status = (FT4222_STATUS)InitBoard(board, serialNumber, 1, DEFAULT_USB_TUNING);
+    }
+    else
+        status = (FT4222_STATUS)InitSimulatedBoard(board, options.simulatedFlash, "SIMULATED", 1, DEFAULT_USB_TUNING);
+    if (status != FT4222_OK)
+        return status;
+
+    status = WakeUpFlash(board);
+    if (status != FT4222_OK)
+        return status;
+
+    FlashDescriptor flashDescriptor;
+    status = DetectFlash(board, &flashDescriptor);
+    if (status != FT4222_OK)
+        return status;
+    SetFlashDescriptor(board, flashDescriptor);
+
+    std::cout << (options.isHardware ? "Board " : "Simulated board ") << GetBoardSerialNumber(board) << ", flash " << flashDescriptor.name;
+    std::cout << ", SPI clock " << SpiClockHz(GetSpiClock(board)) / 1000000.0 << " MHz" << std::endl << std::endl;
+    return status;
+}
+
+/*
+* Latency of WriteSPI and ReadSPI from 1 Byte up to the largest read of one transfer
+* The written bytes are all DummyCmd, which the flash does not take as a command
+* The reads continue a fast read from address 0, only the ReadSPI call is timed
+*/
+FT4222_STATUS SpiLatencyBenchmark(IceBoard* board)
+{
+    FT4222_STATUS status;
+
+    const std::vector<uint8> writeBuffer(MAX_READ_SIZE, DummyCmd);
+    std::vector<uint8> readBuffer(MAX_READ_SIZE);
+    const uint8 fastReadCommand[] = { FastReadCmd, 0, 0, 0, DummyCmd };
+
+    std::cout << "SPI transfers, latency in us" << std::endl;
+    std::cout << std::setw(10) << "Bytes" << std::setw(12) << "Write min" << std::setw(12) << "median" << std::setw(12) << "MB/s";
+    std::cout << std::setw(12) << "Read min" << std::setw(12) << "median" << std::setw(12) << "MB/s" << std::endl;
+
+    for (int size : TRANSFER_SIZES)
+    {
+        LatencyStats writeStats;
+        status = MeasureLatency([&]() { return WriteSPI(board, std::span<const uint8>(writeBuffer).first(size), true); }, &writeStats);
+        if (status != FT4222_OK)
+            return status;
+
+        std::vector<double> samples;
+        for (int i = 0; i < TRANSFER_SAMPLES; i++)
+        {
+            status = WriteSPI(board, fastReadCommand, false);
+            if (status != FT4222_OK)
+                return status;
+
+            Clock::time_point start = Clock::now();
+            status = ReadSPI(board, std::span<uint8>(readBuffer).first(size), true);
+            if (status != FT4222_OK)
+                return status;
+            samples.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+        }
+        std::sort(samples.begin(), samples.end());
+        const LatencyStats readStats = { samples.front(), samples[samples.size() / 2] };
+
+        std::cout << std::setw(10) << size;
+        PrintLatency(writeStats);
+        std::cout << std::setw(12) << size / writeStats.medianUs;
+        PrintLatency(readStats);
+        std::cout << std::setw(12) << size / readStats.medianUs << std::endl;
+    }
+    std::cout << std::endl;
+
+    return FT4222_OK;
+}
+
+/*
+* Latency of one poll of the status register (RDSR), as WaitForFlashReady sends it with different numbers of status reads
+*/
+FT4222_STATUS StatusPollBenchmark(IceBoard* board)
+{
+    FT4222_STATUS status;
+
+    std::cout << "Status register polls, latency in us" << std::endl;
+    std::cout << std::setw(10) << "Reads" << std::setw(12) << "min" << std::setw(12) << "median" << std::endl;
+
+    for (int statusReads : STATUS_POLL_READS)
+    {
+        uint8 statusRegister;
+        LatencyStats stats;
+        status = MeasureLatency([&]() { return ReadStatusFlash(board, &statusRegister, statusReads); }, &stats);
+        if (status != FT4222_OK)
+            return status;
+
+        std::cout << std::setw(10) << statusReads;
+        PrintLatency(stats);
+        std::cout << std::endl;
+    }
+    std::cout << std::endl;
+
+    return FT4222_OK;
+}
+
+/*
+* Cost of programming a full page: sending the page program command and waiting for the flash to complete it
+* Erases and programs the sector given by scratchSectorIndex, its content is lost
+*/
+FT4222_STATUS PageProgramBenchmark(IceBoard* board, int scratchSectorIndex)
+{
+    FT4222_STATUS status;
+
+    const FlashDescriptor& flashDescriptor = GetFlashDescriptor(board);
+    const int pagesPerSector = flashDescriptor.sectorSize / flashDescriptor.pageSize;
+    std::mt19937 random(1);
+    std::vector<uint8> page(flashDescriptor.pageSize);
+    std::vector<double> commandSamples;
+    std::vector<double> waitSamples;
+    std::vector<double> totalSamples;
+
+    for (int cycle = 0; cycle < PAGE_PROGRAM_ERASE_CYCLES; cycle++)
+    {
+        status = EraseSector(board, scratchSectorIndex);
+        if (status != FT4222_OK)
+            return status;
+
+        for (int i = 0; i < pagesPerSector && (int)commandSamples.size() < TRANSFER_SAMPLES; i++)
+        {
+            for (uint8& byte : page)
+                byte = (uint8)random();
+
+            Clock::time_point start = Clock::now();
+            status = StartPageProgramFlash(board, scratchSectorIndex * pagesPerSector + i, 0, page);
+            if (status != FT4222_OK)
+                return status;
+
+            Clock::time_point sent = Clock::now();
+            status = WaitForFlashReady(board, flashDescriptor.pageProgramTiming);
+            if (status != FT4222_OK)
+                return status;
+
+            Clock::time_point end = Clock::now();
+            commandSamples.push_back(std::chrono::duration<double, std::micro>(sent - start).count());
+            waitSamples.push_back(std::chrono::duration<double, std::micro>(end - sent).count());
+            totalSamples.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+        }
+    }
+
+    std::cout << "Page program of " << flashDescriptor.pageSize << " Bytes, latency in us" << std::endl;
+    std::cout << std::setw(10) << "Step" << std::setw(12) << "min" << std::setw(12) << "median" << std::endl;
+    for (auto [name, samples] : { std::pair{ "Command", &commandSamples }, std::pair{ "Wait", &waitSamples }, std::pair{ "Total", &totalSamples } })
+    {
+        std::sort(samples->begin(), samples->end());
+        std::cout << std::setw(10) << name;
+        PrintLatency({ samples->front(), (*samples)[samples->size() / 2] });
+        std::cout << std::endl;
+    }
+    std::cout << std::endl;
+
+    return FT4222_OK;
+}
+
+/*
+* Throughput of ReadFlash for every read chunk size, once with the USB request size the driver starts with and once with the tuned one
+* The last row is the chunk size TuneUsb picks for the tuned setting, the board is left tuned with the defaults
+*/
+FT4222_STATUS ReadCurveBenchmark(IceBoard* board)
+{
+    FT4222_STATUS status;
+
+    std::vector<uint8> readBuffer(std::min(READ_CURVE_BYTES, GetFlashDescriptor(board).size));
+    // The board was opened with the defaults
+    std::vector<int> chunkSizes(std::begin(READ_CHUNK_SIZES), std::end(READ_CHUNK_SIZES));
+    chunkSizes.push_back(GetReadChunkSize(board));
+
+    std::cout << "ReadFlash of " << readBuffer.size() << " Bytes, MB/s by read chunk size and USB request size (packets of " << GetUsbPacketSize(board) << " Bytes)" << std::endl;
+    std::cout << std::setw(10) << "Chunk";
+    for (DWORD inTransferSize : USB_IN_TRANSFER_SIZES)
+        std::cout << std::setw(12) << inTransferSize;
+    std::cout << std::endl;
+
+    for (int chunkSize : chunkSizes)
+    {
+        std::cout << std::setw(10) << chunkSize;
+        for (DWORD inTransferSize : USB_IN_TRANSFER_SIZES)
+        {
+            status = TuneUsb(board, { DEFAULT_USB_TUNING.latencyTimerMs, inTransferSize });
+            if (status != FT4222_OK)
+                return status;
+            SetReadChunkSize(board, chunkSize);
+
+            std::vector<double> samples;
+            for (int i = 0; i < READ_CURVE_SAMPLES; i++)
+            {
+                Clock::time_point start = Clock::now();
+                status = ReadFlash(board, 0, readBuffer);
+                if (status != FT4222_OK)
+                    return status;
+                samples.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+            }
+            std::sort(samples.begin(), samples.end());
+            std::cout << std::fixed << std::setprecision(2) << std::setw(12) << readBuffer.size() / samples[samples.size() / 2];
+        }
+        std::cout << std::endl;
+    }
+    std::cout << std::endl;
+
+    return TuneUsb(board, DEFAULT_USB_TUNING);
+}
+
+/*
+* Host work of slicing an image for programming: cutting it into sectors and finding the part of every page that is not blank
+* Half of the image is random and half erased, as the tail of a bitstream that does not fill the flash
+*/
+void SliceBenchmark(IceBoard* board)
+{
+    const FlashDescriptor& flashDescriptor = GetFlashDescriptor(board);
+    std::mt19937 random(1);
+    std::vector<uint8> image(flashDescriptor.size, 0xFF);
+    for (size_t i = 0; i < image.size() / 2; i++)
+        image[i] = (uint8)random();
+    const int sectorCount = flashDescriptor.size / flashDescriptor.sectorSize;
+    volatile size_t sink = 0;
+
+    const double throughput = MeasureThroughput(image.size(), [&]()
+        {
+            for (int i = 0; i < sectorCount; i++)
+            {
+                std::span<const uint8> sector = ExtractSector(board, image, i);
+                for (size_t offset = 0; offset < sector.size(); offset += flashDescriptor.pageSize)
+                {
+                    size_t first;
+                    size_t last;
+                    FindNonBlankRange(sector.subspan(offset, flashDescriptor.pageSize), &first, &last);
+                    sink = sink + last - first;
+                }
+            }
+        });
+
+    std::cout << "Slicing, MB/s of a " << image.size() << " Bytes image" << std::endl;
+    std::cout << std::setw(10) << "Sectors" << std::fixed << std::setprecision(0) << std::setw(12) << throughput << std::endl << std::endl;
+}
+
+/*
+* Hashes random buffers with the image hash that validates the flash and with the sector hashes of the manifest
+*/
+void HashBenchmark()
+{
+    std::mt19937 random(1);
+    std::vector<uint8> image(HASH_SIZES[std::size(HASH_SIZES) - 1]);
+    for (uint8& byte : image)
+        byte = (uint8)random();
+    volatile unsigned long long sink = 0;
+
+    std::cout << "Hashing, MB/s" << std::endl;
+    std::cout << std::setw(10) << "Bytes" << std::setw(12) << "Image" << std::setw(12) << "Manifest" << std::endl;
+
+    for (size_t size : HASH_SIZES)
+    {
+        std::span<const uint8> buffer(image.data(), size);
+        ImageManifest manifest;
+
+        std::cout << std::setw(10) << size << std::fixed << std::setprecision(0);
+        std::cout << std::setw(12) << MeasureThroughput(size, [&]() { sink = sink + HashImage(buffer, IMAGE_HASH_SEED); });
+        std::cout << std::setw(12) << MeasureThroughput(size, [&]() { BuildManifest(buffer, FLASH_SECTOR_SIZE, &manifest); sink = sink + manifest.imageHash; });
+        std::cout << std::endl;
+    }
+    std::cout << std::endl;
+}
+
+/*
+* Compares equal buffers with every compare kernel the CPU supports, the common case of a flash that programmed correctly
+* std::equal is measured as well, it is what the read back was compared with before the kernels
+*/
+void CompareBenchmark()
+{
+    std::mt19937 random(1);
+    std::vector<uint8> image(COMPARE_SIZES[std::size(COMPARE_SIZES) - 1]);
+    for (uint8& byte : image)
+        byte = (uint8)random();
+    const std::vector<uint8> readBack = image;
+    std::vector<unsigned long long> mismatchBlocks(image.size() / COMPARE_BLOCK_SIZE / 64 + 1);
+    volatile size_t sink = 0;
+
+    const CompareKernel defaultKernel = GetCompareKernel();
+    std::cout << "Compare, MB/s of equal buffers (default kernel " << CompareKernelName(defaultKernel) << ")" << std::endl;
+    std::cout << std::setw(10) << "Bytes" << std::setw(12) << "std::equal";
+    for (CompareKernel kernel : { ScalarCompareKernel, Sse2CompareKernel, Avx2CompareKernel })
+        std::cout << std::setw(12) << CompareKernelName(kernel);
+    std::cout << std::endl;
+
+    for (size_t size : COMPARE_SIZES)
+    {
+        std::span<const uint8> actual(readBack.data(), size);
+        std::span<const uint8> expected(image.data(), size);
+
+        std::cout << std::setw(10) << size << std::fixed << std::setprecision(0);
+        std::cout << std::setw(12) << MeasureThroughput(size, [&]() { sink = sink + std::equal(actual.begin(), actual.end(), expected.begin()); });
+
+        for (CompareKernel kernel : { ScalarCompareKernel, Sse2CompareKernel, Avx2CompareKernel })
+        {
+            if (!SetCompareKernel(kernel))
+            {
+                std::cout << std::setw(12) << "-";
+                continue;
+            }
+            std::cout << std::setw(12) << MeasureThroughput(size, [&]() { sink = sink + CompareImage(actual, expected, 0, COMPARE_BLOCK_SIZE, mismatchBlocks); });
+        }
+        std::cout << std::endl;
+    }
+
+    SetCompareKernel(defaultKernel);
+    std::cout << std::endl;
+}
+
+void PrintUsage()
+{
+    std::cout << "Usage: IceBoard-Benchmarks.exe [options]" << std::endl;
+    std::cout << "  --hardware              Measure the transfers of the first Ice Board found instead of a simulated one" << std::endl;
+    std::cout << "  --serial <serial>       Measure the transfers of the Ice Board with this serial number" << std::endl;
+    std::cout << "  --usb-latency-us <n>    USB latency of every transfer to the simulated flash (default 1000)" << std::endl;
+    std::cout << "  --scratch-sector <n>    Sector erased and programmed by the page program benchmark (default last sector of a simulated flash,"  << std::endl;
+    std::cout << "                          the benchmark is skipped on a board without it)" << std::endl;
+}
+
+/*
+* Parses the command line into options
+* Returns false if the command line is not valid
+*/
+bool ParseArguments(int argc, char const* argv[], BenchmarkOptions* options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string argument = argv[i];
+        const bool hasValue = i + 1 < argc;
+
+        if (argument == "--hardware")
+            options->isHardware = true;
+        else if (argument == "--serial" && hasValue)
+        {
+            options->isHardware = true;
+            options->serialNumber = argv[++i];
+        }
+        else if (argument == "--usb-latency-us" && hasValue)
+            options->simulatedFlash.usbLatencyUs = std::stoi(argv[++i]);
+        else if (argument == "--scratch-sector" && hasValue)
+            options->scratchSectorIndex = std::stoi(argv[++i]);
+        else
+            return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char const* argv[])
+{
+    BenchmarkOptions options;
+    if (!ParseArguments(argc, argv, &options))
+    {
+        PrintUsage();
+        return EXIT_FAILURE;
+    }
+
+    FT4222_STATUS status;
+    IceBoard board;
+    status = OpenBenchmarkBoard(options, &board);
+
+    if (status == FT4222_OK)
+        status = SpiLatencyBenchmark(&board);
+    if (status == FT4222_OK)
+        status = StatusPollBenchmark(&board);
+    if (status == FT4222_OK)
+        status = ReadCurveBenchmark(&board);
+
+    // The scratch sector is only overwritten on a board if the user chose it
+    const int sectorCount = GetFlashDescriptor(&board).size / GetFlashDescriptor(&board).sectorSize;
+    const int scratchSectorIndex = options.scratchSectorIndex < 0 && !options.isHardware ? sectorCount - 1 : options.scratchSectorIndex;
+    if (status == FT4222_OK && scratchSectorIndex >= sectorCount)
+        status = FT4222_INVALID_PARAMETER;
+    if (status == FT4222_OK && scratchSectorIndex >= 0)
+        status = PageProgramBenchmark(&board, scratchSectorIndex);
+
+    if (status != FT4222_OK)
+    {
+        std::cout << statusMessages[status] << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    SliceBenchmark(&board);
+    HashBenchmark();
+    CompareBenchmark();
+    return EXIT_SUCCESS;
+}
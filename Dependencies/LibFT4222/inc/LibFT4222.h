@@ -162,7 +162,13 @@ typedef enum FT4222_STATUS
     FT4222_FUN_NOT_SUPPORT,
     FT4222_INORRECT_TRANSFER_SIZE,
     FT4222_TIME_OUT_ERROR,
-    FT4222_CORRUPTED_UPLOAD
+    FT4222_CORRUPTED_UPLOAD,
+    FT4222_QUAD_ENABLE_FAILED,
+    FT4222_FLASH_NOT_DETECTED,
+    FT4222_FLASH_MISMATCH,
+    FT4222_IMAGE_TOO_LARGE,
+    FT4222_IMAGE_READ_FAILED,
+    FT4222_FPGA_NOT_CONFIGURED
 }
 FT4222_STATUS;
 
@@ -0,0 +1,302 @@
+#include <thread>
+#include <algorithm>
+#include "AsyncProgrammer.h"
+
+/*
+* Starts task on the next call of Run, task must stay alive until Run returns
+*/
+void ProgramScheduler::Spawn(ProgramTask& task)
+{
+    Schedule(task.Handle(), Clock::now());
+}
+
+void ProgramScheduler::Schedule(std::coroutine_handle<> handle, Clock::time_point deadline)
+{
+    timers.push({ deadline, sequence++, handle });
+}
+
+/*
+* Resumes coroutines until all spawned tasks are done
+* Waits shorter than MIN_SLEEP_US are spent spinning instead of sleeping, as the OS can not sleep that precisely
+*/
+void ProgramScheduler::Run()
+{
+    const std::chrono::microseconds minSleep(MIN_SLEEP_US);
+
+    while (!timers.empty())
+    {
+        Timer timer = timers.top();
+        timers.pop();
+
+        if (timer.deadline - Clock::now() > minSleep)
+            std::this_thread::sleep_until(timer.deadline);
+        while (Clock::now() < timer.deadline)
+            std::this_thread::yield();
+
+        timer.handle.resume();
+    }
+}
+
+/*
+* Waits until the flash has completed the operation described by timing, without blocking the other coroutines of the scheduler
+* Unlike WaitForFlashReady the status is not polled by holding SS low, as that transfer would keep every other board waiting
+* The coroutine sleeps through the typical time of the operation, then polls once per transfer with a sleep in between that doubles with every poll
+* If the flash is still busy after the max time of the operation a time out error is issued
+* The wait counts as WaitReadyPhase up to the deadlines the coroutine sleeps until, the time it is resumed later counts as QueuedPhase
+*/
+ProgramTask AsyncWaitForFlashReady(ProgramScheduler* scheduler, IceBoard* board, FlashOperationTiming timing)
+{
+    typedef ProgramScheduler::Clock Clock;
+
+    FT4222_STATUS status;
+
+    const Phase previousPhase = EnterPhase(&board->metrics, WaitReadyPhase);
+    const Clock::time_point start = Clock::now();
+    const Clock::time_point deadline = start + std::chrono::microseconds(timing.maxTimeUs);
+    const std::chrono::microseconds maxBackoff(std::max(timing.typicalTimeUs / 2, MIN_ASYNC_POLL_INTERVAL_US));
+    std::chrono::microseconds backoff(std::max(timing.typicalTimeUs / 16, MIN_ASYNC_POLL_INTERVAL_US));
+    uint8 statusRegister;
+
+    co_await scheduler->SleepUntil(start + std::chrono::microseconds(timing.typicalTimeUs), &board->metrics);
+
+    for (;;)
+    {
+        status = ReadStatusFlash(board, &statusRegister, 1);
+        if (status != FT4222_OK)
+            break;
+
+        if ((statusRegister & 0x01) == 0x00)
+        {
+            TraceFlashBusy(board, start, Clock::now());
+            break;
+        }
+
+        Clock::time_point now = Clock::now();
+        if (now >= deadline)
+        {
+            status = FT4222_TIME_OUT_ERROR;
+            break;
+        }
+
+        co_await scheduler->SleepUntil(std::min(now + backoff, deadline), &board->metrics);
+        backoff = std::min(backoff * 2, maxBackoff);
+    }
+
+    LeavePhase(&board->metrics, previousPhase);
+    co_return status;
+}
+
+/*
+* Erases all sectors overlapping startAddress to endAddress (exclusive) with the plan from PlanEraseFlash, see EraseRangeFlash
+*/
+ProgramTask AsyncEraseRangeFlash(ProgramScheduler* scheduler, IceBoard* board, int startAddress, int endAddress, bool isChipEraseAllowed)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    std::vector<EraseStep> plan;
+    PlanEraseFlash(board, startAddress, endAddress, isChipEraseAllowed, &plan);
+
+    for (const EraseStep& step : plan)
+    {
+        status = StartEraseBlockFlash(board, step.eraseType, step.address);
+        if (status != FT4222_OK)
+            co_return status;
+
+        status = co_await AsyncWaitForFlashReady(scheduler, board, step.eraseType.timing);
+        if (status != FT4222_OK)
+            co_return status;
+    }
+
+    co_return status;
+}
+
+/*
+* Programs the pages of the sector that NextPageFlash selects with isMismatchOnly, waiting for every page program without blocking the scheduler
+*/
+static ProgramTask AsyncProgramPagesFlash(ProgramScheduler* scheduler, IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer, bool isMismatchOnly)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    PageWrite pageWrite;
+    for (int pageCursor = 0; NextPageFlash(board, sectorIndex, sectorBuffer, isMismatchOnly, &pageCursor, &pageWrite); )
+    {
+        status = StartPageProgramFlash(board, pageWrite.pageIndex, pageWrite.pageOffset, pageWrite.writeBuffer);
+        if (status != FT4222_OK)
+            co_return status;
+
+        status = co_await AsyncWaitForFlashReady(scheduler, board, GetFlashDescriptor(board).pageProgramTiming);
+        if (status != FT4222_OK)
+            co_return status;
+    }
+
+    co_return status;
+}
+
+/*
+* Programs one erased sector given by the sectorIndex with the content of the sectorBuffer, see SectorProgramFlash
+*/
+ProgramTask AsyncSectorProgramFlash(ProgramScheduler* scheduler, IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer)
+{
+    return AsyncProgramPagesFlash(scheduler, board, sectorIndex, sectorBuffer, false);
+}
+
+/*
+* Programs the pages of the sector marked in the mismatchPages of the transfer arena again, see ReprogramPagesFlash
+*/
+ProgramTask AsyncReprogramPagesFlash(ProgramScheduler* scheduler, IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer)
+{
+    return AsyncProgramPagesFlash(scheduler, board, sectorIndex, sectorBuffer, true);
+}
+
+/*
+* Retries a sector that did not verify after it was programmed the first time, as PlanSectorRetryFlash decides, see VerifiedSectorProgramFlash
+* Gives up once the sector was programmed MAX_SECTOR_PROGRAM_ATTEMPTS times in all
+*/
+static ProgramTask AsyncRetrySectorFlash(ProgramScheduler* scheduler, IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    const int sectorSize = GetFlashDescriptor(board).sectorSize;
+    bool isProgrammed;
+    SectorRetryAction retryAction;
+
+    for (int attempts = 0; attempts < MAX_SECTOR_PROGRAM_ATTEMPTS; attempts++)
+    {
+        status = PlanSectorRetryFlash(board, sectorIndex, sectorBuffer, attempts, &retryAction);
+        if (status != FT4222_OK)
+            co_return status;
+
+        if (retryAction == EraseSectorRetry)
+        {
+            status = co_await AsyncEraseRangeFlash(scheduler, board, sectorIndex * sectorSize, (sectorIndex + 1) * sectorSize, false);
+            if (status != FT4222_OK)
+                co_return status;
+        }
+
+        if (attempts + 1 == MAX_SECTOR_PROGRAM_ATTEMPTS)
+            break;
+
+        if (retryAction == EraseSectorRetry)
+            status = co_await AsyncSectorProgramFlash(scheduler, board, sectorIndex, sectorBuffer);
+        else
+            status = co_await AsyncReprogramPagesFlash(scheduler, board, sectorIndex, sectorBuffer);
+        if (status != FT4222_OK)
+            co_return status;
+
+        status = ReadBackSectorFlash(board, sectorIndex, sectorBuffer, &isProgrammed);
+        if (status != FT4222_OK || isProgrammed)
+            co_return status;
+    }
+
+    co_return FT4222_CORRUPTED_UPLOAD;
+}
+
+/*
+* Programs one erased sector and reads it back, a corrupted sector is retried by AsyncRetrySectorFlash, see VerifiedSectorProgramFlash
+* The retry counts as RetryPhase, entered and left explicitly as a PhaseTimer can not live across the suspensions of the retry
+*/
+ProgramTask AsyncVerifiedSectorProgramFlash(ProgramScheduler* scheduler, IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    bool isProgrammed;
+
+    status = co_await AsyncSectorProgramFlash(scheduler, board, sectorIndex, sectorBuffer);
+    if (status != FT4222_OK || board->verifyPolicy != InlineVerify)
+        co_return status;
+
+    status = ReadBackSectorFlash(board, sectorIndex, sectorBuffer, &isProgrammed);
+    if (status != FT4222_OK || isProgrammed)
+        co_return status;
+
+    const Phase previousPhase = EnterPhase(&board->metrics, RetryPhase);
+    status = co_await AsyncRetrySectorFlash(scheduler, board, sectorIndex, sectorBuffer);
+    LeavePhase(&board->metrics, previousPhase);
+
+    co_return status;
+}
+
+/*
+* Programs the content of the fileBuffer to the erased flash, see ProgramFlash
+* Other boards get a turn after every sector
+*/
+ProgramTask AsyncProgramFlash(ProgramScheduler* scheduler, IceBoard* board, std::span<const uint8> fileBuffer)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    int sectorCount = 1 + (((int)fileBuffer.size() - 1) / GetFlashDescriptor(board).sectorSize);
+
+    for (int i = 0; i < sectorCount; i++)
+    {
+        status = co_await AsyncVerifiedSectorProgramFlash(scheduler, board, i, ExtractSector(board, fileBuffer, i));
+        if (status != FT4222_OK)
+            co_return status;
+
+        co_await scheduler->Yield(&board->metrics);
+    }
+
+    co_return status;
+}
+
+/*
+* Erases and programs only the sectors whose content differs from fileBuffer, see DiffProgramFlash
+* changedSectorCount receives the number of sectors that were reprogrammed
+*/
+ProgramTask AsyncDiffProgramFlash(ProgramScheduler* scheduler, IceBoard* board, std::span<const uint8> fileBuffer, int* changedSectorCount)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    std::vector<int> changedSectors;
+    const int sectorSize = GetFlashDescriptor(board).sectorSize;
+
+    status = FindChangedSectorsFlash(board, fileBuffer, &changedSectors);
+    if (status != FT4222_OK)
+        co_return status;
+
+    for (size_t runStart = 0; runStart < changedSectors.size(); )
+    {
+        size_t runEnd = FindSectorRunEnd(changedSectors, runStart);
+
+        status = co_await AsyncEraseRangeFlash(scheduler, board, changedSectors[runStart] * sectorSize, (changedSectors[runEnd - 1] + 1) * sectorSize, false);
+        if (status != FT4222_OK)
+            co_return status;
+
+        for (size_t i = runStart; i < runEnd; i++)
+        {
+            status = co_await AsyncVerifiedSectorProgramFlash(scheduler, board, changedSectors[i], ExtractSector(board, fileBuffer, changedSectors[i]));
+            if (status != FT4222_OK)
+                co_return status;
+
+            co_await scheduler->Yield(&board->metrics);
+        }
+
+        runStart = runEnd;
+    }
+
+    *changedSectorCount = (int)changedSectors.size();
+    co_return status;
+}
+
+/*
+* Checks the programmed image as selected by the verify policy of the board, see VerifyFlash
+* Other boards get a turn after every read step, so their flashes keep programming while this one is read back
+*/
+ProgramTask AsyncVerifyFlash(ProgramScheduler* scheduler, IceBoard* board, std::span<const uint8> fileBuffer)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    VerifyProgress progress;
+    bool isDone = false;
+
+    while (!isDone)
+    {
+        status = VerifyStepFlash(board, fileBuffer, &progress, &isDone);
+        if (status != FT4222_OK)
+            co_return status;
+
+        if (!isDone)
+            co_await scheduler->Yield(&board->metrics);
+    }
+
+    co_return status;
+}
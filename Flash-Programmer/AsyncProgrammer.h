@@ -0,0 +1,135 @@
+/*
+* Coroutine versions of the programming functions in IceBoard.cpp, driven by one scheduler thread for any number of boards
+* Every transfer is still a blocking LibFT4222 call, but where the synchronous functions sleep or poll while a flash is busy
+* the coroutine is suspended until its deadline and the scheduler resumes another board in the meantime
+*/
+
+#pragma once
+#include <vector>
+#include <queue>
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include "IceBoard.h"
+
+const int MIN_ASYNC_POLL_INTERVAL_US = 100;     // Shortest time between two status polls of a busy flash
+
+/*
+* Result of a coroutine that returns an FT4222_STATUS
+* The coroutine starts suspended, it runs when it is awaited by another one or spawned on a ProgramScheduler
+*/
+class ProgramTask
+{
+public:
+    struct promise_type
+    {
+        // Resumes the awaiting coroutine when this one is done, a spawned coroutine returns to the scheduler
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+            {
+                std::coroutine_handle<> continuation = handle.promise().continuation;
+                return continuation ? continuation : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+
+        FT4222_STATUS result = FT4222_OK;
+        std::coroutine_handle<> continuation;
+
+        ProgramTask get_return_object() { return ProgramTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_value(FT4222_STATUS status) { result = status; }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    // Runs the awaited coroutine right away and returns its status to the awaiting one
+    struct Awaiter
+    {
+        std::coroutine_handle<promise_type> handle;
+
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+        {
+            handle.promise().continuation = awaiting;
+            return handle;
+        }
+        FT4222_STATUS await_resume() noexcept { return handle.promise().result; }
+    };
+
+    explicit ProgramTask(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    ProgramTask(ProgramTask&& other) noexcept : handle(other.handle) { other.handle = nullptr; }
+    ProgramTask(const ProgramTask&) = delete;
+    ProgramTask& operator=(const ProgramTask&) = delete;
+    ~ProgramTask()
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    Awaiter operator co_await() noexcept { return { handle }; }
+
+    std::coroutine_handle<> Handle() const { return handle; }
+    bool IsDone() const { return handle.done(); }
+    FT4222_STATUS Result() const { return handle.promise().result; }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+/*
+* Resumes suspended coroutines on the thread that calls Run, in the order of their deadlines
+* Coroutines with the same deadline are resumed in the order they were suspended
+*/
+class ProgramScheduler
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // Suspends the awaiting coroutine until deadline, the time it is resumed late is charged to the QueuedPhase of metrics
+    struct SleepAwaiter
+    {
+        ProgramScheduler* scheduler;
+        Clock::time_point deadline;
+        BoardMetrics* metrics;
+
+        bool await_ready() noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { scheduler->Schedule(handle, deadline); }
+        void await_resume() noexcept { ChargeQueuedTime(metrics, deadline); }
+    };
+
+    void Spawn(ProgramTask& task);
+    void Run();
+
+    SleepAwaiter SleepUntil(Clock::time_point deadline, BoardMetrics* metrics) { return { this, deadline, metrics }; }
+    SleepAwaiter Yield(BoardMetrics* metrics) { return { this, Clock::now(), metrics }; }
+
+private:
+    struct Timer
+    {
+        Clock::time_point deadline;
+        unsigned long long sequence;
+        std::coroutine_handle<> handle;
+
+        bool operator>(const Timer& other) const
+        {
+            return deadline != other.deadline ? deadline > other.deadline : sequence > other.sequence;
+        }
+    };
+
+    void Schedule(std::coroutine_handle<> handle, Clock::time_point deadline);
+
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+    unsigned long long sequence = 0;
+};
+
+ProgramTask AsyncWaitForFlashReady(ProgramScheduler* scheduler, IceBoard* board, FlashOperationTiming timing);
+ProgramTask AsyncEraseRangeFlash(ProgramScheduler* scheduler, IceBoard* board, int startAddress, int endAddress, bool isChipEraseAllowed);
+ProgramTask AsyncSectorProgramFlash(ProgramScheduler* scheduler, IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer);
+ProgramTask AsyncReprogramPagesFlash(ProgramScheduler* scheduler, IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer);
+ProgramTask AsyncVerifiedSectorProgramFlash(ProgramScheduler* scheduler, IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer);
+ProgramTask AsyncProgramFlash(ProgramScheduler* scheduler, IceBoard* board, std::span<const uint8> fileBuffer);
+ProgramTask AsyncDiffProgramFlash(ProgramScheduler* scheduler, IceBoard* board, std::span<const uint8> fileBuffer, int* changedSectorCount);
+ProgramTask AsyncVerifyFlash(ProgramScheduler* scheduler, IceBoard* board, std::span<const uint8> fileBuffer);
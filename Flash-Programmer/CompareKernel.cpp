@@ -0,0 +1,213 @@
+#include <algorithm>
+#include "CompareKernel.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define COMPARE_KERNEL_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define AVX2_TARGET                                 // MSVC compiles AVX2 intrinsics without a compiler switch
+#else
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+/*
+* Every kernel compares actual with expected block by block, setting the bit of every block that differs in mismatchBlocks
+* offset is the position of actual in the compared area, see CompareImage
+* Returns the index in actual of the start of the first block that differs, or size if all blocks are equal
+* The vectors of a block are compared without an early exit, a block is a page and almost always equal
+* Block boundaries are stepped through without a division per block, which would cost as much as comparing the block
+*/
+typedef size_t (*CompareBlocksFunction)(const uint8* actual, const uint8* expected, size_t size, size_t offset, size_t blockSize, unsigned long long* mismatchBlocks);
+
+static void MarkMismatch(size_t blockIndex, unsigned long long* mismatchBlocks)
+{
+    mismatchBlocks[blockIndex / 64] |= 1ULL << (blockIndex % 64);
+}
+
+static size_t ScalarCompareBlocks(const uint8* actual, const uint8* expected, size_t size, size_t offset, size_t blockSize, unsigned long long* mismatchBlocks)
+{
+    size_t firstMismatch = size;
+
+    size_t blockIndex = offset / blockSize;
+    size_t last = std::min(size, (blockIndex + 1) * blockSize - offset);
+
+    for (size_t first = 0; first < size; first = last, last = std::min(size, last + blockSize), blockIndex++)
+    {
+        for (size_t i = first; i < last; i++)
+        {
+            if (actual[i] != expected[i])
+            {
+                MarkMismatch(blockIndex, mismatchBlocks);
+                firstMismatch = std::min(firstMismatch, first);
+                break;
+            }
+        }
+    }
+
+    return firstMismatch;
+}
+
+#ifdef COMPARE_KERNEL_X86
+
+static size_t Sse2CompareBlocks(const uint8* actual, const uint8* expected, size_t size, size_t offset, size_t blockSize, unsigned long long* mismatchBlocks)
+{
+    size_t firstMismatch = size;
+
+    size_t blockIndex = offset / blockSize;
+    size_t last = std::min(size, (blockIndex + 1) * blockSize - offset);
+
+    for (size_t first = 0; first < size; first = last, last = std::min(size, last + blockSize), blockIndex++)
+    {
+        size_t i = first;
+        __m128i equal0 = _mm_set1_epi8(-1);
+        __m128i equal1 = _mm_set1_epi8(-1);
+        bool isDifferent = false;
+
+        // Two accumulators so that consecutive compares do not wait for each other
+        for (; i + 32 <= last; i += 32)
+        {
+            equal0 = _mm_and_si128(equal0, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(actual + i)), _mm_loadu_si128((const __m128i*)(expected + i))));
+            equal1 = _mm_and_si128(equal1, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(actual + i + 16)), _mm_loadu_si128((const __m128i*)(expected + i + 16))));
+        }
+        for (; i < last; i++)
+            isDifferent |= actual[i] != expected[i];
+
+        if (isDifferent || _mm_movemask_epi8(_mm_and_si128(equal0, equal1)) != 0xFFFF)
+        {
+            MarkMismatch(blockIndex, mismatchBlocks);
+            firstMismatch = std::min(firstMismatch, first);
+        }
+    }
+
+    return firstMismatch;
+}
+
+AVX2_TARGET static size_t Avx2CompareBlocks(const uint8* actual, const uint8* expected, size_t size, size_t offset, size_t blockSize, unsigned long long* mismatchBlocks)
+{
+    size_t firstMismatch = size;
+
+    size_t blockIndex = offset / blockSize;
+    size_t last = std::min(size, (blockIndex + 1) * blockSize - offset);
+
+    for (size_t first = 0; first < size; first = last, last = std::min(size, last + blockSize), blockIndex++)
+    {
+        size_t i = first;
+        __m256i difference0 = _mm256_setzero_si256();
+        __m256i difference1 = _mm256_setzero_si256();
+        bool isDifferent = false;
+
+        // Two accumulators so that consecutive compares do not wait for each other
+        for (; i + 64 <= last; i += 64)
+        {
+            difference0 = _mm256_or_si256(difference0, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(actual + i)), _mm256_loadu_si256((const __m256i*)(expected + i))));
+            difference1 = _mm256_or_si256(difference1, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(actual + i + 32)), _mm256_loadu_si256((const __m256i*)(expected + i + 32))));
+        }
+        for (; i < last; i++)
+            isDifferent |= actual[i] != expected[i];
+
+        const __m256i difference = _mm256_or_si256(difference0, difference1);
+        if (isDifferent || !_mm256_testz_si256(difference, difference))
+        {
+            MarkMismatch(blockIndex, mismatchBlocks);
+            firstMismatch = std::min(firstMismatch, first);
+        }
+    }
+
+    return firstMismatch;
+}
+
+/*
+* AVX2 needs support by the CPU and the OS saving the upper halves of the YMM registers
+*/
+static bool IsAvx2Supported()
+{
+#if defined(_MSC_VER)
+    int info[4];
+
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+
+    __cpuid(info, 1);
+    const bool isOsSaved = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 0x06) == 0x06;
+
+    __cpuidex(info, 7, 0);
+    return isOsSaved && (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+static bool IsKernelSupported(CompareKernel kernel)
+{
+#ifdef COMPARE_KERNEL_X86
+    return kernel != Avx2CompareKernel || IsAvx2Supported();
+#else
+    return kernel == ScalarCompareKernel;
+#endif
+}
+
+static CompareBlocksFunction KernelFunction(CompareKernel kernel)
+{
+#ifdef COMPARE_KERNEL_X86
+    if (kernel == Avx2CompareKernel)
+        return Avx2CompareBlocks;
+    if (kernel == Sse2CompareKernel)
+        return Sse2CompareBlocks;
+#endif
+    return ScalarCompareBlocks;
+}
+
+static CompareKernel FastestKernel()
+{
+    if (IsKernelSupported(Avx2CompareKernel))
+        return Avx2CompareKernel;
+    if (IsKernelSupported(Sse2CompareKernel))
+        return Sse2CompareKernel;
+    return ScalarCompareKernel;
+}
+
+// Only written by SetCompareKernel, which is never called while other threads compare
+static CompareKernel selectedKernel = FastestKernel();
+static CompareBlocksFunction compareBlocks = KernelFunction(selectedKernel);
+
+size_t CompareImage(std::span<const uint8> actual, std::span<const uint8> expected, size_t offset, size_t blockSize, std::span<unsigned long long> mismatchBlocks)
+{
+    const size_t firstMismatchBlock = compareBlocks(actual.data(), expected.data(), actual.size(), offset, blockSize, mismatchBlocks.data());
+    if (firstMismatchBlock == actual.size())
+        return actual.size();
+
+    return std::mismatch(actual.begin() + firstMismatchBlock, actual.end(), expected.begin() + firstMismatchBlock).first - actual.begin();
+}
+
+bool SetCompareKernel(CompareKernel kernel)
+{
+    if (!IsKernelSupported(kernel))
+        return false;
+
+    selectedKernel = kernel;
+    compareBlocks = KernelFunction(kernel);
+    return true;
+}
+
+CompareKernel GetCompareKernel()
+{
+    return selectedKernel;
+}
+
+const char* CompareKernelName(CompareKernel kernel)
+{
+    switch (kernel)
+    {
+    case Avx2CompareKernel:
+        return "avx2";
+    case Sse2CompareKernel:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
@@ -0,0 +1,33 @@
+/*
+* Compares data read back from the flash with the image it should hold
+* The comparison runs on AVX2 or SSE2 when the CPU has them, chosen once at runtime, and byte by byte otherwise
+*/
+
+#pragma once
+#include <span>
+#include "ftd2xx.h"
+#include "LibFT4222.h"
+
+enum CompareKernel
+{
+    ScalarCompareKernel,    // Byte by byte, works on every CPU
+    Sse2CompareKernel,      // 16 bytes at a time, every x64 CPU has SSE2
+    Avx2CompareKernel       // 32 bytes at a time
+};
+
+/*
+* Compares actual with the same number of bytes of expected
+* offset is the position of actual in the compared area, which is divided in blocks of blockSize bytes (usually pages) starting at its beginning
+* The bit of every block with a difference is set in mismatchBlocks, bit i % 64 of word i / 64 for block i, the bits of the other blocks are left as they are
+* Returns the index in actual of the first differing byte, or actual.size() if all bytes are equal
+*/
+size_t CompareImage(std::span<const uint8> actual, std::span<const uint8> expected, size_t offset, size_t blockSize, std::span<unsigned long long> mismatchBlocks);
+
+/*
+* Selects the kernel used by CompareImage, returns false and keeps the current one if the CPU does not support kernel
+* The fastest supported kernel is selected at startup, other kernels are only selected to benchmark them
+* Not synchronized, may only be called before the threads that program or verify boards are started
+*/
+bool SetCompareKernel(CompareKernel kernel);
+CompareKernel GetCompareKernel();
+const char* CompareKernelName(CompareKernel kernel);
@@ -0,0 +1,291 @@
+#include <algorithm>
+#include "FlashDescriptor.h"
+#include "IceBoard.h"
+
+/*
+* Flashes the programmer knows without reading SFDP, the first entry is used when nothing better is known
+* Dummy cycles of the read commands are sent as 0xFF bytes (8 cycles per byte on one line, 2 per byte on four lines)
+*/
+const std::vector<FlashDescriptor>& KnownFlashParts()
+{
+    static const std::vector<FlashDescriptor> knownFlashParts =
+    {
+        // Small flash as fitted to the Ice Board
+        {
+            "generic", { 0x00, 0x00, 0x00 }, FLASH_SIZE, FLASH_PAGE_SIZE, FLASH_SECTOR_SIZE,
+            {
+                { SectorEraseCmd, FLASH_SECTOR_SIZE, { 45000, 400000 } },       // tSE
+                { BlockErase32Cmd, FLASH_BLOCK32_SIZE, { 120000, 1600000 } },   // tBE1
+                { BlockErase64Cmd, FLASH_BLOCK64_SIZE, { 150000, 2000000 } },   // tBE2
+                { 0, 0, { 0, 0 } }
+            },
+            { ChipEraseCmd, FLASH_SIZE, { 500000, 10000000 } },                 // tCE
+            { 700, 5000 },                                                      // tPP
+            { 10000, 50000 },                                                   // tW
+            {
+                { true, ReadCmd,            SPI_IO_SINGLE,  4, 0 },
+                { true, FastReadCmd,        SPI_IO_SINGLE,  5, 0 },
+                { true, DualOutputReadCmd,  SPI_IO_DUAL,    5, 0 },
+                { true, QuadOutputReadCmd,  SPI_IO_QUAD,    5, 0 },
+                { true, QuadIOReadCmd,      SPI_IO_QUAD,    1, 6 }
+            },
+            QuadEnableStatus2Bit1
+        },
+        // Winbond W25Q32JV, where a chip erase takes longer than erasing the whole flash block by block
+        {
+            "w25q", { 0xEF, 0x40, 0x16 }, 4194304, 256, 4096,
+            {
+                { SectorEraseCmd, 4096, { 45000, 400000 } },
+                { BlockErase32Cmd, 32768, { 120000, 1600000 } },
+                { BlockErase64Cmd, 65536, { 150000, 2000000 } },
+                { 0, 0, { 0, 0 } }
+            },
+            { ChipEraseCmd, 4194304, { 10000000, 50000000 } },
+            { 400, 3000 },
+            { 10000, 15000 },
+            {
+                { true, ReadCmd,            SPI_IO_SINGLE,  4, 0 },
+                { true, FastReadCmd,        SPI_IO_SINGLE,  5, 0 },
+                { true, DualOutputReadCmd,  SPI_IO_DUAL,    5, 0 },
+                { true, QuadOutputReadCmd,  SPI_IO_QUAD,    5, 0 },
+                { true, QuadIOReadCmd,      SPI_IO_QUAD,    1, 6 }
+            },
+            QuadEnableStatus2Bit1
+        }
+    };
+
+    return knownFlashParts;
+}
+
+/*
+* Descriptor used until a flash has been detected
+*/
+const FlashDescriptor& DefaultFlashDescriptor()
+{
+    return KnownFlashParts()[0];
+}
+
+/*
+* Returns the known part called name, or nullptr if there is none
+*/
+const FlashDescriptor* FindKnownFlashPart(const std::string& name)
+{
+    for (const FlashDescriptor& flashPart : KnownFlashParts())
+    {
+        if (flashPart.name == name)
+            return &flashPart;
+    }
+    return nullptr;
+}
+
+/*
+* Returns the known part with the given JEDEC ID, or nullptr if there is none
+*/
+const FlashDescriptor* FindKnownFlashPart(const uint8 jedecId[3])
+{
+    for (const FlashDescriptor& flashPart : KnownFlashParts())
+    {
+        if (std::equal(jedecId, jedecId + 3, flashPart.jedecId))
+            return &flashPart;
+    }
+    return nullptr;
+}
+
+/*
+* Returns DWORD number index (counted from 1, as in JESD216) of an SFDP parameter table
+*/
+static uint32 Dword(const std::vector<uint8>& table, int index)
+{
+    int offset = (index - 1) * 4;
+    return table[offset] | (table[offset + 1] << 8) | (table[offset + 2] << 16) | ((uint32)table[offset + 3] << 24);
+}
+
+/*
+* Decodes an SFDP time field: a 5-bit count followed by a units field selecting one of units (in microseconds)
+*/
+static int DecodeSfdpTime(uint32 field, int unitBits, const int* units)
+{
+    int count = field & 0x1F;
+    int unit = (field >> 5) & ((1 << unitBits) - 1);
+    return (count + 1) * units[unit];
+}
+
+/*
+* Builds the read command for an x-y-z read mode from the mode and dummy clocks SFDP gives for it
+* Returns a command that is not supported if the clocks can not be sent as whole bytes
+*/
+static FlashReadCommand SfdpReadCommand(uint8 opcode, FT4222_SPIMode spiLines, bool isAddressOnDataLines, int waitClocks)
+{
+    FlashReadCommand command = { false, opcode, spiLines, 0, 0 };
+
+    if (isAddressOnDataLines)
+    {
+        // Command on one line, then address, mode and dummy clocks on all lines
+        if ((waitClocks * spiLines) % 8 != 0)
+            return command;
+        command.singleWriteBytes = 1;
+        command.multiWriteBytes = 3 + waitClocks * spiLines / 8;
+    }
+    else if (waitClocks % 8 == 0)
+    {
+        // Mode and dummy clocks on one line after the address
+        command.singleWriteBytes = 4 + waitClocks / 8;
+    }
+    else
+    {
+        // Mode and dummy clocks on the data lines, the flash ignores what it receives during them
+        if ((waitClocks * spiLines) % 8 != 0)
+            return command;
+        command.singleWriteBytes = 4;
+        command.multiWriteBytes = waitClocks * spiLines / 8;
+    }
+
+    command.isSupported = true;
+    return command;
+}
+
+/*
+* Returns the number of bytes the SFDP header at the start of sfdpHeader and the parameter headers following it take
+* Returns 0 if the flash does not answer with a valid SFDP header
+*/
+int SfdpHeadersSize(const std::vector<uint8>& sfdpHeader)
+{
+    if (sfdpHeader.size() < SFDP_HEADER_SIZE || Dword(sfdpHeader, 1) != SFDP_SIGNATURE)
+        return 0;
+
+    // Byte 6 holds the number of parameter headers - 1
+    return SFDP_HEADER_SIZE * (sfdpHeader[6] + 2);
+}
+
+/*
+* Finds the JEDEC Basic Flash Parameter Table in the SFDP header and the parameter headers that follow it
+* sfdpHeaders must start at SFDP address 0 and contain all parameter headers
+* Returns false if there is no such table
+*/
+bool FindBasicFlashParameterTable(const std::vector<uint8>& sfdpHeaders, int* tableAddress, int* tableSize)
+{
+    if (SfdpHeadersSize(sfdpHeaders) == 0)
+        return false;
+
+    int parameterHeaderCount = sfdpHeaders[6] + 1;
+    for (int i = 0; i < parameterHeaderCount; i++)
+    {
+        size_t header = SFDP_HEADER_SIZE * (i + 1);
+        if (header + SFDP_HEADER_SIZE > sfdpHeaders.size())
+            return false;
+
+        // The Basic Flash Parameter Table has ID 0xFF00, the MSB is in the last byte of the header
+        if (sfdpHeaders[header] == 0x00 && sfdpHeaders[header + 7] == 0xFF)
+        {
+            *tableSize = sfdpHeaders[header + 3] * 4;
+            *tableAddress = sfdpHeaders[header + 4] | (sfdpHeaders[header + 5] << 8) | (sfdpHeaders[header + 6] << 16);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+* Fills descriptor with what the Basic Flash Parameter Table (JESD216) describes
+* Fields the table does not cover, e.g. the times of JESD216 (rev 1.0) tables with only 9 DWORDs, are left as they are
+*/
+void ParseBasicFlashParameterTable(const std::vector<uint8>& table, FlashDescriptor* descriptor)
+{
+    const int dwordCount = (int)table.size() / 4;
+    if (dwordCount < 9)
+        return;
+
+    // Density is given in bits, either as size - 1 or as a power of two
+    uint32 density = Dword(table, 2);
+    long long sizeBits = (density & 0x80000000) != 0 ? 1LL << std::min(density & 0x7FFFFFFF, 40u) : (long long)density + 1;
+    descriptor->size = (int)std::min(sizeBits / 8, (long long)MAX_FLASH_SIZE);
+    descriptor->chipErase.size = descriptor->size;
+
+    // Read commands with their mode and dummy clocks
+    uint32 features = Dword(table, 1);
+    uint32 quadReads = Dword(table, 3);
+    uint32 dualReads = Dword(table, 4);
+    descriptor->readCommands[DualOutputReadMode].isSupported = false;
+    descriptor->readCommands[QuadOutputReadMode].isSupported = false;
+    descriptor->readCommands[QuadIOReadMode].isSupported = false;
+    if ((features & (1 << 16)) != 0)
+        descriptor->readCommands[DualOutputReadMode] = SfdpReadCommand((dualReads >> 8) & 0xFF, SPI_IO_DUAL, false, (dualReads & 0x1F) + ((dualReads >> 5) & 0x07));
+    if ((features & (1 << 22)) != 0)
+        descriptor->readCommands[QuadOutputReadMode] = SfdpReadCommand(quadReads >> 24, SPI_IO_QUAD, false, ((quadReads >> 16) & 0x1F) + ((quadReads >> 21) & 0x07));
+    if ((features & (1 << 21)) != 0)
+        descriptor->readCommands[QuadIOReadMode] = SfdpReadCommand((quadReads >> 8) & 0xFF, SPI_IO_QUAD, true, (quadReads & 0x1F) + ((quadReads >> 5) & 0x07));
+
+    // Erase types, DWORD 10 holds their times from JESD216A on
+    const int eraseUnitsUs[] = { 1000, 16000, 128000, 1000000 };
+    FlashEraseType eraseTypes[MAX_ERASE_TYPES] = {};
+    int eraseTypeCount = 0;
+    for (int i = 0; i < MAX_ERASE_TYPES; i++)
+    {
+        uint16 eraseField = (uint16)(Dword(table, 8 + i / 2) >> (16 * (i % 2)));
+        int sizeExponent = eraseField & 0xFF;
+        if (sizeExponent == 0 || sizeExponent > 24)
+            continue;
+
+        FlashEraseType& eraseType = eraseTypes[eraseTypeCount++];
+        eraseType.opcode = eraseField >> 8;
+        eraseType.size = 1 << sizeExponent;
+        // Without DWORD 10 the times of a known erase of the same size are used, an erase never takes longer than a chip erase
+        eraseType.timing = descriptor->chipErase.timing;
+        for (const FlashEraseType& knownType : descriptor->eraseTypes)
+        {
+            if (knownType.size == eraseType.size)
+                eraseType.timing = knownType.timing;
+        }
+
+        if (dwordCount >= 11)
+        {
+            uint32 eraseTimes = Dword(table, 10);
+            int maxMultiplier = 2 * ((eraseTimes & 0x0F) + 1);
+            eraseType.timing.typicalTimeUs = DecodeSfdpTime(eraseTimes >> (4 + 7 * i), 2, eraseUnitsUs);
+            eraseType.timing.maxTimeUs = eraseType.timing.typicalTimeUs * maxMultiplier;
+        }
+    }
+    if (eraseTypeCount > 0)
+    {
+        std::stable_sort(eraseTypes, eraseTypes + eraseTypeCount, [](const FlashEraseType& a, const FlashEraseType& b) { return a.size < b.size; });
+        std::copy(eraseTypes, eraseTypes + MAX_ERASE_TYPES, descriptor->eraseTypes);
+        descriptor->sectorSize = eraseTypes[0].size;
+    }
+
+    // Page size, page program and chip erase times
+    if (dwordCount >= 11)
+    {
+        uint32 programTimes = Dword(table, 11);
+        int maxMultiplier = 2 * ((programTimes & 0x0F) + 1);
+        const int programUnitsUs[] = { 8, 64 };
+        const int chipEraseUnitsUs[] = { 16000, 256000, 4000000, 64000000 };
+
+        descriptor->pageSize = 1 << ((programTimes >> 4) & 0x0F);
+        descriptor->pageProgramTiming.typicalTimeUs = DecodeSfdpTime(programTimes >> 8, 1, programUnitsUs);
+        descriptor->pageProgramTiming.maxTimeUs = descriptor->pageProgramTiming.typicalTimeUs * maxMultiplier;
+        descriptor->chipErase.timing.typicalTimeUs = DecodeSfdpTime(programTimes >> 24, 2, chipEraseUnitsUs);
+        descriptor->chipErase.timing.maxTimeUs = (int)std::min((long long)descriptor->chipErase.timing.typicalTimeUs * maxMultiplier, 2000000000LL);
+    }
+
+    // Quad Enable requirements, methods the programmer can not set are left as they are
+    if (dwordCount >= 15)
+    {
+        switch ((Dword(table, 15) >> 20) & 0x07)
+        {
+        case 0:
+            descriptor->quadEnable = NoQuadEnableBit;
+            break;
+        case 1:
+        case 4:
+        case 5:
+            descriptor->quadEnable = QuadEnableStatus2Bit1;
+            break;
+        case 2:
+            descriptor->quadEnable = QuadEnableStatus1Bit6;
+            break;
+        default:
+            break;
+        }
+    }
+}
@@ -0,0 +1,83 @@
+/*
+* Describes the flash on the board: its size, page and erase geometry, busy times, read commands and Quad Enable bit
+* The programming, erase planning and status polling functions in IceBoard.cpp are driven by the descriptor that is active
+* A descriptor is built at startup from the JEDEC ID and SFDP tables of the flash or taken from the table of known parts
+*/
+
+#pragma once
+#include <vector>
+#include <string>
+#include "ftd2xx.h"
+#include "LibFT4222.h"
+
+// Command used to read from the flash
+enum FlashReadMode
+{
+    SingleReadMode,         // 0x03, 1 data line, no dummy cycles, lowest clock rate on most flashes
+    FastReadMode,           // 0x0B, 1 data line, 8 dummy cycles
+    DualOutputReadMode,     // 0x3B, command and address on 1 line, 8 dummy cycles, data on 2 lines
+    QuadOutputReadMode,     // 0x6B, command and address on 1 line, 8 dummy cycles, data on 4 lines
+    QuadIOReadMode,         // 0xEB, command on 1 line, address, mode byte, 4 dummy cycles and data on 4 lines
+    FlashReadModeCount      // Number of read modes, not a read mode
+};
+
+// Where a flash keeps the Quad Enable (QE) bit that must be set before IO2 and IO3 can be used for data
+enum QuadEnableMethod
+{
+    NoQuadEnableBit,        // Flash has no QE bit, quad commands are always available
+    QuadEnableStatus1Bit6,  // QE is bit 6 of status register 1 (e.g. Macronix)
+    QuadEnableStatus2Bit1   // QE is bit 1 of status register 2, written together with status register 1 (e.g. Winbond)
+};
+
+// Time the flash is busy after an operation, in microseconds
+struct FlashOperationTiming
+{
+    int typicalTimeUs;      // Time the operation usually takes, WaitForFlashReady paces its polling and the erase planner compares erase commands by this
+    int maxTimeUs;          // Time after which WaitForFlashReady gives up
+};
+
+// An erase command and the aligned area it erases
+struct FlashEraseType
+{
+    uint8 opcode;
+    int size;               // Bytes erased, 0 if the entry is not used
+    FlashOperationTiming timing;
+};
+
+// How a read command is sent, dummy cycles are sent as 0xFF bytes (8 cycles per byte on one line, 4 on two lines, 2 on four lines)
+struct FlashReadCommand
+{
+    bool isSupported;
+    uint8 opcode;
+    FT4222_SPIMode spiLines;    // Lines the data is read on
+    int singleWriteBytes;       // Command, address and dummy bytes sent on one line
+    int multiWriteBytes;        // Address, mode and dummy bytes sent on spiLines
+};
+
+const int MAX_ERASE_TYPES = 4;              // Number of erase commands SFDP describes
+const int MAX_FLASH_SIZE = 16777216;        // Largest flash that can be addressed with the 3 address bytes sent in every command
+const int SFDP_HEADER_SIZE = 8;             // Size of the SFDP header and of every parameter header that follows it
+const uint32 SFDP_SIGNATURE = 0x50444653;   // "SFDP" as a little endian 32-bit word
+
+struct FlashDescriptor
+{
+    std::string name;                               // Name of the known part, or the JEDEC ID if the flash was only described by SFDP
+    uint8 jedecId[3];                               // Manufacturer, memory type and capacity
+    int size;                                       // Size of the flash in bytes
+    int pageSize;                                   // Largest number of bytes one page program writes
+    int sectorSize;                                 // Smallest erase size, the image is erased, programmed and verified in units of this
+    FlashEraseType eraseTypes[MAX_ERASE_TYPES];     // Erase commands ordered from the smallest to the largest area
+    FlashEraseType chipErase;
+    FlashOperationTiming pageProgramTiming;
+    FlashOperationTiming writeStatusTiming;
+    FlashReadCommand readCommands[FlashReadModeCount];  // Indexed by FlashReadMode
+    QuadEnableMethod quadEnable;
+};
+
+const std::vector<FlashDescriptor>& KnownFlashParts();
+const FlashDescriptor& DefaultFlashDescriptor();
+const FlashDescriptor* FindKnownFlashPart(const std::string& name);
+const FlashDescriptor* FindKnownFlashPart(const uint8 jedecId[3]);
+int SfdpHeadersSize(const std::vector<uint8>& sfdpHeader);
+bool FindBasicFlashParameterTable(const std::vector<uint8>& sfdpHeaders, int* tableAddress, int* tableSize);
+void ParseBasicFlashParameterTable(const std::vector<uint8>& table, FlashDescriptor* descriptor);
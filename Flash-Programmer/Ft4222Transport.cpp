@@ -0,0 +1,132 @@
+#include "Ft4222Transport.h"
+
+Ft4222Transport::Ft4222Transport(FT_HANDLE handle, FT_HANDLE gpioHandle) :
+    handle(handle),
+    gpioHandle(gpioHandle),
+    divider(CLK_DIV_2),
+    chipSelect(0)
+{
+}
+
+/*
+* Releases the FT4222 and closes the USB connections
+*/
+Ft4222Transport::~Ft4222Transport()
+{
+    if (gpioHandle != nullptr)
+    {
+        FT4222_UnInitialize(gpioHandle);
+        FT_Close(gpioHandle);
+    }
+    FT4222_UnInitialize(handle);
+    FT_Close(handle);
+}
+
+/*
+* SPI mode 3: clock is high when idle and data is shifted out on the trailing edge
+*/
+FT4222_STATUS Ft4222Transport::SetClock(FT4222_ClockRate systemClock, FT4222_SPIClock divider)
+{
+    FT4222_STATUS status = FT4222_SetClock(handle, systemClock);
+    if (status != FT4222_OK)
+        return status;
+
+    this->divider = divider;
+    return FT4222_SPIMaster_Init(handle, SPI_IO_SINGLE, divider, CLK_IDLE_HIGH, CLK_TRAILING, (uint8)(1 << chipSelect));
+}
+
+/*
+* In single mode the slave selects the master drives are fixed by the ssoMap given to FT4222_SPIMaster_Init
+* (FT4222_SPIMaster_SetCS only sets their polarity), so the master is initialized again with the bit of the new slave select
+*/
+FT4222_STATUS Ft4222Transport::SelectChip(int chipIndex)
+{
+    chipSelect = chipIndex;
+    return FT4222_SPIMaster_Init(handle, SPI_IO_SINGLE, divider, CLK_IDLE_HIGH, CLK_TRAILING, (uint8)(1 << chipSelect));
+}
+
+/*
+* LibFT4222 does not change the buffers it sends, it just does not declare them const
+*/
+FT4222_STATUS Ft4222Transport::SingleWrite(const uint8* buffer, uint16 bytesToWrite, uint16* bytesTransferred, bool isEndTransaction)
+{
+    return FT4222_SPIMaster_SingleWrite(handle, const_cast<uint8*>(buffer), bytesToWrite, bytesTransferred, isEndTransaction);
+}
+
+FT4222_STATUS Ft4222Transport::SingleRead(uint8* buffer, uint16 bytesToRead, uint16* bytesRead, bool isEndTransaction)
+{
+    return FT4222_SPIMaster_SingleRead(handle, buffer, bytesToRead, bytesRead, isEndTransaction);
+}
+
+FT4222_STATUS Ft4222Transport::SingleReadWrite(uint8* readBuffer, const uint8* writeBuffer, uint16 bufferSize, uint16* bytesTransferred, bool isEndTransaction)
+{
+    return FT4222_SPIMaster_SingleReadWrite(handle, readBuffer, const_cast<uint8*>(writeBuffer), bufferSize, bytesTransferred, isEndTransaction);
+}
+
+FT4222_STATUS Ft4222Transport::SetLines(FT4222_SPIMode spiLines)
+{
+    return FT4222_SPIMaster_SetLines(handle, spiLines);
+}
+
+FT4222_STATUS Ft4222Transport::MultiReadWrite(uint8* readBuffer, const uint8* writeBuffer, uint8 singleWriteBytes, uint16 multiWriteBytes, uint16 multiReadBytes, uint32* bytesRead)
+{
+    return FT4222_SPIMaster_MultiReadWrite(handle, readBuffer, const_cast<uint8*>(writeBuffer), singleWriteBytes, multiWriteBytes, multiReadBytes, bytesRead);
+}
+
+/*
+* GPIO2 and GPIO3 double as the suspend out and wake up/interrupt pins, both functions are turned off first so the ports can be used
+* All GPIO calls go to the GPIO interface, the SPI interface does not drive the pins
+*/
+FT4222_STATUS Ft4222Transport::InitGpio(const GPIO_Dir directions[4])
+{
+    if (gpioHandle == nullptr)
+        return FT4222_GPIO_NOT_SUPPORTED_IN_THIS_MODE;
+
+    FT4222_STATUS status = FT4222_SetSuspendOut(gpioHandle, FALSE);
+    if (status != FT4222_OK)
+        return status;
+
+    status = FT4222_SetWakeUpInterrupt(gpioHandle, FALSE);
+    if (status != FT4222_OK)
+        return status;
+
+    GPIO_Dir gpioDirections[4] = { directions[0], directions[1], directions[2], directions[3] };
+    return FT4222_GPIO_Init(gpioHandle, gpioDirections);
+}
+
+FT4222_STATUS Ft4222Transport::WriteGpio(GPIO_Port port, bool isHigh)
+{
+    if (gpioHandle == nullptr)
+        return FT4222_GPIO_NOT_SUPPORTED_IN_THIS_MODE;
+
+    return FT4222_GPIO_Write(gpioHandle, port, isHigh ? TRUE : FALSE);
+}
+
+FT4222_STATUS Ft4222Transport::ReadGpio(GPIO_Port port, bool* isHigh)
+{
+    if (gpioHandle == nullptr)
+        return FT4222_GPIO_NOT_SUPPORTED_IN_THIS_MODE;
+
+    BOOL value;
+    FT4222_STATUS status = FT4222_GPIO_Read(gpioHandle, port, &value);
+    *isHigh = value != FALSE;
+    return status;
+}
+
+FT4222_STATUS Ft4222Transport::GetMaxTransferSize(uint16* maxTransferSize)
+{
+    return FT4222_GetMaxTransferSize(handle, maxTransferSize);
+}
+
+/*
+* Both settings belong to the D2XX driver of the FT4222, its status codes are shared with FT4222_STATUS
+* The driver does not support an out transfer size, it is given the same value
+*/
+FT4222_STATUS Ft4222Transport::SetUsbParameters(uint8 latencyTimerMs, DWORD inTransferSize)
+{
+    FT4222_STATUS status = (FT4222_STATUS)FT_SetLatencyTimer(handle, latencyTimerMs);
+    if (status != FT4222_OK)
+        return status;
+
+    return (FT4222_STATUS)FT_SetUSBParameters(handle, inTransferSize, inTransferSize);
+}
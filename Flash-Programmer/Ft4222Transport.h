@@ -0,0 +1,33 @@
+/*
+* SPI transport that talks to the FT4222 IC on a physical Ice Board
+* The FT4222 has a USB interface for its SPI master and, in mode 0, one for its GPIO pins, each with a handle of its own
+*/
+
+#pragma once
+#include "SpiTransport.h"
+
+class Ft4222Transport : public SpiTransport
+{
+public:
+    Ft4222Transport(FT_HANDLE handle, FT_HANDLE gpioHandle);
+    ~Ft4222Transport();
+
+    FT4222_STATUS SetClock(FT4222_ClockRate systemClock, FT4222_SPIClock divider) override;
+    FT4222_STATUS SelectChip(int chipIndex) override;
+    FT4222_STATUS SingleWrite(const uint8* buffer, uint16 bytesToWrite, uint16* bytesTransferred, bool isEndTransaction) override;
+    FT4222_STATUS SingleRead(uint8* buffer, uint16 bytesToRead, uint16* bytesRead, bool isEndTransaction) override;
+    FT4222_STATUS SingleReadWrite(uint8* readBuffer, const uint8* writeBuffer, uint16 bufferSize, uint16* bytesTransferred, bool isEndTransaction) override;
+    FT4222_STATUS SetLines(FT4222_SPIMode spiLines) override;
+    FT4222_STATUS MultiReadWrite(uint8* readBuffer, const uint8* writeBuffer, uint8 singleWriteBytes, uint16 multiWriteBytes, uint16 multiReadBytes, uint32* bytesRead) override;
+    FT4222_STATUS InitGpio(const GPIO_Dir directions[4]) override;
+    FT4222_STATUS WriteGpio(GPIO_Port port, bool isHigh) override;
+    FT4222_STATUS ReadGpio(GPIO_Port port, bool* isHigh) override;
+    FT4222_STATUS GetMaxTransferSize(uint16* maxTransferSize) override;
+    FT4222_STATUS SetUsbParameters(uint8 latencyTimerMs, DWORD inTransferSize) override;
+
+private:
+    FT_HANDLE handle;
+    FT_HANDLE gpioHandle;       // GPIO interface of the same FT4222, nullptr if it has none in its mode
+    FT4222_SPIClock divider;    // Divider the SPI master was last initialized with
+    int chipSelect;             // Slave select the SPI master drives
+};
@@ -1,72 +1,190 @@
 #include <string>
+#include <cstring>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <array>
+#include <optional>
 #include "IceBoard.h"
+#include "Ft4222Transport.h"
+#include "CompareKernel.h"
+#include "SimulatedFlash.h"
+#include "Trace.h"
 
-FT_HANDLE IceBoardHandle;
+/*
+* Returns the opcode of a command followed by the 3 bytes of address, most significant first
+*/
+inline std::array<uint8, ADDRESSED_COMMAND_SIZE> AddressedCommand(uint8 opcode, int address)
+{
+    return { opcode, (uint8)(address >> 16), (uint8)(address >> 8), (uint8)address };
+}
 
-inline std::vector<unsigned char> IntToByteVec(int x)
+/*
+* Finds the range of buffer between the first and the last byte that is not 0xFF, erased flash already holds the bytes outside it
+* first is set to the first such byte and last to one past the last, both are equal if the whole buffer is 0xFF
+* The blank runs are skipped 8 bytes at a time
+*/
+void FindNonBlankRange(std::span<const uint8> buffer, size_t* first, size_t* last)
 {
-    std::vector<unsigned char> byte(3);
-    byte[0] = (x & 0x00FF0000) >> 16;
-    byte[1] = (x & 0x0000FF00) >> 8;
-    byte[2] = (x & 0x000000FF);
+    const unsigned long long blankWord = ~0ULL;
+    unsigned long long word;
+    size_t begin = 0;
+    size_t end = buffer.size();
+
+    while (end - begin >= sizeof(word))
+    {
+        std::memcpy(&word, buffer.data() + begin, sizeof(word));
+        if (word != blankWord)
+            break;
+        begin += sizeof(word);
+    }
+    while (begin < end && buffer[begin] == 0xFF)
+        begin++;
+
+    while (end - begin >= sizeof(word))
+    {
+        std::memcpy(&word, buffer.data() + end - sizeof(word), sizeof(word));
+        if (word != blankWord)
+            break;
+        end -= sizeof(word);
+    }
+    while (end > begin && buffer[end - 1] == 0xFF)
+        end--;
 
-    return byte;
+    *first = begin;
+    *last = end;
+}
+
+/*
+* Fills info with the details of the FTDI device at index in the list built by FT_CreateDeviceInfoList
+*/
+static FT_STATUS GetDeviceInfo(DWORD index, FT_DEVICE_LIST_INFO_NODE* info)
+{
+    memset(info, 0, sizeof(*info));
+
+    return FT_GetDeviceInfoDetail(
+        index,
+        &info->Flags,
+        &info->Type,
+        &info->ID,
+        &info->LocId,
+        info->SerialNumber,
+        info->Description,
+        &info->ftHandle);
 }
 
 /*
-* Finds all FTDI devices connected to host and saves those FTDI devices that are of type FT4222
+* Finds all FTDI devices connected to host and returns those that are of type FT4222 in boards
 * The Ice Board is a FT4222 device
-* Establishes connection with the first FT4222 device it finds
-* Initializes the FT4222 IC on the Ice Board to following:
-*   - SPI Master, in single SPI mode (one MOSI and one MISO)
-*   - SPI clock to be half that of FT4222 clock
-*   - SPI clock is high when idle
-*   - Shifts data out on trailing clock edge
 */
-FT_STATUS InitBoard()
+FT_STATUS FindBoards(std::vector<IceBoardInfo>* boards)
 {
     FT_STATUS status = FT_OK;
 
     DWORD ftdiDdeviceCount = 0;                          // Number of FTDI (of any type) currently connected to hos
-    size_t ft4222DeviceCount = 0;                        // Number of FT4222 devices currently connected to host
-    std::vector<FT_DEVICE_LIST_INFO_NODE> ft4222Devices; // Will store FT4222 devices that are currently connected to host
+
+    boards->clear();
 
     status = FT_CreateDeviceInfoList(&ftdiDdeviceCount);
+    if (status != FT_OK)
+        return status;
 
     // Loop through all connected FTDI devices and find those who are of type FT4222
     for (DWORD i = 0; i < ftdiDdeviceCount; ++i)
     {
         FT_DEVICE_LIST_INFO_NODE ftdiDeviceInfo;
-        memset(&ftdiDeviceInfo, 0, sizeof(ftdiDeviceInfo));
-
-        status = FT_GetDeviceInfoDetail(
-            i,
-            &ftdiDeviceInfo.Flags,
-            &ftdiDeviceInfo.Type,
-            &ftdiDeviceInfo.ID,
-            &ftdiDeviceInfo.LocId,
-            ftdiDeviceInfo.SerialNumber,
-            ftdiDeviceInfo.Description,
-            &ftdiDeviceInfo.ftHandle);
+        status = GetDeviceInfo(i, &ftdiDeviceInfo);
 
         const std::string deviceDescription = ftdiDeviceInfo.Description;
         if (status == FT_OK && (deviceDescription == "FT4222" || deviceDescription == "FT4222 A"))
-            ft4222Devices.push_back(ftdiDeviceInfo);
+            boards->push_back({ ftdiDeviceInfo.SerialNumber, ftdiDeviceInfo.LocId });
     }
-    // Number of FT4222 devices
-    ft4222DeviceCount = ft4222Devices.size();
-    if (ft4222DeviceCount == 0)
+
+    if (boards->empty())
         return FT_DEVICE_NOT_FOUND;
 
-    // Connect/Open the chosen FT4222 device 
-    // Simply connect to the first FT4222 device that was found 
-    status = FT_OpenEx((PVOID)ft4222Devices[0].SerialNumber, FT_OPEN_BY_SERIAL_NUMBER, &IceBoardHandle);
+    return FT_OK;
+}
+
+/*
+* Opens the GPIO interface of the FT4222 whose SPI interface has serialNumber
+* In mode 0 the FT4222 shows up as two devices, "FT4222 A" for SPI and "FT4222 B" for GPIO, the second directly follows the first in the device list
+* gpioHandle is set to nullptr if the FT4222 has no GPIO interface in its mode
+*/
+static FT_STATUS OpenGpioInterface(const std::string& serialNumber, FT_HANDLE* gpioHandle)
+{
+    FT_STATUS status;
+
+    *gpioHandle = nullptr;
+
+    DWORD ftdiDeviceCount = 0;
+    status = FT_CreateDeviceInfoList(&ftdiDeviceCount);
     if (status != FT_OK)
         return status;
 
-    status = FT4222_SPIMaster_Init(IceBoardHandle, SPI_IO_SINGLE, CLK_DIV_2, CLK_IDLE_HIGH, CLK_TRAILING, 0x01);
+    for (DWORD i = 0; i + 1 < ftdiDeviceCount; i++)
+    {
+        FT_DEVICE_LIST_INFO_NODE spiInfo;
+        status = GetDeviceInfo(i, &spiInfo);
+        if (status != FT_OK)
+            return status;
+        if (std::string(spiInfo.Description) != "FT4222 A" || spiInfo.SerialNumber != serialNumber)
+            continue;
+
+        FT_DEVICE_LIST_INFO_NODE gpioInfo;
+        status = GetDeviceInfo(i + 1, &gpioInfo);
+        if (status != FT_OK)
+            return status;
+        if (std::string(gpioInfo.Description) != "FT4222 B")
+            return FT_OK;
+
+        return FT_Open((int)(i + 1), gpioHandle);
+    }
+
+    return FT_OK;
+}
+
+/*
+* Establishes connection with the FT4222 device with the given serial number, as returned by FindBoards
+* Initializes the FT4222 IC on the Ice Board to following:
+*   - SPI Master, in single SPI mode (one MOSI and one MISO)
+*   - SPI clock to be DEFAULT_SPI_CLOCK, 60 MHz FT4222 clock divided by 2
+*   - SPI clock is high when idle
+*   - Shifts data out on trailing clock edge
+*   - Slave select SS0, chipCount flashes are wired to SS0 and up
+*   - USB latency timer and request size given by usbTuning, see TuneUsb
+*/
+FT_STATUS InitBoard(IceBoard* board, const std::string& serialNumber, int chipCount, const UsbTuning& usbTuning)
+{
+    FT_STATUS status = FT_OK;
+
+    PhaseTimer phaseTimer(&board->metrics, InitPhase);
+    FT_HANDLE iceBoardHandle;
+    status = FT_OpenEx((PVOID)serialNumber.c_str(), FT_OPEN_BY_SERIAL_NUMBER, &iceBoardHandle);
+    if (status != FT_OK)
+        return status;
+
+    FT_HANDLE gpioHandle;
+    status = OpenGpioInterface(serialNumber, &gpioHandle);
+    if (status != FT_OK)
+    {
+        FT_Close(iceBoardHandle);
+        return status;
+    }
+
+    board->transport.reset(new Ft4222Transport(iceBoardHandle, gpioHandle));
+    board->serialNumber = serialNumber;
+    if (IsTraceEnabled())
+        board->traceId = RegisterTraceBoard(serialNumber);
+    board->chipCount = chipCount;
+
+    status = SetSpiClock(board, DEFAULT_SPI_CLOCK);
+    if (status != FT_OK)
+        return status;
+
+    status = TuneUsb(board, usbTuning);
     if (status != FT_OK)
         return status;
 
@@ -74,341 +192,1941 @@ FT_STATUS InitBoard()
 }
 
 /*
-* Writes the content of writeBuffer out on SPI 
-* Only writes the number of bytes as specified by the second argument bytesToWrite
-* If third argument isEndTransaction is true the SS signal will go high after sending the data in writeBuffer
+* Connects board to an in-process simulated flash instead of an Ice Board
+* All functions below then run against the simulated flash instead of the FT4222
+* With a chipCount above 1 every slave select gets its own simulated flash
 */
-FT4222_STATUS WriteSPI(std::vector<uint8> writeBuffer, size_t bytesToWrite, bool isEndTransaction)
+FT_STATUS InitSimulatedBoard(IceBoard* board, const SimulatedFlashConfig& config, const std::string& serialNumber, int chipCount, const UsbTuning& usbTuning)
 {
-    FT4222_STATUS status = FT4222_OK;
-    uint16 bytesTransferred;
-    
-    status = FT4222_SPIMaster_SingleWrite(IceBoardHandle, &writeBuffer[0], (uint16)bytesToWrite, &bytesTransferred, isEndTransaction);
+    PhaseTimer phaseTimer(&board->metrics, InitPhase);
+
+    if (chipCount == 1)
+        board->transport.reset(new SimulatedFlash(config));
+    else
+        board->transport.reset(new SimulatedSpiBus(config, chipCount));
+    board->serialNumber = serialNumber;
+    if (IsTraceEnabled())
+        board->traceId = RegisterTraceBoard(serialNumber);
+    board->chipCount = chipCount;
+
+    FT4222_STATUS status = SetSpiClock(board, DEFAULT_SPI_CLOCK);
     if (status != FT4222_OK)
         return status;
-    else if (bytesTransferred != bytesToWrite)
-        return FT4222_INORRECT_TRANSFER_SIZE;
 
-    return status;
+    return TuneUsb(board, usbTuning);
 }
 
 /*
-* Reads bytesToRead bytes from SPI and stores the read data in readBuffer
-* If third argument isEndTransaction is true the SS signal will go high after reading the bytes
+* Returns the serial number of the FT4222 on the board that was initialized
 */
-FT4222_STATUS ReadSPI(std::vector<uint8>* readBuffer, size_t bytesToRead, bool isEndTransaction)
+std::string GetBoardSerialNumber(IceBoard* board)
 {
-    FT4222_STATUS status;
-    uint16 bytesRead;
-
-    status = FT4222_SPIMaster_SingleRead(IceBoardHandle, &(*readBuffer)[0], (uint16)bytesToRead, &bytesRead, isEndTransaction);
-    if (status != FT4222_OK)
-        return status;
-    else if (bytesRead != bytesToRead)
-        return FT4222_INORRECT_TRANSFER_SIZE;
+    return board->serialNumber;
+}
 
-    return status;
+/*
+* Returns true if opcode is followed by 3 address bytes
+*/
+static bool IsAddressedOpcode(IceBoard* board, uint8 opcode)
+{
+    switch (opcode)
+    {
+    case ReadCmd:
+    case FastReadCmd:
+    case DualOutputReadCmd:
+    case QuadOutputReadCmd:
+    case QuadIOReadCmd:
+    case ReadSfdpCmd:
+    case PageProgramCmd:
+    case QuadPageProgramCmd:
+        return true;
+    default:
+        return std::any_of(std::begin(board->flashDescriptor.eraseTypes), std::end(board->flashDescriptor.eraseTypes), [&](const FlashEraseType& eraseType) { return eraseType.size > 0 && eraseType.opcode == opcode; });
+    }
 }
 
 /*
-* Whenever a page is programmed or any erase command is sent this function should be called
-* It waits until the flash has completed the program or erase command
-* The function reads the status register and checks if the lest-significant-bit is cleared (0)
-* If the bit is cleared the flash is ready otherwise it is busy and the bit is checked again after 1ms
-* If the flash is still busy after MAX_WAIT_TIME_MS a time out error is issued
+* Counts a transfer that started at transferStart and has just completed in the metrics of the board, and adds it to the trace if tracing is on
+* writeBuffer is what the transfer sent, if it starts a transaction it begins with the opcode and address the transaction is traced with
+* byteCount is the number of bytes the transfer clocked
 */
-FT4222_STATUS WaitForFlashReady()
+static void RecordSpiTransfer(IceBoard* board, TransferType type, std::span<const uint8> writeBuffer, size_t byteCount, bool isEndTransaction, std::chrono::steady_clock::time_point transferStart)
 {
-    FT4222_STATUS status;
+    const std::chrono::steady_clock::time_point transferEnd = std::chrono::steady_clock::now();
 
-    std::vector<uint8> readBuffer(1);
+    RecordTransfer(&board->metrics, type, byteCount, transferStart, transferEnd);
 
-    for (int i = 0; i < MAX_WAIT_TIME_MS; i++)
+    if (!IsTraceEnabled())
+        return;
+
+    // A bitstream sent to the SRAM of the FPGA has no opcode
+    const bool isBitstream = board->metrics.phase == SramPhase;
+    const bool isContinuation = board->isTransactionOpen;
+    if (!isContinuation)
     {
-        status = WriteSPI({ ReadStatusRegisterCmd }, 1, false);
-        if (status != FT4222_OK)
-            return status;
+        board->transactionOpcode = writeBuffer.empty() ? DummyCmd : writeBuffer[0];
+        board->transactionAddress = -1;
+        if (!isBitstream && writeBuffer.size() >= ADDRESSED_COMMAND_SIZE && IsAddressedOpcode(board, board->transactionOpcode))
+            board->transactionAddress = (writeBuffer[1] << 16) | (writeBuffer[2] << 8) | writeBuffer[3];
+    }
+    board->isTransactionOpen = !isEndTransaction;
 
-        status = ReadSPI(&readBuffer, readBuffer.size(), true);
-        if (status != FT4222_OK)
-            return status;
+    RecordTraceEvent({ transferStart, transferEnd, isBitstream ? "Bitstream" : nullptr, board->traceId, board->transactionAddress, (uint32)byteCount, board->transactionOpcode, (uint8)board->chipSelect, SpiTraceEvent, isEndTransaction, isContinuation });
+}
 
-        if ((readBuffer[0] & 0x01) == 0x00)
-            return FT4222_OK;
+/*
+* Counts a transfer that configured the FT4222 instead of clocking SPI bytes, and adds it to the trace under name if tracing is on
+*/
+static void RecordControlTransfer(IceBoard* board, const char* name, std::chrono::steady_clock::time_point transferStart)
+{
+    const std::chrono::steady_clock::time_point transferEnd = std::chrono::steady_clock::now();
 
-        Sleep(1);
-    }
+    RecordTransfer(&board->metrics, ControlTransfer, 0, transferStart, transferEnd);
 
-    return FT4222_TIME_OUT_ERROR;
+    if (IsTraceEnabled())
+        RecordTraceEvent({ transferStart, transferEnd, name, board->traceId, -1, 0, 0, (uint8)board->chipSelect, ControlTraceEvent, true, false });
 }
 
 /*
-* Sends a wake up command
+* Adds the time from start to end, in which the flash was busy with a program or erase, to the trace if tracing is on
+*/
+void TraceFlashBusy(IceBoard* board, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+    if (IsTraceEnabled())
+        RecordTraceEvent({ start, end, "Busy", board->traceId, -1, 0, 0, (uint8)board->chipSelect, BusyTraceEvent, true, false });
+}
+
+/*
+* Sets the FT4222 system clock and SPI clock divider
+* This re-initializes the SPI master, which leaves it in single mode
 */
-FT4222_STATUS WakeUpFlash()
+FT4222_STATUS SetSpiClock(IceBoard* board, SpiClockSetting clockSetting)
 {
-    FT4222_STATUS status = WriteSPI({ WakeUpCmd }, 1, true);
+    FT4222_STATUS status;
+
+    board->usbTransferCount++;
+    auto transferStart = std::chrono::steady_clock::now();
+    status = board->transport->SetClock(clockSetting.systemClock, clockSetting.divider);
+    RecordControlTransfer(board, "Set Clock", transferStart);
+    board->spiLines = SPI_IO_SINGLE;
     if (status != FT4222_OK)
         return status;
 
+    board->spiClock = clockSetting;
+
     return status;
 }
 
+SpiClockSetting GetSpiClock(IceBoard* board)
+{
+    return board->spiClock;
+}
+
 /*
-* Sends write enable command
+* Returns the SPI clock frequency in Hz that clockSetting gives
 */
-FT4222_STATUS WriteEnableFlash()
+int SpiClockHz(SpiClockSetting clockSetting)
 {
-    FT4222_STATUS status = WriteSPI({ WriteEnableCmd }, 1, true);
-    if (status != FT4222_OK)
-        return status;
+    // Indexed by FT4222_ClockRate
+    const int systemClockHz[] = { 60000000, 24000000, 48000000, 80000000 };
 
-    return status;
+    return systemClockHz[clockSetting.systemClock] >> clockSetting.divider;
 }
 
 /*
-* Erases the entire flash
+* Finds the fastest SPI clock at which the board reads back the flash reliably
+* A test pattern is written to the scratch sector at SAFE_SPI_CLOCK
+* Then every system clock and divider combination is tried, fastest first, and the sector is read back AUTOTUNE_READ_REPEATS times
+* The first combination where every read matches the pattern is set and returned in tunedClock
+* The content of the scratch sector is destroyed
 */
-FT4222_STATUS EraseFlash()
+FT4222_STATUS AutotuneSpiClock(IceBoard* board, int scratchSectorIndex, SpiClockSetting* tunedClock)
 {
     FT4222_STATUS status;
 
-    status = WriteEnableFlash();
+    PhaseTimer phaseTimer(&board->metrics, AutotunePhase);
+    const FT4222_ClockRate systemClocks[] = { SYS_CLK_80, SYS_CLK_60, SYS_CLK_48, SYS_CLK_24 };
+    std::vector<SpiClockSetting> candidates;
+    for (FT4222_ClockRate systemClock : systemClocks)
+    {
+        for (int divider = CLK_DIV_2; divider <= CLK_DIV_512; divider++)
+        {
+            // The SPI master does not support 80 MHz / 2
+            if (systemClock == SYS_CLK_80 && divider == CLK_DIV_2)
+                continue;
+            candidates.push_back({ systemClock, (FT4222_SPIClock)divider });
+        }
+    }
+    std::stable_sort(candidates.begin(), candidates.end(), [](SpiClockSetting a, SpiClockSetting b) { return SpiClockHz(a) > SpiClockHz(b); });
+
+    // Alternating bits, long runs of 0s and 1s and pseudo-random data
+    const int sectorSize = board->flashDescriptor.sectorSize;
+    std::vector<uint8> pattern(sectorSize);
+    uint16 lfsr = 0xACE1;
+    for (int i = 0; i < sectorSize; i++)
+    {
+        lfsr = (uint16)((lfsr >> 1) ^ (-(lfsr & 1) & 0xB400));
+        if (i < sectorSize / 4)
+            pattern[i] = (i & 1) ? 0xAA : 0x55;
+        else if (i < sectorSize / 2)
+            pattern[i] = (i & 64) ? 0xFF : 0x00;
+        else
+            pattern[i] = (uint8)lfsr;
+    }
+
+    std::vector<uint8> readBuffer(sectorSize);
+
+    status = SetSpiClock(board, SAFE_SPI_CLOCK);
     if (status != FT4222_OK)
         return status;
 
-    status = WriteSPI({ ChipEraseCmd }, 1, true);
+    status = EraseSector(board, scratchSectorIndex);
     if (status != FT4222_OK)
         return status;
 
-    status = WaitForFlashReady();
+    status = SectorProgramFlash(board, scratchSectorIndex, pattern);
     if (status != FT4222_OK)
         return status;
 
-    return status;
+    status = ReadSectorFlash(board, scratchSectorIndex, readBuffer);
+    if (status != FT4222_OK)
+        return status;
+    if (readBuffer != pattern)
+        return FT4222_CORRUPTED_UPLOAD;
+
+    for (const SpiClockSetting& candidate : candidates)
+    {
+        status = SetSpiClock(board, candidate);
+        if (status == FT4222_CLK_NOT_SUPPORTED)
+            continue;
+        if (status != FT4222_OK)
+            return status;
+
+        // A transfer error at a too high clock counts as unstable, not as a failure of the autotuning
+        bool isStable = true;
+        for (int i = 0; i < AUTOTUNE_READ_REPEATS && isStable; i++)
+            isStable = ReadSectorFlash(board, scratchSectorIndex, readBuffer) == FT4222_OK && readBuffer == pattern;
+
+        if (isStable)
+        {
+            *tunedClock = candidate;
+            return FT4222_OK;
+        }
+    }
+
+    SetSpiClock(board, SAFE_SPI_CLOCK);
+    return FT4222_CORRUPTED_UPLOAD;
 }
 
 /*
-* Erases a sector given by the sectorIndex
+* Writes the content of writeBuffer out on SPI 
+* If second argument isEndTransaction is true the SS signal will go high after sending the data in writeBuffer
 */
-FT4222_STATUS EraseSector(int sectorIndex)
+FT4222_STATUS WriteSPI(IceBoard* board, std::span<const uint8> writeBuffer, bool isEndTransaction)
 {
-    FT4222_STATUS status;
+    FT4222_STATUS status = FT4222_OK;
+    uint16 bytesTransferred;
     
-    status = WriteEnableFlash();
+    status = SetSpiLines(board, SPI_IO_SINGLE);
+    if (status != FT4222_OK)
+        return status;
+
+    board->usbTransferCount++;
+    auto transferStart = std::chrono::steady_clock::now();
+    status = board->transport->SingleWrite(writeBuffer.data(), (uint16)writeBuffer.size(), &bytesTransferred, isEndTransaction);
+    RecordSpiTransfer(board, WriteTransfer, writeBuffer, writeBuffer.size(), isEndTransaction, transferStart);
     if (status != FT4222_OK)
         return status;
+    else if (bytesTransferred != writeBuffer.size())
+        return FT4222_INORRECT_TRANSFER_SIZE;
+
+    return status;
+}
 
-    std::vector<uint8> writeBuffer = IntToByteVec(sectorIndex * FLASH_SECTOR_SIZE);
-    writeBuffer.insert(writeBuffer.begin(), SectorEraseCmd);
+/*
+* Reads as many bytes from SPI as fit in readBuffer
+* If second argument isEndTransaction is true the SS signal will go high after reading the bytes
+*/
+FT4222_STATUS ReadSPI(IceBoard* board, std::span<uint8> readBuffer, bool isEndTransaction)
+{
+    FT4222_STATUS status;
+    uint16 bytesRead;
 
-    status = WriteSPI(writeBuffer, writeBuffer.size(), true);
+    status = SetSpiLines(board, SPI_IO_SINGLE);
     if (status != FT4222_OK)
         return status;
 
-    status = WaitForFlashReady();
+    board->usbTransferCount++;
+    auto transferStart = std::chrono::steady_clock::now();
+    status = board->transport->SingleRead(readBuffer.data(), (uint16)readBuffer.size(), &bytesRead, isEndTransaction);
+    RecordSpiTransfer(board, ReadTransfer, {}, readBuffer.size(), isEndTransaction, transferStart);
     if (status != FT4222_OK)
         return status;
+    else if (bytesRead != readBuffer.size())
+        return FT4222_INORRECT_TRANSFER_SIZE;
 
     return status;
 }
 
-
 /*
-* Programs one page given by the pageIndex with the content of the writeBuffer
+* Writes the content of writeBuffer out on SPI and stores the bytes read at the same time in readBuffer
+* Both happen in the same transfer, so a command and its response only cost one USB round trip
+* readBuffer must be as large as writeBuffer
+* If third argument isEndTransaction is true the SS signal will go high after the transfer
 */
-FT4222_STATUS PageProgramFlash(int pageIndex, std::vector<uint8> writeBuffer)
+FT4222_STATUS ReadWriteSPI(IceBoard* board, std::span<uint8> readBuffer, std::span<const uint8> writeBuffer, bool isEndTransaction)
 {
     FT4222_STATUS status;
+    uint16 bytesTransferred;
 
-    std::vector<uint8> readBuffer(FLASH_PAGE_SIZE);
-    int startAddress = pageIndex * FLASH_PAGE_SIZE;
-    std::vector<uint8> commandAndAddressBuffer = IntToByteVec(startAddress);
-    commandAndAddressBuffer.insert(commandAndAddressBuffer.begin(), PageProgramCmd);
-
-    status = WriteEnableFlash();
+    status = SetSpiLines(board, SPI_IO_SINGLE);
     if (status != FT4222_OK)
         return status;
 
-    status = WriteSPI(commandAndAddressBuffer, commandAndAddressBuffer.size(), false);
+    board->usbTransferCount++;
+    auto transferStart = std::chrono::steady_clock::now();
+    status = board->transport->SingleReadWrite(readBuffer.data(), writeBuffer.data(), (uint16)writeBuffer.size(), &bytesTransferred, isEndTransaction);
+    RecordSpiTransfer(board, ReadWriteTransfer, writeBuffer, writeBuffer.size(), isEndTransaction, transferStart);
     if (status != FT4222_OK)
         return status;
+    else if (bytesTransferred != writeBuffer.size())
+        return FT4222_INORRECT_TRANSFER_SIZE;
+
+    return status;
+}
+
+/*
+* Performs one complete transaction on spiLines (SPI_IO_DUAL or SPI_IO_QUAD)
+* The first singleWriteBytes of writeBuffer are sent on one line, the rest of it on all lines
+* Then readBuffer is filled with bytes read on all lines
+*/
+FT4222_STATUS MultiReadWriteSPI(IceBoard* board, std::span<uint8> readBuffer, std::span<const uint8> writeBuffer, FT4222_SPIMode spiLines, int singleWriteBytes)
+{
+    FT4222_STATUS status;
+    uint32 bytesRead;
 
-    status = WriteSPI(writeBuffer, FLASH_PAGE_SIZE, true);
+    status = SetSpiLines(board, spiLines);
     if (status != FT4222_OK)
         return status;
 
-    status = WaitForFlashReady();
+    board->usbTransferCount++;
+    auto transferStart = std::chrono::steady_clock::now();
+    status = board->transport->MultiReadWrite(readBuffer.data(), writeBuffer.data(), (uint8)singleWriteBytes, (uint16)(writeBuffer.size() - singleWriteBytes), (uint16)readBuffer.size(), &bytesRead);
+    RecordSpiTransfer(board, MultiTransfer, writeBuffer, writeBuffer.size() + readBuffer.size(), true, transferStart);
     if (status != FT4222_OK)
         return status;
-
+    else if (bytesRead != readBuffer.size())
+        return FT4222_INORRECT_TRANSFER_SIZE;
 
     return status;
 }
 
 /*
-* Programs one sector given by the sectorIndex with the content of the sectorBuffer
-* If the sectorBuffer size is less than the size of a flash sector size only the bytes actually present in the sectorBuffer are programmed
-* sectorBuffer may not be larger than a flash sector size
+* Switches the SPI master between single, dual and quad mode
+* Switching costs a USB round trip, so nothing is sent if the master already uses the requested mode
 */
-FT4222_STATUS SectorProgramFlash(int sectorIndex, std::vector<uint8> sectorBuffer)
+FT4222_STATUS SetSpiLines(IceBoard* board, FT4222_SPIMode spiLines)
 {
     FT4222_STATUS status = FT4222_OK;
 
-    int pageCount = (int)sectorBuffer.size() < FLASH_SECTOR_SIZE ? 1 + (((int)sectorBuffer.size() - 1) / FLASH_PAGE_SIZE) : FLASH_SECTOR_SIZE/FLASH_PAGE_SIZE;
-    int pageStartIndex = sectorIndex * (FLASH_SECTOR_SIZE/FLASH_PAGE_SIZE);
-    
-    for (int i = 0; i < pageCount; i++)
-    {
-        std::vector<uint8>::const_iterator first = sectorBuffer.begin() + i*FLASH_PAGE_SIZE;
-        std::vector<uint8>::const_iterator last = i == pageCount - 1 ? sectorBuffer.end() : sectorBuffer.begin() + (i + 1) * FLASH_PAGE_SIZE;
-        std::vector<uint8> pageBuffer(first, last);
+    if (spiLines == board->spiLines)
+        return status;
 
-        status = PageProgramFlash(pageStartIndex + i, pageBuffer);
-        if (status != FT4222_OK)
-            return status;
-    }
+    board->usbTransferCount++;
+    auto transferStart = std::chrono::steady_clock::now();
+    status = board->transport->SetLines(spiLines);
+    RecordControlTransfer(board, "Set Lines", transferStart);
+    if (status != FT4222_OK)
+        return status;
+
+    board->spiLines = spiLines;
 
     return status;
 }
 
 /*
-* Reads a sector of the flash at sectorIndex and stores the read data in readBuffer
+* Sets the latency timer and the USB request size of the driver to tuning, and sizes the reads of ReadFlash to match
+* A read is cut into chunks that fill whole USB packets of the size the FT4222 reports and fit in one USB request,
+* so only the last chunk of a read ends with a partly filled packet that waits for the latency timer
 */
-FT4222_STATUS ReadSectorFlash(int sectorIndex, std::vector<uint8>* readBuffer)
+FT4222_STATUS TuneUsb(IceBoard* board, const UsbTuning& tuning)
 {
     FT4222_STATUS status;
 
-    std::vector<uint8> commandAndAddressBuffer = IntToByteVec(sectorIndex*FLASH_SECTOR_SIZE);
-    commandAndAddressBuffer.insert(commandAndAddressBuffer.begin(), ReadCmd);
-
-    status = WriteSPI(commandAndAddressBuffer, commandAndAddressBuffer.size(), false);
+    board->usbTransferCount++;
+    auto transferStart = std::chrono::steady_clock::now();
+    status = board->transport->SetUsbParameters(tuning.latencyTimerMs, tuning.inTransferSize);
+    RecordControlTransfer(board, "Set USB Parameters", transferStart);
     if (status != FT4222_OK)
         return status;
 
-    readBuffer->resize(FLASH_SECTOR_SIZE);
-    status = ReadSPI(readBuffer, FLASH_SECTOR_SIZE, true);
+    uint16 maxTransferSize;
+    status = board->transport->GetMaxTransferSize(&maxTransferSize);
     if (status != FT4222_OK)
         return status;
+    board->usbPacketSize = maxTransferSize;
+
+    int readChunkSize = std::min(MAX_READ_SIZE, (int)tuning.inTransferSize);
+    if (maxTransferSize > 0 && readChunkSize >= maxTransferSize)
+        readChunkSize -= readChunkSize % maxTransferSize;
+    SetReadChunkSize(board, readChunkSize);
 
     return status;
 }
 
 /*
-* Programs the conent of the fileBuffer to the flash
+* Sets the number of bytes, command header included, that one read transfer of ReadFlash clocks, at most MAX_READ_SIZE
 */
-FT4222_STATUS ProgramFlash(std::vector<uint8> fileBuffer)
+void SetReadChunkSize(IceBoard* board, int readChunkSize)
 {
-    FT4222_STATUS status = FT4222_OK;
+    board->readChunkSize = std::clamp(readChunkSize, MAX_READ_HEADER_SIZE + 1, MAX_READ_SIZE);
+}
 
-    // Points into fileBuffer the current non-programmed byte
-    int bufferPointer = 0;
-    std::vector<uint8> readBuffer;
-    
-    bool success = false;
-    int attempts = 0;
-    int bytesToTransmit = 0;
-    int errorCount = 0;
-    
-    // Number of sectors to program rounded up
-    size_t sectorCount = 1 + ((fileBuffer.size() - 1) / FLASH_SECTOR_SIZE);
+int GetReadChunkSize(IceBoard* board)
+{
+    return board->readChunkSize;
+}
 
-    for (int i = 0; i < sectorCount; i++)
-    {
-        success = false;
-        attempts = 0;
+/*
+* Returns the bytes in one USB packet as the FT4222 reported them to the last TuneUsb
+*/
+int GetUsbPacketSize(IceBoard* board)
+{
+    return board->usbPacketSize;
+}
 
-        while (!success)
-        {
-            errorCount = 0;
+/*
+* Returns the number of SPI transfers made so far, every transfer is one USB round trip on the FT4222
+*/
+size_t GetUsbTransferCount(IceBoard* board)
+{
+    return board->usbTransferCount;
+}
 
-            // Extract the current sector from the fileBuffer and copies it into sectorBuffer
-            std::vector<uint8>::const_iterator first = fileBuffer.begin() + bufferPointer;
-            std::vector<uint8>::const_iterator last = i == sectorCount - 1 ? fileBuffer.end() : fileBuffer.begin() + bufferPointer + FLASH_SECTOR_SIZE;
-            std::vector<uint8> sectorBuffer(first, last);
+/*
+* Returns the time per phase and the transfer statistics collected since the board was initialized, see Metrics.h
+*/
+const BoardMetrics& GetBoardMetrics(IceBoard* board)
+{
+    return board->metrics;
+}
 
-            // The file may not be perfectly divisble into the flash sector size
-            bytesToTransmit = (i == sectorCount - 1) ? (int)fileBuffer.size() - i * FLASH_SECTOR_SIZE : FLASH_SECTOR_SIZE;
+/*
+* Makes the FT4222 GPIO ports inputs or outputs as given by directions
+*/
+FT4222_STATUS InitGpio(IceBoard* board, const GPIO_Dir directions[4])
+{
+    board->usbTransferCount++;
+    auto transferStart = std::chrono::steady_clock::now();
+    FT4222_STATUS status = board->transport->InitGpio(directions);
+    RecordControlTransfer(board, "Init GPIO", transferStart);
+    return status;
+}
 
-            // Program the sector
-            status = SectorProgramFlash(i, sectorBuffer);
-            if (status != FT4222_OK)
-                return status;
-            
-            // Read back the sector
-            status = ReadSectorFlash(i, &readBuffer);
-            if (status != FT4222_OK)
-                return status;
+/*
+* Drives the output port high or low, every write is a USB round trip
+*/
+FT4222_STATUS WriteGpio(IceBoard* board, GPIO_Port port, bool isHigh)
+{
+    board->usbTransferCount++;
+    auto transferStart = std::chrono::steady_clock::now();
+    FT4222_STATUS status = board->transport->WriteGpio(port, isHigh);
+    RecordControlTransfer(board, "Write GPIO", transferStart);
+    return status;
+}
 
-            // Check for any corruptions
-            for (int j = 0; j < bytesToTransmit; j++)
-            {
-                if (readBuffer[j] != sectorBuffer[j])
-                    errorCount++;
-            }
+/*
+* Reads the level of port into isHigh, every read is a USB round trip
+*/
+FT4222_STATUS ReadGpio(IceBoard* board, GPIO_Port port, bool* isHigh)
+{
+    board->usbTransferCount++;
+    auto transferStart = std::chrono::steady_clock::now();
+    FT4222_STATUS status = board->transport->ReadGpio(port, isHigh);
+    RecordControlTransfer(board, "Read GPIO", transferStart);
+    return status;
+}
 
-            // If there was a corruption erase the sector and try again
-            if (errorCount > 0)
-            {
-                status = EraseSector(i);
-                if (status != FT4222_OK)
-                    return status;
-            }
-            
-            success = errorCount == 0;
-                
-            attempts++;
-            if (attempts == MAX_SECTOR_PROGRAM_ATTEMPTS)
-                return FT4222_CORRUPTED_UPLOAD;
+/*
+* Sends all following transactions to the flash on slave select chipIndex
+* Switching re-initializes the SPI master, which costs a USB round trip and leaves it in single mode
+* so nothing is sent if the flash is already selected
+*/
+FT4222_STATUS SelectChipFlash(IceBoard* board, int chipIndex)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    if (chipIndex == board->chipSelect)
+        return status;
+
+    board->usbTransferCount++;
+    auto transferStart = std::chrono::steady_clock::now();
+    status = board->transport->SelectChip(chipIndex);
+    RecordControlTransfer(board, "Select Chip", transferStart);
+    board->spiLines = SPI_IO_SINGLE;
+    if (status != FT4222_OK)
+        return status;
+
+    board->chipSelect = chipIndex;
 
-        }
-        bufferPointer += FLASH_SECTOR_SIZE;
-    }
     return status;
 }
 
 /*
-* Reads out the entire flash
-* Compares the content of the flash with the content of fileBuffer
-* If they are not the same the programming failed
+* Sends a command that has no data phase (e.g. write enable or an erase) as one transaction
+* The command is sent on one line without switching the SPI master out of dual or quad mode
 */
-FT4222_STATUS ValidateFlash(std::vector<uint8> fileBuffer)
+FT4222_STATUS WriteCommandFlash(IceBoard* board, std::span<const uint8> commandBuffer)
 {
-    FT4222_STATUS status = FT4222_OK;
+    if (board->spiLines == SPI_IO_SINGLE)
+        return WriteSPI(board, commandBuffer, true);
+
+    return MultiReadWriteSPI(board, {}, commandBuffer, board->spiLines, (int)commandBuffer.size());
+}
+
+/*
+* Reads status register 1 statusReads times in a row within one transfer and returns the last value
+* The flash keeps shifting out the current status for as long as SS is held low,
+* so a long read catches the moment a program or erase completes without another USB round trip
+* The SPI master is not switched out of dual or quad mode, there the flash still shifts the status out on IO1 only
+* The status clocks are then read on all lines and the IO1 bit of every clock is put back together
+* statusReads may not be larger than MAX_STATUS_POLL_READS, the transfer is assembled in the transfer arena of the board
+*/
+FT4222_STATUS ReadStatusFlash(IceBoard* board, uint8* statusRegister, int statusReads)
+{
+    FT4222_STATUS status;
 
-    std::vector<uint8> readBuffer(fileBuffer.size());
-    std::vector<uint8> commandAndAddressBuffer;
-    int n = 1 + (((int)fileBuffer.size() - 1) / MAX_READ_SIZE);
-    int pointer = 0;
+    std::span<uint8> readBuffer(board->arena.response);
 
-    for (int i = 0; i < n; i++)
+    board->metrics.statusPollCount++;
+    board->metrics.statusReadCount += statusReads;
+
+    if (board->spiLines == SPI_IO_SINGLE)
     {
-        commandAndAddressBuffer = IntToByteVec(pointer);
-        commandAndAddressBuffer.insert(commandAndAddressBuffer.begin(), ReadCmd);
-        int bytesToRead = i == n - 1 ? (int)fileBuffer.size() - i * MAX_READ_SIZE : MAX_READ_SIZE;
-        std::vector<uint8> tempBuffer(bytesToRead);
+        std::span<uint8> writeBuffer = std::span<uint8>(board->arena.command).first(1 + statusReads);
+        writeBuffer[0] = ReadStatusRegisterCmd;
+        std::fill(writeBuffer.begin() + 1, writeBuffer.end(), DummyCmd);
 
-        status = WriteSPI(commandAndAddressBuffer, commandAndAddressBuffer.size(), false);
+        status = ReadWriteSPI(board, readBuffer.first(writeBuffer.size()), writeBuffer, true);
         if (status != FT4222_OK)
             return status;
 
-        status = ReadSPI(&tempBuffer, bytesToRead, true);
-        if (status != FT4222_OK)
-            return status;
+        *statusRegister = readBuffer[statusReads];
+        return status;
+    }
 
-        for (int j = 0; j < bytesToRead; j++)
-            readBuffer[pointer + j] = tempBuffer[j];
+    const int lineCount = board->spiLines;
+    const int clocksPerByte = 8 / lineCount;
+    const uint8 command[] = { ReadStatusRegisterCmd };
 
-        pointer += MAX_READ_SIZE;
-    }
-    
-    for (int i = 0; i < fileBuffer.size(); i++)
+    // 8 clocks on lineCount lines fill lineCount bytes
+    status = MultiReadWriteSPI(board, readBuffer.first(lineCount * statusReads), command, board->spiLines, 1);
+    if (status != FT4222_OK)
+        return status;
+
+    // The lines of one clock are packed into a byte with the highest line first, so IO1 of clock j in a byte is bit 9 - (j + 1) * lineCount
+    const int lastStatusOffset = lineCount * (statusReads - 1);
+    *statusRegister = 0;
+    for (int clock = 0; clock < 8; clock++)
     {
-        if (readBuffer[i] != fileBuffer[i])
-            return FT4222_CORRUPTED_UPLOAD;
+        int bit = 9 - (clock % clocksPerByte + 1) * lineCount;
+        *statusRegister = (uint8)((*statusRegister << 1) | ((readBuffer[lastStatusOffset + clock / clocksPerByte] >> bit) & 0x01));
     }
 
     return status;
 }
 
+/*
+* Whenever a page is programmed, any erase command or a write status register is sent this function should be called
+* It waits until the flash has completed the operation, which is done when bit 0 (WIP) of the status register is cleared
+* Polling is paced by the typical time of the operation:
+*   - Operations long enough to sleep through are not polled until 3/4 of their typical time has passed
+*   - Every poll holds SS low long enough to cover the rest of the typical time (see ReadStatusFlash)
+*   - Once the typical time has passed the sleep between polls doubles with every poll
+* If the flash is still busy after the max time of the operation a time out error is issued
+* timing is the entry of the flash descriptor for the operation that was started
+*/
+FT4222_STATUS WaitForFlashReady(IceBoard* board, const FlashOperationTiming& timing)
+{
+    return WaitForFlashReady(board, timing, std::chrono::steady_clock::now());
+}
+
+/*
+* Same as above for an operation that was started at start, the time that has passed since then is not waited again
+*/
+FT4222_STATUS WaitForFlashReady(IceBoard* board, const FlashOperationTiming& timing, std::chrono::steady_clock::time_point start)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    PhaseTimer phaseTimer(&board->metrics, WaitReadyPhase);
+    FT4222_STATUS status;
+
+    const Clock::time_point expectedEnd = start + std::chrono::microseconds(timing.typicalTimeUs);
+    const Clock::time_point deadline = start + std::chrono::microseconds(timing.maxTimeUs);
+    const std::chrono::microseconds minSleep(MIN_SLEEP_US);
+    const std::chrono::microseconds maxBackoff(std::max(timing.typicalTimeUs / 2, MIN_SLEEP_US));
+    std::chrono::microseconds backoff(std::max(timing.typicalTimeUs / 16, MIN_SLEEP_US));
+    uint8 statusRegister;
+
+    if (expectedEnd - start > 2 * minSleep)
+        std::this_thread::sleep_until(start + (expectedEnd - start) * 3 / 4);
+
+    for (;;)
+    {
+        Clock::time_point now = Clock::now();
+
+        std::chrono::microseconds pollWindow = std::chrono::duration_cast<std::chrono::microseconds>(expectedEnd - now);
+        pollWindow = std::max(pollWindow, std::chrono::microseconds(MIN_STATUS_POLL_WINDOW_US));
+        long long statusReads = pollWindow.count() * SpiClockHz(board->spiClock) / 8000000;
+        statusReads = std::min(std::max(statusReads, 1LL), (long long)MAX_STATUS_POLL_READS);
+
+        status = ReadStatusFlash(board, &statusRegister, (int)statusReads);
+        if (status != FT4222_OK)
+            return status;
+
+        if ((statusRegister & 0x01) == 0x00)
+        {
+            TraceFlashBusy(board, start, Clock::now());
+            return FT4222_OK;
+        }
+
+        now = Clock::now();
+        if (now >= deadline)
+            return FT4222_TIME_OUT_ERROR;
+
+        if (now >= expectedEnd)
+        {
+            std::this_thread::sleep_for(std::min<Clock::duration>(backoff, deadline - now));
+            backoff = std::min(backoff * 2, maxBackoff);
+        }
+    }
+}
+
+/*
+* Sends a wake up command
+*/
+FT4222_STATUS WakeUpFlash(IceBoard* board)
+{
+    const uint8 command[] = { WakeUpCmd };
+
+    FT4222_STATUS status = WriteSPI(board, command, true);
+    if (status != FT4222_OK)
+        return status;
+
+    return status;
+}
+
+/*
+* Sends write enable command
+*/
+FT4222_STATUS WriteEnableFlash(IceBoard* board)
+{
+    const uint8 command[] = { WriteEnableCmd };
+
+    FT4222_STATUS status = WriteCommandFlash(board, command);
+    if (status != FT4222_OK)
+        return status;
+
+    return status;
+}
+
+/*
+* Reads status register 1 and, if statusRegister2 is not null, status register 2
+*/
+FT4222_STATUS ReadStatusRegisters(IceBoard* board, uint8* statusRegister1, uint8* statusRegister2)
+{
+    FT4222_STATUS status;
+
+    uint8 readBuffer[2];
+    const uint8 readStatus1Command[] = { ReadStatusRegisterCmd, DummyCmd };
+    const uint8 readStatus2Command[] = { ReadStatusRegister2Cmd, DummyCmd };
+
+    status = ReadWriteSPI(board, readBuffer, readStatus1Command, true);
+    if (status != FT4222_OK)
+        return status;
+    *statusRegister1 = readBuffer[1];
+
+    if (statusRegister2 == nullptr)
+        return status;
+
+    status = ReadWriteSPI(board, readBuffer, readStatus2Command, true);
+    if (status != FT4222_OK)
+        return status;
+    *statusRegister2 = readBuffer[1];
+
+    return status;
+}
+
+/*
+* Sets the Quad Enable bit so IO2 and IO3 of the flash can be used for data instead of WP and HOLD
+* The bit is non-volatile, so it is only written if it is not set already
+* The status register is read back afterwards, if the bit did not stick FT4222_QUAD_ENABLE_FAILED is returned
+*/
+FT4222_STATUS EnableQuadFlash(IceBoard* board, QuadEnableMethod quadEnable)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    if (quadEnable == NoQuadEnableBit)
+        return status;
+
+    const bool isInStatusRegister2 = quadEnable == QuadEnableStatus2Bit1;
+    uint8 statusRegister1;
+    uint8 statusRegister2 = 0;
+
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        status = ReadStatusRegisters(board, &statusRegister1, isInStatusRegister2 ? &statusRegister2 : nullptr);
+        if (status != FT4222_OK)
+            return status;
+
+        if (isInStatusRegister2 ? (statusRegister2 & 0x02) != 0 : (statusRegister1 & 0x40) != 0)
+            return status;
+
+        if (attempt > 0)
+            break;
+
+        status = WriteEnableFlash(board);
+        if (status != FT4222_OK)
+            return status;
+
+        // Status register 2 is written as the second byte of write status register
+        const uint8 writeBuffer[] = { WriteStatusRegisterCmd, (uint8)(statusRegister1 | (isInStatusRegister2 ? 0x00 : 0x40)), (uint8)(statusRegister2 | 0x02) };
+
+        status = WriteSPI(board, std::span<const uint8>(writeBuffer).first(isInStatusRegister2 ? 3 : 2), true);
+        if (status != FT4222_OK)
+            return status;
+
+        status = WaitForFlashReady(board, board->flashDescriptor.writeStatusTiming);
+        if (status != FT4222_OK)
+            return status;
+    }
+
+    return FT4222_QUAD_ENABLE_FAILED;
+}
+
+/*
+* Selects the command ReadFlash uses
+* Quad modes set the Quad Enable bit first, as given by quadEnable
+* Dual and quad modes require IO1-IO3 of the flash to be connected to the FT4222
+* Returns FT4222_FUN_NOT_SUPPORT if the flash descriptor says the flash does not have the command
+*/
+FT4222_STATUS SetFlashReadMode(IceBoard* board, FlashReadMode readMode, QuadEnableMethod quadEnable)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    if (!board->flashDescriptor.readCommands[readMode].isSupported)
+        return FT4222_FUN_NOT_SUPPORT;
+
+    if (board->flashDescriptor.readCommands[readMode].spiLines == SPI_IO_QUAD)
+    {
+        status = EnableQuadFlash(board, quadEnable);
+        if (status != FT4222_OK)
+            return status;
+    }
+
+    board->flashReadMode = readMode;
+
+    return status;
+}
+
+/*
+* Selects the command PageProgramFlash uses
+* Quad input mode sets the Quad Enable bit first, as given by quadEnable
+* If the bit can not be set the flash stays in single mode and FT4222_QUAD_ENABLE_FAILED is returned
+*/
+FT4222_STATUS SetFlashProgramMode(IceBoard* board, FlashProgramMode programMode, QuadEnableMethod quadEnable)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    if (programMode == QuadInputProgramMode)
+    {
+        status = EnableQuadFlash(board, quadEnable);
+        if (status != FT4222_OK)
+        {
+            board->flashProgramMode = SingleProgramMode;
+            return status;
+        }
+    }
+
+    board->flashProgramMode = programMode;
+
+    return status;
+}
+
+/*
+* Returns the command PageProgramFlash uses, ProgramFlash may have fallen back to single mode
+*/
+FlashProgramMode GetFlashProgramMode(IceBoard* board)
+{
+    return board->flashProgramMode;
+}
+
+/*
+* Erases the entire flash
+*/
+FT4222_STATUS EraseFlash(IceBoard* board)
+{
+    FT4222_STATUS status;
+
+    PhaseTimer phaseTimer(&board->metrics, ErasePhase);
+    status = WriteEnableFlash(board);
+    if (status != FT4222_OK)
+        return status;
+
+    const uint8 command[] = { board->flashDescriptor.chipErase.opcode };
+
+    status = WriteCommandFlash(board, command);
+    if (status != FT4222_OK)
+        return status;
+
+    status = WaitForFlashReady(board, board->flashDescriptor.chipErase.timing);
+    if (status != FT4222_OK)
+        return status;
+
+    return status;
+}
+
+/*
+* Erases a sector given by the sectorIndex, a sector is the smallest area the flash descriptor lists an erase command for
+*/
+FT4222_STATUS EraseSector(IceBoard* board, int sectorIndex)
+{
+    return EraseBlockFlash(board, board->flashDescriptor.eraseTypes[0], sectorIndex * board->flashDescriptor.sectorSize);
+}
+
+/*
+* Reads the manufacturer, memory type and capacity bytes of the flash
+*/
+FT4222_STATUS ReadJedecIdFlash(IceBoard* board, uint8 jedecId[3])
+{
+    FT4222_STATUS status;
+
+    uint8 readBuffer[4];
+    const uint8 command[] = { ReadJedecIdCmd, DummyCmd, DummyCmd, DummyCmd };
+
+    status = ReadWriteSPI(board, readBuffer, command, true);
+    if (status != FT4222_OK)
+        return status;
+
+    std::copy(readBuffer + 1, readBuffer + 4, jedecId);
+    return status;
+}
+
+/*
+* Fills readBuffer with the SFDP tables starting at startAddress, the read is sent like a fast read with 8 dummy cycles
+*/
+FT4222_STATUS ReadSfdpFlash(IceBoard* board, int startAddress, std::span<uint8> readBuffer)
+{
+    FT4222_STATUS status;
+
+    const std::array<uint8, ADDRESSED_COMMAND_SIZE> command = AddressedCommand(ReadSfdpCmd, startAddress);
+    const size_t headerSize = command.size() + 1;
+    std::span<uint8> writeBuffer = std::span<uint8>(board->arena.command).first(headerSize + readBuffer.size());
+    std::copy(command.begin(), command.end(), writeBuffer.begin());
+    std::fill(writeBuffer.begin() + command.size(), writeBuffer.end(), DummyCmd);
+
+    std::span<uint8> transferBuffer = std::span<uint8>(board->arena.response).first(writeBuffer.size());
+    status = ReadWriteSPI(board, transferBuffer, writeBuffer, true);
+    if (status != FT4222_OK)
+        return status;
+
+    std::copy(transferBuffer.begin() + headerSize, transferBuffer.end(), readBuffer.begin());
+    return status;
+}
+
+/*
+* Builds the descriptor of the flash on the board
+* A known part with the same JEDEC ID is the starting point, otherwise the default descriptor
+* If the flash has SFDP tables, the geometry, erase commands, times, read commands and Quad Enable bit are taken from them
+* Without SFDP the capacity byte of the JEDEC ID still gives the size
+* Returns FT4222_FLASH_NOT_DETECTED if no flash answers the JEDEC ID command
+*/
+FT4222_STATUS DetectFlash(IceBoard* board, FlashDescriptor* descriptor)
+{
+    FT4222_STATUS status;
+
+    PhaseTimer phaseTimer(&board->metrics, DetectPhase);
+    uint8 jedecId[3];
+    status = ReadJedecIdFlash(board, jedecId);
+    if (status != FT4222_OK)
+        return status;
+
+    if ((jedecId[0] == 0x00 || jedecId[0] == 0xFF) && jedecId[1] == jedecId[0] && jedecId[2] == jedecId[0])
+        return FT4222_FLASH_NOT_DETECTED;
+
+    const FlashDescriptor* knownPart = FindKnownFlashPart(jedecId);
+    *descriptor = knownPart != nullptr ? *knownPart : DefaultFlashDescriptor();
+    std::copy(jedecId, jedecId + 3, descriptor->jedecId);
+
+    if (knownPart == nullptr)
+    {
+        const char hexDigits[] = "0123456789ABCDEF";
+        descriptor->name = "JEDEC ";
+        for (uint8 idByte : jedecId)
+        {
+            descriptor->name += hexDigits[idByte >> 4];
+            descriptor->name += hexDigits[idByte & 0x0F];
+        }
+
+        // Most vendors encode the size as a power of two in the capacity byte
+        if (jedecId[2] >= 0x10 && jedecId[2] <= 0x18)
+        {
+            descriptor->size = 1 << jedecId[2];
+            descriptor->chipErase.size = descriptor->size;
+        }
+    }
+
+    // The SFDP header gives the number of parameter headers that follow it
+    std::vector<uint8> sfdpHeaders(SFDP_HEADER_SIZE);
+    status = ReadSfdpFlash(board, 0, sfdpHeaders);
+    if (status != FT4222_OK)
+        return status;
+
+    const int headersSize = SfdpHeadersSize(sfdpHeaders);
+    if (headersSize == 0)
+        return status;
+
+    sfdpHeaders.resize(headersSize);
+    status = ReadSfdpFlash(board, 0, sfdpHeaders);
+    if (status != FT4222_OK)
+        return status;
+
+    int tableAddress;
+    int tableSize;
+    if (!FindBasicFlashParameterTable(sfdpHeaders, &tableAddress, &tableSize))
+        return status;
+
+    std::vector<uint8> table(tableSize);
+    status = ReadSfdpFlash(board, tableAddress, table);
+    if (status != FT4222_OK)
+        return status;
+
+    ParseBasicFlashParameterTable(table, descriptor);
+    return status;
+}
+
+/*
+* Selects the flash geometry, busy times and commands used by all functions below
+*/
+void SetFlashDescriptor(IceBoard* board, const FlashDescriptor& descriptor)
+{
+    board->flashDescriptor = descriptor;
+
+    if (board->arena.readBack.size() < (size_t)descriptor.sectorSize)
+        board->arena.readBack.resize(descriptor.sectorSize);
+    board->arena.mismatchPages.resize((descriptor.size / descriptor.pageSize + 63) / 64);
+
+    const int sectorCount = descriptor.size / descriptor.sectorSize;
+    board->arena.eraseTimes.reserve(sectorCount + 1);
+    board->arena.eraseLastSteps.reserve(sectorCount + 1);
+    board->arena.erasePlan.reserve(sectorCount);
+    board->arena.changedSectors.reserve(sectorCount);
+}
+
+const FlashDescriptor& GetFlashDescriptor(IceBoard* board)
+{
+    return board->flashDescriptor;
+}
+
+/*
+* Sends one erase command of the flash descriptor for the area starting at address, or the chip erase command
+* Returns as soon as the command is sent, the flash is busy until WaitForFlashReady sees it done
+* address must be aligned to the size of the erased area
+*/
+FT4222_STATUS StartEraseBlockFlash(IceBoard* board, const FlashEraseType& eraseType, int address)
+{
+    FT4222_STATUS status;
+
+    PhaseTimer phaseTimer(&board->metrics, ErasePhase);
+    status = WriteEnableFlash(board);
+    if (status != FT4222_OK)
+        return status;
+
+    // A chip erase is the opcode alone
+    const std::array<uint8, ADDRESSED_COMMAND_SIZE> command = AddressedCommand(eraseType.opcode, address);
+    const bool isChipErase = eraseType.opcode == board->flashDescriptor.chipErase.opcode;
+
+    status = WriteCommandFlash(board, std::span<const uint8>(command).first(isChipErase ? 1 : command.size()));
+    if (status != FT4222_OK)
+        return status;
+
+    return status;
+}
+
+/*
+* Erases the area of one erase command of the flash descriptor starting at address, or the entire flash
+*/
+FT4222_STATUS EraseBlockFlash(IceBoard* board, const FlashEraseType& eraseType, int address)
+{
+    FT4222_STATUS status;
+
+    status = StartEraseBlockFlash(board, eraseType, address);
+    if (status != FT4222_OK)
+        return status;
+
+    status = WaitForFlashReady(board, eraseType.timing);
+    if (status != FT4222_OK)
+        return status;
+
+    return status;
+}
+
+/*
+* Finds the erase operations that erase all sectors overlapping startAddress to endAddress (exclusive) in the least typical time
+* The erase types of the flash descriptor are mixed, a larger erase is only used if its whole area lies within the sectors to erase
+* If isChipEraseAllowed is true and a chip erase is faster, the plan is a single chip erase, which also erases the flash outside the range
+* The tables of the search are kept in the transfer arena, so planning a range of the flash does not allocate
+*/
+void PlanEraseFlash(IceBoard* board, int startAddress, int endAddress, bool isChipEraseAllowed, std::vector<EraseStep>* plan)
+{
+    plan->clear();
+    if (endAddress <= startAddress)
+        return;
+
+    const int sectorSize = board->flashDescriptor.sectorSize;
+    const int firstSector = startAddress / sectorSize;
+    const int sectorCount = 1 + (endAddress - 1) / sectorSize - firstSector;
+
+    // bestTime[i] is the least time needed to erase the first i sectors of the range, lastStep[i] the erase type that ends there
+    std::vector<long long>& bestTime = board->arena.eraseTimes;
+    std::vector<const FlashEraseType*>& lastStep = board->arena.eraseLastSteps;
+    bestTime.assign(sectorCount + 1, -1);
+    lastStep.assign(sectorCount + 1, nullptr);
+    bestTime[0] = 0;
+
+    for (int i = 0; i < sectorCount; i++)
+    {
+        for (const FlashEraseType& eraseType : board->flashDescriptor.eraseTypes)
+        {
+            if (eraseType.size == 0)
+                continue;
+
+            const int eraseSectors = eraseType.size / sectorSize;
+            const int end = i + eraseSectors;
+            if ((firstSector + i) % eraseSectors != 0 || end > sectorCount)
+                continue;
+
+            const long long time = bestTime[i] + eraseType.timing.typicalTimeUs;
+            if (bestTime[end] < 0 || time < bestTime[end])
+            {
+                bestTime[end] = time;
+                lastStep[end] = &eraseType;
+            }
+        }
+    }
+
+    if (isChipEraseAllowed && board->flashDescriptor.chipErase.timing.typicalTimeUs < bestTime[sectorCount])
+    {
+        plan->push_back({ board->flashDescriptor.chipErase, 0 });
+        return;
+    }
+
+    for (int end = sectorCount; end > 0; end -= lastStep[end]->size / sectorSize)
+    {
+        const int start = end - lastStep[end]->size / sectorSize;
+        plan->push_back({ *lastStep[end], (firstSector + start) * sectorSize });
+    }
+    std::reverse(plan->begin(), plan->end());
+}
+
+/*
+* Erases all sectors overlapping startAddress to endAddress (exclusive) with the plan from PlanEraseFlash
+*/
+FT4222_STATUS EraseRangeFlash(IceBoard* board, int startAddress, int endAddress, bool isChipEraseAllowed)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    std::vector<EraseStep>& plan = board->arena.erasePlan;
+    PlanEraseFlash(board, startAddress, endAddress, isChipEraseAllowed, &plan);
+
+    for (const EraseStep& step : plan)
+    {
+        status = EraseBlockFlash(board, step.eraseType, step.address);
+        if (status != FT4222_OK)
+            return status;
+    }
+
+    return status;
+}
+
+
+/*
+* Sends the write enable and page program commands that program writeBuffer into the page given by the pageIndex, starting pageOffset bytes into the page
+* Returns as soon as the data is sent, the flash is busy until WaitForFlashReady sees it done
+* writeBuffer may be shorter than a page, only the bytes present in it are programmed
+* pageOffset + writeBuffer size may not be larger than a page, the flash would wrap around to the start of the page
+* In quad input mode the data is sent on four lines
+* Command and data are assembled in the transfer arena of the board
+*/
+FT4222_STATUS StartPageProgramFlash(IceBoard* board, int pageIndex, int pageOffset, std::span<const uint8> writeBuffer)
+{
+    FT4222_STATUS status;
+
+    PhaseTimer phaseTimer(&board->metrics, ProgramPhase);
+    int startAddress = pageIndex * board->flashDescriptor.pageSize + pageOffset;
+    const std::array<uint8, ADDRESSED_COMMAND_SIZE> command = AddressedCommand(board->flashProgramMode == QuadInputProgramMode ? QuadPageProgramCmd : PageProgramCmd, startAddress);
+    std::span<uint8> programBuffer = std::span<uint8>(board->arena.command).first(command.size() + writeBuffer.size());
+    std::copy(command.begin(), command.end(), programBuffer.begin());
+    std::copy(writeBuffer.begin(), writeBuffer.end(), programBuffer.begin() + command.size());
+
+    if (board->flashProgramMode == QuadInputProgramMode)
+    {
+        status = SetSpiLines(board, SPI_IO_QUAD);
+        if (status != FT4222_OK)
+            return status;
+    }
+
+    status = WriteEnableFlash(board);
+    if (status != FT4222_OK)
+        return status;
+
+    if (board->flashProgramMode == QuadInputProgramMode)
+        status = MultiReadWriteSPI(board, {}, programBuffer, SPI_IO_QUAD, (int)command.size());
+    else
+        status = WriteSPI(board, programBuffer, true);
+    if (status != FT4222_OK)
+        return status;
+
+    return status;
+}
+
+/*
+* Programs the content of the writeBuffer into the page given by the pageIndex, starting pageOffset bytes into the page
+* Command, address and data are sent as one transfer, so a page costs three USB round trips:
+* write enable, page program and (if the flash is done in time) a single status poll
+* In quad input mode the SPI master stays in quad mode for all three
+*/
+FT4222_STATUS PageProgramFlash(IceBoard* board, int pageIndex, int pageOffset, std::span<const uint8> writeBuffer)
+{
+    FT4222_STATUS status;
+
+    status = StartPageProgramFlash(board, pageIndex, pageOffset, writeBuffer);
+    if (status != FT4222_OK)
+        return status;
+
+    status = WaitForFlashReady(board, board->flashDescriptor.pageProgramTiming);
+    if (status != FT4222_OK)
+        return status;
+
+
+    return status;
+}
+
+/*
+* Finds the next page of the sector given by sectorIndex, starting at page pageCursor of sectorBuffer, that has to be programmed with the content of the sectorBuffer
+* Pages that are all 0xFF are skipped and 0xFF at the start and end of a page are left out of pageWrite
+* With isMismatchOnly only the pages marked in the mismatchPages of the transfer arena are programmed
+* pageCursor is advanced past the page found, returns false once no page is left
+* Shared by the synchronous and the coroutine programming functions, which only differ in how they wait for the flash
+*/
+bool NextPageFlash(IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer, bool isMismatchOnly, int* pageCursor, PageWrite* pageWrite)
+{
+    const int pageSize = board->flashDescriptor.pageSize;
+    const int pageCount = 1 + (((int)sectorBuffer.size() - 1) / pageSize);
+    const int pageStartIndex = sectorIndex * (board->flashDescriptor.sectorSize / pageSize);
+    const std::span<unsigned long long> mismatchPages(board->arena.mismatchPages);
+
+    for (; *pageCursor < pageCount; (*pageCursor)++)
+    {
+        const int i = *pageCursor;
+        if (isMismatchOnly && ((mismatchPages[i / 64] >> (i % 64)) & 1) == 0)
+            continue;
+
+        std::span<const uint8> pageBuffer = sectorBuffer.subspan(i * pageSize, std::min((size_t)pageSize, sectorBuffer.size() - i * pageSize));
+        size_t first;
+        size_t last;
+        FindNonBlankRange(pageBuffer, &first, &last);
+        if (first == last)
+            continue;
+
+        *pageWrite = { pageStartIndex + i, (int)first, pageBuffer.subspan(first, last - first) };
+        (*pageCursor)++;
+        return true;
+    }
+
+    return false;
+}
+
+/*
+* Programs one sector given by the sectorIndex with the content of the sectorBuffer
+* If the sectorBuffer size is less than the size of a flash sector size only the bytes actually present in the sectorBuffer are programmed
+* sectorBuffer may not be larger than a flash sector size
+* The sector must be erased, the pages are selected by NextPageFlash
+*/
+FT4222_STATUS SectorProgramFlash(IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    PageWrite pageWrite;
+    for (int pageCursor = 0; NextPageFlash(board, sectorIndex, sectorBuffer, false, &pageCursor, &pageWrite); )
+    {
+        status = PageProgramFlash(board, pageWrite.pageIndex, pageWrite.pageOffset, pageWrite.writeBuffer);
+        if (status != FT4222_OK)
+            return status;
+    }
+
+    return status;
+}
+
+/*
+* Reads as many bytes as readBuffer holds from the flash starting at startAddress, using the command selected by SetFlashReadMode
+* Reads are split into transfers of the chunk size set by TuneUsb, handleChunk(offset, data) is called with the bytes of every transfer
+* On one line the command header is sent and the data is clocked in within the same transfer, data then points into the transfer arena of the board
+* On several lines the data is read straight into readBuffer and data points there
+*/
+template <typename ChunkHandler>
+static FT4222_STATUS ReadFlashChunks(IceBoard* board, int startAddress, std::span<uint8> readBuffer, ChunkHandler handleChunk)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    const FlashReadCommand& command = board->flashDescriptor.readCommands[board->flashReadMode];
+    const int headerSize = command.singleWriteBytes + command.multiWriteBytes;
+    const size_t maxChunkSize = command.spiLines == SPI_IO_SINGLE ? board->readChunkSize - headerSize : board->readChunkSize;
+    std::span<uint8> commandBuffer(board->arena.command);
+
+    // Mode and dummy bytes are sent as 0xFF, which also keeps 0xEB out of continuous read mode
+    std::fill(commandBuffer.begin(), commandBuffer.begin() + std::min(commandBuffer.size(), headerSize + std::min(maxChunkSize, readBuffer.size())), DummyCmd);
+
+    for (size_t offset = 0; offset < readBuffer.size(); offset += maxChunkSize)
+    {
+        size_t chunkSize = std::min(maxChunkSize, readBuffer.size() - offset);
+
+        const std::array<uint8, ADDRESSED_COMMAND_SIZE> header = AddressedCommand(command.opcode, startAddress + (int)offset);
+        std::copy(header.begin(), header.end(), commandBuffer.begin());
+
+        if (command.spiLines == SPI_IO_SINGLE)
+        {
+            std::span<uint8> chunkBuffer = std::span<uint8>(board->arena.response).first(headerSize + chunkSize);
+            status = ReadWriteSPI(board, chunkBuffer, commandBuffer.first(headerSize + chunkSize), true);
+            if (status != FT4222_OK)
+                return status;
+
+            handleChunk(offset, std::span<const uint8>(chunkBuffer.subspan(headerSize)));
+        }
+        else
+        {
+            status = MultiReadWriteSPI(board, readBuffer.subspan(offset, chunkSize), commandBuffer.first(headerSize), command.spiLines, command.singleWriteBytes);
+            if (status != FT4222_OK)
+                return status;
+
+            handleChunk(offset, std::span<const uint8>(readBuffer.subspan(offset, chunkSize)));
+        }
+    }
+
+    return status;
+}
+
+/*
+* Fills readBuffer with the flash content starting at startAddress
+* Uses the command selected by SetFlashReadMode, see ReadFlashChunks
+*/
+FT4222_STATUS ReadFlash(IceBoard* board, int startAddress, std::span<uint8> readBuffer)
+{
+    return ReadFlashChunks(board, startAddress, readBuffer, [&](size_t offset, std::span<const uint8> data)
+    {
+        // On several lines the data already is in readBuffer
+        if (data.data() != &readBuffer[offset])
+            std::copy(data.begin(), data.end(), readBuffer.begin() + offset);
+    });
+}
+
+/*
+* Returns the start of the read back buffer of the transfer arena that one read transfer fills whatever the header of the read command
+* Reading a long range in steps of it does not split every step into a full and a tiny transfer
+*/
+static std::span<uint8> ReadStepBuffer(IceBoard* board)
+{
+    return std::span<uint8>(board->arena.readBack).first(std::min(board->arena.readBack.size(), (size_t)(board->readChunkSize - MAX_READ_HEADER_SIZE)));
+}
+
+/*
+* Reads the flash starting at startAddress and compares it with expected straight out of the transfer buffers with CompareImage, without copying it first
+* expected is divided in blocks of blockSize bytes, the bits of the blocks that differ are set in mismatchBlocks and the bits of the other blocks cleared
+* firstMismatch receives the offset of the first differing byte in expected, or expected.size() if the flash holds expected
+*/
+FT4222_STATUS CompareFlash(IceBoard* board, int startAddress, std::span<const uint8> expected, size_t blockSize, std::span<unsigned long long> mismatchBlocks, size_t* firstMismatch)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    std::span<uint8> readBuffer = ReadStepBuffer(board);
+    const size_t blockCount = (expected.size() + blockSize - 1) / blockSize;
+
+    std::fill(mismatchBlocks.begin(), mismatchBlocks.begin() + (blockCount + 63) / 64, 0);
+    *firstMismatch = expected.size();
+
+    for (size_t offset = 0; offset < expected.size(); offset += readBuffer.size())
+    {
+        const size_t size = std::min(readBuffer.size(), expected.size() - offset);
+
+        status = ReadFlashChunks(board, startAddress + (int)offset, readBuffer.first(size), [&](size_t chunkOffset, std::span<const uint8> data)
+        {
+            PhaseTimer phaseTimer(&board->metrics, ComparePhase);
+            const size_t position = offset + chunkOffset;
+            const size_t mismatch = CompareImage(data, expected.subspan(position, data.size()), position, blockSize, mismatchBlocks);
+            if (mismatch < data.size() && *firstMismatch == expected.size())
+                *firstMismatch = position + mismatch;
+        });
+        if (status != FT4222_OK)
+            return status;
+    }
+
+    return status;
+}
+
+/*
+* Reads a sector of the flash at sectorIndex and stores the read data in readBuffer, which must hold at least a sector
+*/
+FT4222_STATUS ReadSectorFlash(IceBoard* board, int sectorIndex, std::span<uint8> readBuffer)
+{
+    return ReadFlash(board, sectorIndex * board->flashDescriptor.sectorSize, readBuffer.first(board->flashDescriptor.sectorSize));
+}
+
+/*
+* Checks whether the pages of the sector that are marked in the mismatchPages of the transfer arena can be fixed by programming them again
+* Programming can only clear bits, so that is possible if every bit that should be 1 still is 1 in the pages read back
+* mismatchPageCount receives the number of marked pages
+*/
+FT4222_STATUS CheckPageReprogramFlash(IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer, int* mismatchPageCount, bool* isReprogrammable)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    const int pageSize = board->flashDescriptor.pageSize;
+    const int pageCount = 1 + (((int)sectorBuffer.size() - 1) / pageSize);
+    const std::span<unsigned long long> mismatchPages(board->arena.mismatchPages);
+    std::span<uint8> readBuffer(board->arena.readBack);
+
+    *mismatchPageCount = 0;
+    *isReprogrammable = true;
+
+    for (int i = 0; i < pageCount; i++)
+    {
+        if (((mismatchPages[i / 64] >> (i % 64)) & 1) == 0)
+            continue;
+        (*mismatchPageCount)++;
+
+        std::span<const uint8> pageBuffer = sectorBuffer.subspan(i * pageSize, std::min((size_t)pageSize, sectorBuffer.size() - i * pageSize));
+        status = ReadFlash(board, sectorIndex * board->flashDescriptor.sectorSize + i * pageSize, readBuffer.first(pageBuffer.size()));
+        if (status != FT4222_OK)
+            return status;
+        board->verifyBytesRead += pageBuffer.size();
+
+        for (size_t j = 0; j < pageBuffer.size(); j++)
+        {
+            if ((pageBuffer[j] & ~readBuffer[j]) != 0)
+                *isReprogrammable = false;
+        }
+    }
+
+    return status;
+}
+
+/*
+* Programs the pages of the sector that are marked in the mismatchPages of the transfer arena again, on top of their current content
+* Only valid if CheckPageReprogramFlash found that no bit has to be set back to 1
+*/
+FT4222_STATUS ReprogramPagesFlash(IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    PageWrite pageWrite;
+    for (int pageCursor = 0; NextPageFlash(board, sectorIndex, sectorBuffer, true, &pageCursor, &pageWrite); )
+    {
+        status = PageProgramFlash(board, pageWrite.pageIndex, pageWrite.pageOffset, pageWrite.writeBuffer);
+        if (status != FT4222_OK)
+            return status;
+    }
+
+    return status;
+}
+
+/*
+* Reads back the programmed sector given by sectorIndex and compares it with sectorBuffer, the pages that differ are marked in the mismatchPages of the transfer arena
+* isProgrammed is set to true if the flash holds sectorBuffer
+*/
+FT4222_STATUS ReadBackSectorFlash(IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer, bool* isProgrammed)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    PhaseTimer phaseTimer(&board->metrics, ReadBackPhase);
+    size_t firstMismatch;
+
+    status = CompareFlash(board, sectorIndex * board->flashDescriptor.sectorSize, sectorBuffer, board->flashDescriptor.pageSize, board->arena.mismatchPages, &firstMismatch);
+    if (status != FT4222_OK)
+        return status;
+    board->verifyBytesRead += sectorBuffer.size();
+
+    *isProgrammed = firstMismatch == sectorBuffer.size();
+    return status;
+}
+
+/*
+* Decides how to retry a sector that ReadBackSectorFlash found corrupted at the given attempt, starting at 0
+* The pages that differ are programmed again if that only needs bits cleared, otherwise the sector is erased, see CheckPageReprogramFlash
+* Every sector that needed a retry is added to the sectorRetries of the board
+* A flash that accepted the Quad Enable bit may still not implement quad page program, so the remaining sectors are programmed in single mode
+*/
+FT4222_STATUS PlanSectorRetryFlash(IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer, int attempt, SectorRetryAction* action)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    int mismatchPageCount;
+    bool isReprogrammable;
+
+    board->flashProgramMode = SingleProgramMode;
+
+    if (attempt == 0)
+        board->sectorRetries.push_back({ sectorIndex, 0, 0 });
+    SectorRetry& retry = board->sectorRetries.back();
+
+    status = CheckPageReprogramFlash(board, sectorIndex, sectorBuffer, &mismatchPageCount, &isReprogrammable);
+    if (status != FT4222_OK)
+        return status;
+
+    if (isReprogrammable)
+    {
+        retry.pageReprogramCount += mismatchPageCount;
+        *action = ReprogramPagesRetry;
+    }
+    else
+    {
+        retry.eraseCount++;
+        *action = EraseSectorRetry;
+    }
+
+    return status;
+}
+
+/*
+* Programs one erased sector given by the sectorIndex with the content of the sectorBuffer and reads it back
+* A corrupted sector is programmed again as PlanSectorRetryFlash decides, up to MAX_SECTOR_PROGRAM_ATTEMPTS times
+* Only with the InlineVerify policy, otherwise the sector is just programmed and checked by VerifyFlash afterwards
+*/
+FT4222_STATUS VerifiedSectorProgramFlash(IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    bool isErased = true;       // The whole sector is programmed while it is erased, afterwards only the pages that differ
+    bool isProgrammed;
+    SectorRetryAction retryAction;
+    std::optional<PhaseTimer> retryTimer;   // Started once the sector did not verify at the first attempt
+
+    if (board->verifyPolicy != InlineVerify)
+        return SectorProgramFlash(board, sectorIndex, sectorBuffer);
+
+    for (int attempts = 0; attempts < MAX_SECTOR_PROGRAM_ATTEMPTS; attempts++)
+    {
+        status = isErased ? SectorProgramFlash(board, sectorIndex, sectorBuffer) : ReprogramPagesFlash(board, sectorIndex, sectorBuffer);
+        if (status != FT4222_OK)
+            return status;
+
+        status = ReadBackSectorFlash(board, sectorIndex, sectorBuffer, &isProgrammed);
+        if (status != FT4222_OK || isProgrammed)
+            return status;
+
+        if (attempts == 0)
+            retryTimer.emplace(&board->metrics, RetryPhase);
+
+        status = PlanSectorRetryFlash(board, sectorIndex, sectorBuffer, attempts, &retryAction);
+        if (status != FT4222_OK)
+            return status;
+
+        isErased = retryAction == EraseSectorRetry;
+        if (!isErased)
+            continue;
+
+        status = EraseSector(board, sectorIndex);
+        if (status != FT4222_OK)
+            return status;
+    }
+
+    return FT4222_CORRUPTED_UPLOAD;
+}
+
+/*
+* Returns the part of fileBuffer that belongs in the sector given by sectorIndex
+* The file may not be perfectly divisble into the flash sector size, so the last sector may be shorter
+*/
+std::span<const uint8> ExtractSector(IceBoard* board, std::span<const uint8> fileBuffer, int sectorIndex)
+{
+    const size_t sectorSize = board->flashDescriptor.sectorSize;
+    const size_t first = sectorIndex * sectorSize;
+    return fileBuffer.subspan(first, std::min(sectorSize, fileBuffer.size() - first));
+}
+
+/*
+* Programs the conent of the fileBuffer to the erased flash
+*/
+FT4222_STATUS ProgramFlash(IceBoard* board, std::span<const uint8> fileBuffer)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    // Number of sectors to program rounded up
+    int sectorCount = 1 + (((int)fileBuffer.size() - 1) / board->flashDescriptor.sectorSize);
+
+    for (int i = 0; i < sectorCount; i++)
+    {
+        status = VerifiedSectorProgramFlash(board, i, ExtractSector(board, fileBuffer, i));
+        if (status != FT4222_OK)
+            return status;
+    }
+    return status;
+}
+
+/*
+* Reads the part of the flash that will hold the image and stores the indices of the sectors whose content differs from fileBuffer in changedSectors
+* Only the bytes covered by fileBuffer are compared, the rest of the last sector is ignored
+* The sectors are found by CompareFlash with a block size of one sector
+*/
+FT4222_STATUS FindChangedSectorsFlash(IceBoard* board, std::span<const uint8> fileBuffer, std::vector<int>* changedSectors)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    PhaseTimer phaseTimer(&board->metrics, ReadBackPhase);
+    const size_t sectorSize = board->flashDescriptor.sectorSize;
+    const std::span<unsigned long long> mismatchSectors(board->arena.mismatchPages);
+    size_t firstMismatch;
+
+    changedSectors->clear();
+
+    status = CompareFlash(board, 0, fileBuffer, sectorSize, mismatchSectors, &firstMismatch);
+    if (status != FT4222_OK)
+        return status;
+
+    for (size_t i = 0; i * sectorSize < fileBuffer.size(); i++)
+    {
+        if ((mismatchSectors[i / 64] >> (i % 64)) & 1)
+            changedSectors->push_back((int)i);
+    }
+
+    return status;
+}
+
+/*
+* Returns the end (exclusive) of the run of adjacent sectors that starts at runStart in sectors, which must be in ascending order
+*/
+size_t FindSectorRunEnd(const std::vector<int>& sectors, size_t runStart)
+{
+    size_t runEnd = runStart + 1;
+    while (runEnd < sectors.size() && sectors[runEnd] == sectors[runEnd - 1] + 1)
+        runEnd++;
+    return runEnd;
+}
+
+/*
+* Erases and programs the sectors of fileBuffer whose indices are in changedSectors, which must be in ascending order
+* Every run of adjacent changed sectors is erased with the fewest erase operations PlanEraseFlash finds
+*/
+FT4222_STATUS ProgramChangedSectorsFlash(IceBoard* board, std::span<const uint8> fileBuffer, const std::vector<int>& changedSectors)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    for (size_t runStart = 0; runStart < changedSectors.size(); )
+    {
+        size_t runEnd = FindSectorRunEnd(changedSectors, runStart);
+
+        status = EraseRangeFlash(board, changedSectors[runStart] * board->flashDescriptor.sectorSize, (changedSectors[runEnd - 1] + 1) * board->flashDescriptor.sectorSize, false);
+        if (status != FT4222_OK)
+            return status;
+
+        for (size_t i = runStart; i < runEnd; i++)
+        {
+            status = VerifiedSectorProgramFlash(board, changedSectors[i], ExtractSector(board, fileBuffer, changedSectors[i]));
+            if (status != FT4222_OK)
+                return status;
+        }
+
+        runStart = runEnd;
+    }
+
+    return status;
+}
+
+/*
+* Programs the content of the fileBuffer without a chip erase
+* The current content of the flash is read first and only the sectors that differ from fileBuffer are erased and programmed, see ProgramChangedSectorsFlash
+* The flash beyond the end of the image is left untouched
+* changedSectorCount receives the number of sectors that were reprogrammed
+*/
+FT4222_STATUS DiffProgramFlash(IceBoard* board, std::span<const uint8> fileBuffer, int* changedSectorCount)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    std::vector<int>& changedSectors = board->arena.changedSectors;
+
+    status = FindChangedSectorsFlash(board, fileBuffer, &changedSectors);
+    if (status != FT4222_OK)
+        return status;
+
+    status = ProgramChangedSectorsFlash(board, fileBuffer, changedSectors);
+    if (status != FT4222_OK)
+        return status;
+
+    *changedSectorCount = (int)changedSectors.size();
+    return status;
+}
+
+/*
+* Programs the content of fileBuffer into every flash on the slave selects of the board
+* While one flash is busy with an erase or a page program the next command goes to another flash,
+* so the busy times overlap with the USB transfers to the other flashes instead of being waited out one after another
+* Every step of the erase plan is started on all flashes before the first is waited for, then the pages are programmed round robin
+* A flash whose last page program started longer ago than its max time is polled once with a single status read,
+* it is only waited for (and times out) if it is still busy
+* With the InlineVerify policy every flash is read back afterwards and the sectors that did not program correctly are erased and programmed again
+*/
+FT4222_STATUS InterleavedProgramFlash(IceBoard* board, std::span<const uint8> fileBuffer)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    FT4222_STATUS status = FT4222_OK;
+
+    std::vector<Clock::time_point> busySince(board->chipCount);
+
+    std::vector<EraseStep> plan;
+    PlanEraseFlash(board, 0, (int)fileBuffer.size(), true, &plan);
+
+    for (const EraseStep& step : plan)
+    {
+        for (int chip = 0; chip < board->chipCount; chip++)
+        {
+            status = SelectChipFlash(board, chip);
+            if (status != FT4222_OK)
+                return status;
+
+            status = StartEraseBlockFlash(board, step.eraseType, step.address);
+            if (status != FT4222_OK)
+                return status;
+            busySince[chip] = Clock::now();
+        }
+
+        for (int chip = 0; chip < board->chipCount; chip++)
+        {
+            status = SelectChipFlash(board, chip);
+            if (status != FT4222_OK)
+                return status;
+
+            status = WaitForFlashReady(board, step.eraseType.timing, busySince[chip]);
+            if (status != FT4222_OK)
+                return status;
+        }
+    }
+
+    // The part of a page that is not 0xFF, the same for every flash
+    struct PageRange
+    {
+        int pageIndex;
+        size_t first;
+        size_t last;
+    };
+
+    const int pageSize = board->flashDescriptor.pageSize;
+    std::vector<PageRange> pages;
+    for (int i = 0; i * pageSize < (int)fileBuffer.size(); i++)
+    {
+        size_t first;
+        size_t last;
+        FindNonBlankRange(fileBuffer.subspan(i * pageSize, std::min((size_t)pageSize, fileBuffer.size() - i * pageSize)), &first, &last);
+        if (first == last)
+            continue;
+
+        pages.push_back({ i, first, last });
+    }
+
+    const FlashOperationTiming& pageProgramTiming = board->flashDescriptor.pageProgramTiming;
+    const std::chrono::microseconds maxPageProgramTime(pageProgramTiming.maxTimeUs);
+
+    for (size_t i = 0; i < pages.size(); i++)
+    {
+        std::span<const uint8> pageBuffer = fileBuffer.subspan(pages[i].pageIndex * pageSize + pages[i].first, pages[i].last - pages[i].first);
+
+        for (int chip = 0; chip < board->chipCount; chip++)
+        {
+            status = SelectChipFlash(board, chip);
+            if (status != FT4222_OK)
+                return status;
+
+            if (i > 0)
+            {
+                uint8 statusRegister = 0x01;
+                if (Clock::now() - busySince[chip] >= maxPageProgramTime)
+                {
+                    status = ReadStatusFlash(board, &statusRegister, 1);
+                    if (status != FT4222_OK)
+                        return status;
+                }
+
+                if ((statusRegister & 0x01) != 0x00)
+                {
+                    status = WaitForFlashReady(board, pageProgramTiming, busySince[chip]);
+                    if (status != FT4222_OK)
+                        return status;
+                }
+            }
+
+            status = StartPageProgramFlash(board, pages[i].pageIndex, (int)pages[i].first, pageBuffer);
+            if (status != FT4222_OK)
+                return status;
+            busySince[chip] = Clock::now();
+        }
+    }
+
+    for (int chip = 0; chip < board->chipCount; chip++)
+    {
+        status = SelectChipFlash(board, chip);
+        if (status != FT4222_OK)
+            return status;
+
+        if (!pages.empty())
+        {
+            status = WaitForFlashReady(board, pageProgramTiming, busySince[chip]);
+            if (status != FT4222_OK)
+                return status;
+        }
+
+        // The pages were programmed without reading them back, with InlineVerify the flash is read back here instead
+        if (board->verifyPolicy != InlineVerify)
+            continue;
+
+        int changedSectorCount;
+        status = DiffProgramFlash(board, fileBuffer, &changedSectorCount);
+        if (status != FT4222_OK)
+            return status;
+        board->verifyBytesRead += fileBuffer.size();
+    }
+
+    return status;
+}
+
+/*
+* Reads the next step of the image from the flash, as much as one read transfer returns, and compares it with fileBuffer, see CompareFlash
+*/
+static FT4222_STATUS ValidateStepFlash(IceBoard* board, std::span<const uint8> fileBuffer, VerifyProgress* progress)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    PhaseTimer phaseTimer(&board->metrics, ValidatePhase);
+    std::span<const uint8> expected = fileBuffer.subspan(progress->offset, std::min(ReadStepBuffer(board).size(), fileBuffer.size() - progress->offset));
+    size_t firstMismatch;
+
+    status = CompareFlash(board, (int)progress->offset, expected, board->flashDescriptor.pageSize, board->arena.mismatchPages, &firstMismatch);
+    if (status != FT4222_OK)
+        return status;
+    board->verifyBytesRead += expected.size();
+    progress->offset += expected.size();
+
+    if (firstMismatch < expected.size())
+        return FT4222_CORRUPTED_UPLOAD;
+
+    return status;
+}
+
+/*
+* Reads the next step of the image from the flash like ValidateStepFlash, but only continues the hash of the flash content with it
+* The hash is compared with the hash of fileBuffer after the last step
+*/
+static FT4222_STATUS HashValidateStepFlash(IceBoard* board, std::span<const uint8> fileBuffer, VerifyProgress* progress)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    PhaseTimer phaseTimer(&board->metrics, ValidatePhase);
+    std::span<uint8> readBuffer = ReadStepBuffer(board);
+    std::span<uint8> chunk = readBuffer.first(std::min(readBuffer.size(), fileBuffer.size() - progress->offset));
+
+    status = ReadFlash(board, (int)progress->offset, chunk);
+    if (status != FT4222_OK)
+        return status;
+    board->verifyBytesRead += chunk.size();
+    progress->offset += chunk.size();
+
+    progress->flashHash = HashImage(chunk, progress->flashHash);
+    if (progress->offset == fileBuffer.size() && progress->flashHash != HashImage(fileBuffer, IMAGE_HASH_SEED))
+        return FT4222_CORRUPTED_UPLOAD;
+
+    return status;
+}
+
+/*
+* Reads out the part of the flash that holds the image, using the read mode selected by SetFlashReadMode
+* Compares the content of the flash with the content of fileBuffer as it is received, one read step at a time, see ValidateStepFlash
+* If they are not the same the programming failed
+*/
+FT4222_STATUS ValidateFlash(IceBoard* board, std::span<const uint8> fileBuffer)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    VerifyProgress progress;
+    while (progress.offset < fileBuffer.size())
+    {
+        status = ValidateStepFlash(board, fileBuffer, &progress);
+        if (status != FT4222_OK)
+            return status;
+    }
+
+    return status;
+}
+
+/*
+* Continues the FNV-1a hash of the bytes before buffer, pass IMAGE_HASH_SEED for the first bytes
+*/
+unsigned long long HashImage(std::span<const uint8> buffer, unsigned long long hash)
+{
+    for (uint8 byte : buffer)
+        hash = (hash ^ byte) * 1099511628211ULL;
+    return hash;
+}
+
+/*
+* Reads out the part of the flash that holds the image like ValidateFlash, but compares a hash of it with the hash of fileBuffer
+* The read data is hashed one chunk at a time and never compared byte by byte, a SPI NOR flash can not hash its content itself so every byte still crosses USB once
+*/
+FT4222_STATUS HashValidateFlash(IceBoard* board, std::span<const uint8> fileBuffer)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    VerifyProgress progress;
+    while (progress.offset < fileBuffer.size())
+    {
+        status = HashValidateStepFlash(board, fileBuffer, &progress);
+        if (status != FT4222_OK)
+            return status;
+    }
+
+    return status;
+}
+
+void SetVerifyPolicy(IceBoard* board, VerifyPolicy verifyPolicy)
+{
+    board->verifyPolicy = verifyPolicy;
+}
+
+VerifyPolicy GetVerifyPolicy(IceBoard* board)
+{
+    return board->verifyPolicy;
+}
+
+size_t GetVerifyBytesRead(IceBoard* board)
+{
+    return board->verifyBytesRead;
+}
 
+const std::vector<SectorRetry>& GetSectorRetries(IceBoard* board)
+{
+    return board->sectorRetries;
+}
+
+/*
+* Checks the next read step of the programmed image as selected by the verify policy of the board, isDone is set after the last step
+* The InlineVerify policy has checked every sector while programming it, so it and NoVerify are done without reading anything
+* Lets the coroutine programming functions give other boards a turn between the steps, see AsyncVerifyFlash
+*/
+FT4222_STATUS VerifyStepFlash(IceBoard* board, std::span<const uint8> fileBuffer, VerifyProgress* progress, bool* isDone)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    if (progress->offset < fileBuffer.size())
+    {
+        switch (board->verifyPolicy)
+        {
+        case DeferredVerify:
+            status = ValidateStepFlash(board, fileBuffer, progress);
+            break;
+        case HashVerify:
+            status = HashValidateStepFlash(board, fileBuffer, progress);
+            break;
+        default:
+            progress->offset = fileBuffer.size();
+            break;
+        }
+    }
+
+    *isDone = progress->offset == fileBuffer.size();
+    return status;
+}
+
+/*
+* Checks the programmed image after all sectors are programmed, as selected by the verify policy of the board
+* The InlineVerify policy has checked every sector while programming it, so it and NoVerify read nothing here
+*/
+FT4222_STATUS VerifyFlash(IceBoard* board, std::span<const uint8> fileBuffer)
+{
+    switch (board->verifyPolicy)
+    {
+    case DeferredVerify:
+        return ValidateFlash(board, fileBuffer);
+    case HashVerify:
+        return HashValidateFlash(board, fileBuffer);
+    default:
+        return FT4222_OK;
+    }
+}
+
+/*
+* Configures the iCE40 straight from bitstream into its SRAM, the flash is not written and the design is lost at power off
+* The FPGA is held in reset through CRESET_B, and SS is held low while CRESET_B is released, which makes the FPGA an SPI slave
+* The flash shares SS0 with the FPGA, so the transaction starts with a 0x00 byte (no command) that makes the flash ignore the bitstream
+* Once the FPGA has cleared its configuration memory the bitstream is sent in one transaction, followed by the dummy clocks that start the design
+* CDONE is then polled until it goes high, a USB transfer takes longer than the reset pulse the FPGA needs so none is waited for
+* Leaves the SPI master at ICE40_SPI_CLOCK
+*/
+FT4222_STATUS LoadSramFpga(IceBoard* board, std::span<const uint8> bitstream, GPIO_Port cresetPort, GPIO_Port cdonePort)
+{
+    FT4222_STATUS status;
+
+    PhaseTimer phaseTimer(&board->metrics, SramPhase);
+    GPIO_Dir directions[4] = { GPIO_INPUT, GPIO_INPUT, GPIO_INPUT, GPIO_INPUT };
+    directions[cresetPort] = GPIO_OUTPUT;
+    const std::span<uint8> dummyBytes = std::span<uint8>(board->arena.command).first(ICE40_TRAILING_CLOCK_BYTES);
+    std::fill(dummyBytes.begin(), dummyBytes.end(), 0x00);
+
+    status = SelectChipFlash(board, 0);
+    if (status != FT4222_OK)
+        return status;
+
+    status = SetSpiClock(board, ICE40_SPI_CLOCK);
+    if (status != FT4222_OK)
+        return status;
+
+    status = InitGpio(board, directions);
+    if (status != FT4222_OK)
+        return status;
+
+    status = WriteGpio(board, cresetPort, false);
+    if (status != FT4222_OK)
+        return status;
+
+    status = WriteSPI(board, dummyBytes.first(1), false);
+    if (status != FT4222_OK)
+        return status;
+
+    status = WriteGpio(board, cresetPort, true);
+    if (status != FT4222_OK)
+        return status;
+
+    std::this_thread::sleep_for(std::chrono::microseconds(ICE40_CLEAR_TIME_US));
+
+    for (size_t offset = 0; offset < bitstream.size(); offset += MAX_READ_SIZE)
+    {
+        status = WriteSPI(board, bitstream.subspan(offset, std::min((size_t)MAX_READ_SIZE, bitstream.size() - offset)), false);
+        if (status != FT4222_OK)
+            return status;
+    }
+
+    status = WriteSPI(board, dummyBytes, true);
+    if (status != FT4222_OK)
+        return status;
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(ICE40_CDONE_TIMEOUT_US);
+    bool isDone;
+    for (;;)
+    {
+        status = ReadGpio(board, cdonePort, &isDone);
+        if (status != FT4222_OK)
+            return status;
+
+        if (isDone)
+            return status;
+
+        if (std::chrono::steady_clock::now() >= deadline)
+            return FT4222_FPGA_NOT_CONFIGURED;
+    }
+}
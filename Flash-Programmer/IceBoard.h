@@ -5,42 +5,260 @@
 #pragma once
 #include <vector>
 #include <map>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <span>
 #include "ftd2xx.h"
 #include "LibFT4222.h"
+#include "FlashDescriptor.h"
+#include "SpiTransport.h"
+#include "Metrics.h"
 
 enum FlashCommands
 {
     ReadStatusRegisterCmd = 0x05,
+    ReadStatusRegister2Cmd = 0x35,
+    WriteStatusRegisterCmd = 0x01,
     WakeUpCmd = 0xAB,
     WriteEnableCmd = 0x06,
     ChipEraseCmd = 0x60,
     SectorEraseCmd = 0x20,
+    BlockErase32Cmd = 0x52,
+    BlockErase64Cmd = 0xD8,
     ReadCmd = 0x03,
+    FastReadCmd = 0x0B,
+    DualOutputReadCmd = 0x3B,
+    QuadOutputReadCmd = 0x6B,
+    QuadIOReadCmd = 0xEB,
+    ReadJedecIdCmd = 0x9F,
+    ReadSfdpCmd = 0x5A,
     PageProgramCmd = 0x02,
+    QuadPageProgramCmd = 0x32,
     DummyCmd = 0xFF
 };
 
+// Command used to program a page of the flash
+enum FlashProgramMode
+{
+    SingleProgramMode,      // 0x02, command, address and data on 1 line
+    QuadInputProgramMode    // 0x32, command and address on 1 line, data on 4 lines
+};
+
+// How the programmed image is read back to check it, every policy counts the bytes it reads back in verifyBytesRead
+enum VerifyPolicy
+{
+    InlineVerify,       // Every sector is read back right after it is programmed and programmed again if it is corrupted
+    DeferredVerify,     // The whole image is read back once after programming, in transfers as large as the arena allows
+    HashVerify,         // As DeferredVerify, but only a hash of the read data is kept and compared with the hash of the image
+    NoVerify            // Nothing is read back
+};
+
+// Retries that were needed to program one sector, reported after the upload
+struct SectorRetry
+{
+    int sectorIndex;
+    int pageReprogramCount;     // Pages programmed again on top of their content, as they only needed bits cleared
+    int eraseCount;             // Times the sector was erased and programmed again from scratch
+};
+
+// What is done with a sector that did not verify, chosen by PlanSectorRetryFlash
+enum SectorRetryAction
+{
+    ReprogramPagesRetry,    // The pages that differ are programmed again on top of their content
+    EraseSectorRetry        // The sector is erased and programmed again from scratch
+};
+
+// The part of a page that PageProgramFlash has to send, found by NextPageFlash
+struct PageWrite
+{
+    int pageIndex;
+    int pageOffset;                         // Offset of the first byte in the page that is not 0xFF
+    std::span<const uint8> writeBuffer;     // Bytes from there up to the last byte that is not 0xFF
+};
+
+// One erase command of an erase plan
+struct EraseStep
+{
+    FlashEraseType eraseType;   // One of the erase types of the flash descriptor or its chip erase
+    int address;                // Start of the erased area, ignored for a chip erase
+};
+
+// FT4222 system clock and the divider that gives the SPI clock
+struct SpiClockSetting
+{
+    FT4222_ClockRate systemClock;
+    FT4222_SPIClock divider;
+};
+
+// Settings of the USB driver of the FT4222
+struct UsbTuning
+{
+    uint8 latencyTimerMs;   // Time the FT4222 holds back a partly filled packet, the short replies of commands and status polls wait for it
+    DWORD inTransferSize;   // Size of the USB requests the driver reads with, a bulk read larger than this takes several requests
+};
+
 // All size constants below are given in units of bytes
+// The geometry of the flash in use comes from its FlashDescriptor, these are the sizes of the flash fitted to the Ice Board
 const int FLASH_SIZE = 262144;              // Size of flash
 const int FLASH_PAGE_SIZE = 256;            // Size of a page in the flash
 const int FLASH_SECTOR_SIZE = 4096;         // Size of a sector in flash
+const int FLASH_BLOCK32_SIZE = 32768;       // Size of the area erased by a 32 KB block erase
+const int FLASH_BLOCK64_SIZE = 65536;       // Size of the area erased by a 64 KB block erase
 const int MAX_READ_SIZE = 65535;            // Maximum bytes that can be read in one read command
-const int MAX_WAIT_TIME_MS = 500;           // Max amount of time to wait for flash device to signal its ready
+const DWORD DEFAULT_USB_IN_TRANSFER_SIZE = 4096;    // USB request size of the driver until it is set
+const UsbTuning DEFAULT_USB_TUNING = { 2, 65536 };  // Shortest latency timer, and requests that take the largest read at once
+const int ADDRESSED_COMMAND_SIZE = 4;       // Opcode and 3 address bytes that start read, program and erase commands
+const int MAX_READ_HEADER_SIZE = 7;         // Maximum number of command, address and dummy bytes that precede the data of a read
+const int MAX_SINGLE_WRITE_SIZE = 15;       // Maximum bytes sent on one line at the start of a dual or quad transfer
+const SpiClockSetting DEFAULT_SPI_CLOCK = { SYS_CLK_60, CLK_DIV_2 };   // 30 MHz, the clock used until a tuned one is set
+const SpiClockSetting SAFE_SPI_CLOCK = { SYS_CLK_60, CLK_DIV_8 };      // 7.5 MHz, used to write the autotune test pattern
+const int MIN_SLEEP_US = 2000;              // Waits shorter than this are spent polling instead of sleeping, as the OS can not sleep that precisely
+const int MIN_STATUS_POLL_WINDOW_US = 200;  // Minimum time SS is held low while polling the status register
+const int MAX_STATUS_POLL_READS = 4096;     // Maximum number of status bytes read in one poll
+const int AUTOTUNE_READ_REPEATS = 4;        // Number of times the scratch sector is read back at every clock setting during autotuning
+const int MAX_CHIP_COUNT = 4;               // Number of slave select lines (SS0 to SS3) of the FT4222 SPI master
+const unsigned long long IMAGE_HASH_SEED = 14695981039346656037ULL;   // FNV-1a 64 bit offset basis, the hash of an empty image
+const SpiClockSetting ICE40_SPI_CLOCK = { SYS_CLK_48, CLK_DIV_2 };    // 24 MHz, below the 25 MHz the iCE40 accepts as SPI slave while it is configured
+const GPIO_Port DEFAULT_CRESET_PORT = GPIO_PORT2;   // FT4222 GPIO wired to CRESET_B of the iCE40
+const GPIO_Port DEFAULT_CDONE_PORT = GPIO_PORT3;    // FT4222 GPIO wired to CDONE of the iCE40
+const int ICE40_CLEAR_TIME_US = 1200;       // Time the iCE40 takes to clear its configuration memory after CRESET_B goes high, it ignores the bus until then
+const int ICE40_TRAILING_CLOCK_BYTES = 7;   // Dummy bytes sent after the bitstream, the iCE40 needs at least 49 more clocks to start the design
+const int ICE40_CDONE_TIMEOUT_US = 100000;  // Max time CDONE may take to go high after the bitstream was sent
 const int MAX_SECTOR_PROGRAM_ATTEMPTS = 5;  // Max number of attemts to re-program a sector (in case some of the data was corrupted during upload)
 
+// Buffers of one board that transfers are assembled and received in, allocated once so that programming does not allocate
+struct TransferArena
+{
+    std::vector<uint8> command = std::vector<uint8>(MAX_READ_SIZE);     // Command header followed by the data or dummy bytes of one transfer
+    std::vector<uint8> response = std::vector<uint8>(MAX_READ_SIZE);    // Bytes clocked in during one transfer
+    std::vector<uint8> readBack = std::vector<uint8>(MAX_READ_SIZE);    // Flash content read back for comparison, at least one sector
+    std::vector<unsigned long long> mismatchPages = std::vector<unsigned long long>(FLASH_SIZE / FLASH_PAGE_SIZE / 64);  // One bit per page of the flash set by CompareFlash
+    std::vector<long long> eraseTimes;                  // Least time to erase the first sectors of a range, one entry per sector of the flash and one more, used by PlanEraseFlash
+    std::vector<const FlashEraseType*> eraseLastSteps;  // Erase type that ends each of those, used by PlanEraseFlash
+    std::vector<EraseStep> erasePlan;                   // Plan of EraseRangeFlash, at most one step per sector of the flash
+    std::vector<int> changedSectors;                    // Sectors DiffProgramFlash found changed, at most every sector of the flash
+};
+
+// How far VerifyStepFlash has checked the image
+struct VerifyProgress
+{
+    size_t offset = 0;                                  // Bytes of the image checked so far
+    unsigned long long flashHash = IMAGE_HASH_SEED;     // Hash of the flash content read so far, only with HashVerify
+};
+
+// State of one Ice Board, every function below that talks to a board takes it as first parameter
+// Functions may be called for different boards from different threads, but never for the same board
+struct IceBoard
+{
+    std::unique_ptr<SpiTransport> transport;                // Every SPI transfer goes through this transport, the FT4222 on the board or a simulated flash
+    size_t usbTransferCount = 0;                            // Number of transfers (each one a USB round trip on the FT4222) made since the board was initialized
+    FT4222_SPIMode spiLines = SPI_IO_SINGLE;                // Number of data lines the SPI master currently uses, only changed through SetSpiLines
+    std::string serialNumber;                               // Serial number of the FT4222, used to look up per-board settings
+    SpiClockSetting spiClock = DEFAULT_SPI_CLOCK;           // Clock the SPI master currently runs at, only changed through SetSpiClock
+    FlashDescriptor flashDescriptor = DefaultFlashDescriptor(); // Geometry, busy times and commands of the flash, only changed through SetFlashDescriptor
+    FlashReadMode flashReadMode = FastReadMode;             // Command used by ReadFlash, only changed through SetFlashReadMode
+    FlashProgramMode flashProgramMode = SingleProgramMode;  // Command used by PageProgramFlash, only changed through SetFlashProgramMode or a fall back in ProgramFlash
+    int chipCount = 1;                                      // Number of flashes on the slave select lines SS0 and up, all of the part in flashDescriptor
+    int chipSelect = 0;                                     // Slave select of the flash all transactions go to, only changed through SelectChipFlash
+    VerifyPolicy verifyPolicy = InlineVerify;               // How programmed sectors are checked, only changed through SetVerifyPolicy
+    size_t verifyBytesRead = 0;                             // Number of bytes read back to verify programmed data since the board was initialized
+    std::vector<SectorRetry> sectorRetries;                 // Sectors that did not verify at the first attempt since the board was initialized
+    BoardMetrics metrics;                                   // Time per phase and statistics of every transfer since the board was initialized
+    int traceId = -1;                                       // Id of the board in the trace, -1 if tracing is off
+    bool isTransactionOpen = false;                         // SS is held low after the last transfer, only tracked while tracing
+    uint8 transactionOpcode = DummyCmd;                     // Opcode of the last transaction, the traced transfers that continue it are shown with it
+    int transactionAddress = -1;                            // Address of the last transaction, -1 if its opcode takes none
+    int readChunkSize = MAX_READ_SIZE;                      // Bytes clocked by one read transfer of ReadFlash, only changed through SetReadChunkSize
+    int usbPacketSize = 0;                                  // Bytes in one USB packet as reported by the FT4222, set by TuneUsb
+    TransferArena arena;
+};
+
+// An FT4222 found by FindBoards
+struct IceBoardInfo
+{
+    std::string serialNumber;
+    DWORD locationId;       // Position of the device in the USB tree, stays the same for a given hub port
+};
+
 extern std::map<int, std::string> statusMessages;
 
-FT_STATUS InitBoard();
-FT4222_STATUS WriteSPI(std::vector<uint8> writeBuffer, size_t bytesToWrite, bool isEndTransaction);
-FT4222_STATUS ReadSPI(std::vector<uint8>* readBuffer, size_t bytesToRead, bool isEndTransaction);
-FT4222_STATUS WaitForFlashReady();
-FT4222_STATUS WakeUpFlash();
-FT4222_STATUS EraseFlash();
-FT4222_STATUS EraseSector(int startAddress);
-FT4222_STATUS WriteEnableFlash();
-FT4222_STATUS PageProgramFlash(int pageIndex, std::vector<uint8> writeBuffer);
-FT4222_STATUS SectorProgramFlash(int sectorIndex, std::vector<uint8> writeBuffer);
-FT4222_STATUS ReadSectorFlash(int sectorIndex, std::vector<uint8>* readBuffer);
-FT4222_STATUS ProgramFlash(std::vector<uint8> fileBuffer);
-FT4222_STATUS ValidateFlash(std::vector<uint8> fileBuffer);
+struct SimulatedFlashConfig;
+
+FT_STATUS FindBoards(std::vector<IceBoardInfo>* boards);
+FT_STATUS InitBoard(IceBoard* board, const std::string& serialNumber, int chipCount, const UsbTuning& usbTuning);
+FT_STATUS InitSimulatedBoard(IceBoard* board, const SimulatedFlashConfig& config, const std::string& serialNumber, int chipCount, const UsbTuning& usbTuning);
+std::string GetBoardSerialNumber(IceBoard* board);
+FT4222_STATUS SetSpiClock(IceBoard* board, SpiClockSetting clockSetting);
+SpiClockSetting GetSpiClock(IceBoard* board);
+int SpiClockHz(SpiClockSetting clockSetting);
+FT4222_STATUS AutotuneSpiClock(IceBoard* board, int scratchSectorIndex, SpiClockSetting* tunedClock);
+FT4222_STATUS WriteSPI(IceBoard* board, std::span<const uint8> writeBuffer, bool isEndTransaction);
+FT4222_STATUS ReadSPI(IceBoard* board, std::span<uint8> readBuffer, bool isEndTransaction);
+FT4222_STATUS ReadWriteSPI(IceBoard* board, std::span<uint8> readBuffer, std::span<const uint8> writeBuffer, bool isEndTransaction);
+FT4222_STATUS MultiReadWriteSPI(IceBoard* board, std::span<uint8> readBuffer, std::span<const uint8> writeBuffer, FT4222_SPIMode spiLines, int singleWriteBytes);
+FT4222_STATUS SetSpiLines(IceBoard* board, FT4222_SPIMode spiLines);
+FT4222_STATUS TuneUsb(IceBoard* board, const UsbTuning& tuning);
+void SetReadChunkSize(IceBoard* board, int readChunkSize);
+int GetReadChunkSize(IceBoard* board);
+int GetUsbPacketSize(IceBoard* board);
+size_t GetUsbTransferCount(IceBoard* board);
+const BoardMetrics& GetBoardMetrics(IceBoard* board);
+void TraceFlashBusy(IceBoard* board, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+FT4222_STATUS InitGpio(IceBoard* board, const GPIO_Dir directions[4]);
+FT4222_STATUS WriteGpio(IceBoard* board, GPIO_Port port, bool isHigh);
+FT4222_STATUS ReadGpio(IceBoard* board, GPIO_Port port, bool* isHigh);
+FT4222_STATUS SelectChipFlash(IceBoard* board, int chipIndex);
+FT4222_STATUS WriteCommandFlash(IceBoard* board, std::span<const uint8> commandBuffer);
+FT4222_STATUS ReadStatusFlash(IceBoard* board, uint8* statusRegister, int statusReads);
+FT4222_STATUS WaitForFlashReady(IceBoard* board, const FlashOperationTiming& timing);
+FT4222_STATUS WaitForFlashReady(IceBoard* board, const FlashOperationTiming& timing, std::chrono::steady_clock::time_point start);
+FT4222_STATUS WakeUpFlash(IceBoard* board);
+FT4222_STATUS EraseFlash(IceBoard* board);
+FT4222_STATUS EraseSector(IceBoard* board, int startAddress);
+FT4222_STATUS ReadJedecIdFlash(IceBoard* board, uint8 jedecId[3]);
+FT4222_STATUS ReadSfdpFlash(IceBoard* board, int startAddress, std::span<uint8> readBuffer);
+FT4222_STATUS DetectFlash(IceBoard* board, FlashDescriptor* descriptor);
+void SetFlashDescriptor(IceBoard* board, const FlashDescriptor& descriptor);
+const FlashDescriptor& GetFlashDescriptor(IceBoard* board);
+FT4222_STATUS StartEraseBlockFlash(IceBoard* board, const FlashEraseType& eraseType, int address);
+FT4222_STATUS EraseBlockFlash(IceBoard* board, const FlashEraseType& eraseType, int address);
+void PlanEraseFlash(IceBoard* board, int startAddress, int endAddress, bool isChipEraseAllowed, std::vector<EraseStep>* plan);
+FT4222_STATUS EraseRangeFlash(IceBoard* board, int startAddress, int endAddress, bool isChipEraseAllowed);
+FT4222_STATUS WriteEnableFlash(IceBoard* board);
+FT4222_STATUS ReadStatusRegisters(IceBoard* board, uint8* statusRegister1, uint8* statusRegister2);
+FT4222_STATUS EnableQuadFlash(IceBoard* board, QuadEnableMethod quadEnable);
+FT4222_STATUS SetFlashReadMode(IceBoard* board, FlashReadMode readMode, QuadEnableMethod quadEnable);
+FT4222_STATUS ReadFlash(IceBoard* board, int startAddress, std::span<uint8> readBuffer);
+FT4222_STATUS CompareFlash(IceBoard* board, int startAddress, std::span<const uint8> expected, size_t blockSize, std::span<unsigned long long> mismatchBlocks, size_t* firstMismatch);
+FT4222_STATUS SetFlashProgramMode(IceBoard* board, FlashProgramMode programMode, QuadEnableMethod quadEnable);
+FlashProgramMode GetFlashProgramMode(IceBoard* board);
+void FindNonBlankRange(std::span<const uint8> buffer, size_t* first, size_t* last);
+FT4222_STATUS StartPageProgramFlash(IceBoard* board, int pageIndex, int pageOffset, std::span<const uint8> writeBuffer);
+FT4222_STATUS PageProgramFlash(IceBoard* board, int pageIndex, int pageOffset, std::span<const uint8> writeBuffer);
+bool NextPageFlash(IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer, bool isMismatchOnly, int* pageCursor, PageWrite* pageWrite);
+FT4222_STATUS SectorProgramFlash(IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer);
+FT4222_STATUS ReadSectorFlash(IceBoard* board, int sectorIndex, std::span<uint8> readBuffer);
+FT4222_STATUS CheckPageReprogramFlash(IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer, int* mismatchPageCount, bool* isReprogrammable);
+FT4222_STATUS ReprogramPagesFlash(IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer);
+FT4222_STATUS ReadBackSectorFlash(IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer, bool* isProgrammed);
+FT4222_STATUS PlanSectorRetryFlash(IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer, int attempt, SectorRetryAction* action);
+FT4222_STATUS VerifiedSectorProgramFlash(IceBoard* board, int sectorIndex, std::span<const uint8> sectorBuffer);
+std::span<const uint8> ExtractSector(IceBoard* board, std::span<const uint8> fileBuffer, int sectorIndex);
+FT4222_STATUS ProgramFlash(IceBoard* board, std::span<const uint8> fileBuffer);
+FT4222_STATUS FindChangedSectorsFlash(IceBoard* board, std::span<const uint8> fileBuffer, std::vector<int>* changedSectors);
+size_t FindSectorRunEnd(const std::vector<int>& sectors, size_t runStart);
+FT4222_STATUS ProgramChangedSectorsFlash(IceBoard* board, std::span<const uint8> fileBuffer, const std::vector<int>& changedSectors);
+FT4222_STATUS DiffProgramFlash(IceBoard* board, std::span<const uint8> fileBuffer, int* changedSectorCount);
+FT4222_STATUS InterleavedProgramFlash(IceBoard* board, std::span<const uint8> fileBuffer);
+FT4222_STATUS ValidateFlash(IceBoard* board, std::span<const uint8> fileBuffer);
+unsigned long long HashImage(std::span<const uint8> buffer, unsigned long long hash);
+FT4222_STATUS HashValidateFlash(IceBoard* board, std::span<const uint8> fileBuffer);
+void SetVerifyPolicy(IceBoard* board, VerifyPolicy verifyPolicy);
+VerifyPolicy GetVerifyPolicy(IceBoard* board);
+size_t GetVerifyBytesRead(IceBoard* board);
+const std::vector<SectorRetry>& GetSectorRetries(IceBoard* board);
+FT4222_STATUS VerifyStepFlash(IceBoard* board, std::span<const uint8> fileBuffer, VerifyProgress* progress, bool* isDone);
+FT4222_STATUS VerifyFlash(IceBoard* board, std::span<const uint8> fileBuffer);
+FT4222_STATUS LoadSramFpga(IceBoard* board, std::span<const uint8> bitstream, GPIO_Port cresetPort, GPIO_Port cdonePort);
 
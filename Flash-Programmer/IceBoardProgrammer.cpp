@@ -2,10 +2,83 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <chrono>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <algorithm>
 #include <time.h>
 #include "ftd2xx.h"
 #include "LibFT4222.h"
 #include "IceBoard.h"
+#include "SimulatedFlash.h"
+#include "AsyncProgrammer.h"
+#include "MappedImage.h"
+#include "ImageStream.h"
+#include "Manifest.h"
+#include "Trace.h"
+
+struct ProgrammerOptions
+{
+    std::string filePath;
+    bool isSimulated = false;
+    SimulatedFlashConfig simulatedFlash;
+    FlashReadMode readMode = FastReadMode;
+    FlashProgramMode programMode = SingleProgramMode;
+    QuadEnableMethod quadEnable = QuadEnableStatus2Bit1;
+    bool isQuadEnableSet = false;
+    bool isAutotune = false;
+    int scratchSectorIndex = -1;
+    std::string profilePath = "IceBoard-Profiles.txt";
+    bool isDiff = false;
+    const FlashDescriptor* flashPart = nullptr;
+    bool isAll = false;
+    std::vector<std::string> serialNumbers;
+    std::vector<DWORD> locationIds;
+    int simulatedBoardCount = 1;
+    int chipCount = 1;
+    bool isAsync = false;
+    VerifyPolicy verifyPolicy = InlineVerify;
+    bool isManifest = false;
+    int manifestSectorIndex = -1;
+    bool isSram = false;
+    GPIO_Port cresetPort = DEFAULT_CRESET_PORT;
+    GPIO_Port cdonePort = DEFAULT_CDONE_PORT;
+    std::string reportPath;
+    std::string tracePath;
+    UsbTuning usbTuning = DEFAULT_USB_TUNING;
+};
+
+const std::map<std::string, FlashReadMode> readModeNames =
+{
+    {"single", SingleReadMode},
+    {"fast", FastReadMode},
+    {"dual", DualOutputReadMode},
+    {"quad", QuadOutputReadMode},
+    {"quad-io", QuadIOReadMode}
+};
+
+const std::map<std::string, FlashProgramMode> programModeNames =
+{
+    {"single", SingleProgramMode},
+    {"quad", QuadInputProgramMode}
+};
+
+const std::map<std::string, VerifyPolicy> verifyPolicyNames =
+{
+    {"inline", InlineVerify},
+    {"deferred", DeferredVerify},
+    {"hash", HashVerify},
+    {"none", NoVerify}
+};
+
+const std::map<std::string, QuadEnableMethod> quadEnableNames =
+{
+    {"none", NoQuadEnableBit},
+    {"sr1-bit6", QuadEnableStatus1Bit6},
+    {"sr2-bit1", QuadEnableStatus2Bit1}
+};
 
 void HandleStatus(int status)
 {
@@ -32,12 +105,6 @@ std::vector<uint8> OpenFile(std::string filePath)
     fileSize = (int)file.tellg();
     file.seekg(0, file.beg);
 
-    if (fileSize > FLASH_SIZE)
-    {
-        std::cout << "Too large file" << std::endl;
-        exit(EXIT_FAILURE);
-    }
-
     fileBuffer.resize(fileSize);
     file.read((char*)&fileBuffer[0], fileSize);
     file.close();
@@ -45,25 +112,837 @@ std::vector<uint8> OpenFile(std::string filePath)
     return fileBuffer;
 }
 
+/*
+* Looks up the tuned SPI clock of the board with serialNumber in the profile file
+* Every line of the file is "<serial number> <system clock> <divider>"
+* Returns false if the file or the board is not found
+*/
+bool LoadClockProfile(const std::string& profilePath, const std::string& serialNumber, SpiClockSetting* clockSetting)
+{
+    std::ifstream file(profilePath);
+    std::string lineSerialNumber;
+    int systemClock;
+    int divider;
+
+    while (file >> lineSerialNumber >> systemClock >> divider)
+    {
+        if (lineSerialNumber == serialNumber)
+        {
+            clockSetting->systemClock = (FT4222_ClockRate)systemClock;
+            clockSetting->divider = (FT4222_SPIClock)divider;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+* Stores the tuned SPI clock of the board with serialNumber in the profile file, replacing an earlier entry for the board
+*/
+void SaveClockProfile(const std::string& profilePath, const std::string& serialNumber, SpiClockSetting clockSetting)
+{
+    std::vector<std::string> lines;
+    std::string line;
+
+    std::ifstream inputFile(profilePath);
+    while (std::getline(inputFile, line))
+    {
+        if (!line.empty() && line.compare(0, serialNumber.size() + 1, serialNumber + " ") != 0)
+            lines.push_back(line);
+    }
+    inputFile.close();
+
+    lines.push_back(serialNumber + " " + std::to_string(clockSetting.systemClock) + " " + std::to_string(clockSetting.divider));
+
+    std::ofstream outputFile(profilePath, std::ofstream::trunc);
+    for (const std::string& profileLine : lines)
+        outputFile << profileLine << std::endl;
+}
+
+void PrintUsage()
+{
+    std::cout << "Usage: ./IceBoard-Programmer.exe [options] <Filename>.bin" << std::endl;
+    std::cout << "       <Filename> may be - to read the image from stdin or name a pipe, it is programmed while it arrives" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  --simulate              Program an in-process simulated flash instead of an Ice Board" << std::endl;
+    std::cout << "  --usb-latency-us <n>    USB latency of every transfer to the simulated flash (default 1000)" << std::endl;
+    std::cout << "  --sim-max-clock-hz <n>  Fastest SPI clock the simulated board reads back without bit errors (default 30000000)" << std::endl;
+    std::cout << "  --sim-flash-image <file> Content of the simulated flash before programming (default erased)" << std::endl;
+    std::cout << "  --sim-boards <n>        Number of simulated boards programmed in parallel (default 1)" << std::endl;
+    std::cout << "  --all                   Program every connected Ice Board in parallel" << std::endl;
+    std::cout << "  --serial <serial>       Program the Ice Board with this FT4222 serial number, may be given several times" << std::endl;
+    std::cout << "  --location <id>         Program the Ice Board at this USB location id, may be given several times" << std::endl;
+    std::cout << "  --autotune              Find the fastest stable SPI clock and store it in the profile file" << std::endl;
+    std::cout << "  --scratch-sector <n>    Sector overwritten by --autotune (default last sector)" << std::endl;
+    std::cout << "  --profile <file>        Profile file with tuned SPI clocks per board (default IceBoard-Profiles.txt)" << std::endl;
+    std::cout << "  --read-mode <mode>      single, fast, dual, quad or quad-io (default fast)" << std::endl;
+    std::cout << "                          dual and quad modes require IO1-IO3 of the flash to be wired to the FT4222" << std::endl;
+    std::cout << "  --program-mode <mode>   single or quad (default single), quad falls back to single if the flash does not support it" << std::endl;
+    std::cout << "  --quad-enable <bit>     Location of the flash Quad Enable bit: none, sr1-bit6 or sr2-bit1 (default from the flash SFDP tables)" << std::endl;
+    std::cout << "  --verify <policy>       inline, deferred, hash or none (default inline): read back every sector after programming it," << std::endl;
+    std::cout << "                          the whole image once at the end, the whole image compared by hash, or nothing" << std::endl;
+    std::cout << "  --manifest              Keep a manifest with hashes of the image in the last sector, an image that is already on the flash" << std::endl;
+    std::cout << "                          is skipped and a changed one is diffed by the hashes without reading the flash (not with --async or --chips)" << std::endl;
+    std::cout << "  --manifest-sector <n>   Sector used for the manifest (default last sector), without --manifest a manifest found there is erased" << std::endl;
+    std::cout << "  --diff                  Skip the chip erase and only erase and program the sectors that differ from the flash" << std::endl;
+    std::cout << "  --flash-part <part>     Use the settings of a known flash instead of reading JEDEC ID and SFDP: generic or w25q" << std::endl;
+    std::cout << "  --async                 Program all boards from one thread with coroutines instead of one thread per board (not with --chips)" << std::endl;
+    std::cout << "  --chips <n>             Number of flashes on the slave selects SS0-SS3 of every board, all get the same image (default 1)" << std::endl;
+    std::cout << "  --sram                  Load the image straight into the SRAM of the iCE40 instead of programming the flash, it is lost at power off" << std::endl;
+    std::cout << "                          (not with --diff, --manifest, --autotune, --async or --chips)" << std::endl;
+    std::cout << "  --report <file>         Write the time per phase, the transfer counts and latencies of every board to file as JSON" << std::endl;
+    std::cout << "  --usb-latency-timer <ms> Latency timer of the FT4222 driver, 2 to 255 (default 2)" << std::endl;
+    std::cout << "  --usb-transfer-size <n> Size of the USB requests the driver reads with, a multiple of 64 up to 65536 (default 65536)" << std::endl;
+    std::cout << "  --trace <file>          Write every SPI transfer and the busy time of the flashes to file as a Chrome trace for Perfetto" << std::endl;
+    std::cout << "  --creset-gpio <n>       FT4222 GPIO0-GPIO3 wired to CRESET_B of the iCE40 (default 2)" << std::endl;
+    std::cout << "  --cdone-gpio <n>        FT4222 GPIO0-GPIO3 wired to CDONE of the iCE40 (default 3)" << std::endl;
+}
+
+/*
+* Parses the command line into options
+* Returns false if the command line is not valid
+*/
+bool ParseArguments(int argc, char const* argv[], ProgrammerOptions* options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string argument = argv[i];
+        const bool hasValue = i + 1 < argc;
+
+        if (argument == "--simulate")
+            options->isSimulated = true;
+        else if (argument == "--usb-latency-us" && hasValue)
+            options->simulatedFlash.usbLatencyUs = std::stoi(argv[++i]);
+        else if (argument == "--sim-max-clock-hz" && hasValue)
+            options->simulatedFlash.maxStableSpiClockHz = std::stoi(argv[++i]);
+        else if (argument == "--sim-flash-image" && hasValue)
+            options->simulatedFlash.initialContents = OpenFile(argv[++i]);
+        else if (argument == "--autotune")
+            options->isAutotune = true;
+        else if (argument == "--scratch-sector" && hasValue)
+            options->scratchSectorIndex = std::stoi(argv[++i]);
+        else if (argument == "--profile" && hasValue)
+            options->profilePath = argv[++i];
+        else if (argument == "--read-mode" && hasValue && readModeNames.count(argv[i + 1]) != 0)
+            options->readMode = readModeNames.at(argv[++i]);
+        else if (argument == "--program-mode" && hasValue && programModeNames.count(argv[i + 1]) != 0)
+            options->programMode = programModeNames.at(argv[++i]);
+        else if (argument == "--quad-enable" && hasValue && quadEnableNames.count(argv[i + 1]) != 0)
+        {
+            options->quadEnable = quadEnableNames.at(argv[++i]);
+            options->isQuadEnableSet = true;
+        }
+        else if (argument == "--verify" && hasValue && verifyPolicyNames.count(argv[i + 1]) != 0)
+            options->verifyPolicy = verifyPolicyNames.at(argv[++i]);
+        else if (argument == "--manifest")
+            options->isManifest = true;
+        else if (argument == "--manifest-sector" && hasValue)
+        {
+            options->manifestSectorIndex = std::stoi(argv[++i]);
+        }
+        else if (argument == "--diff")
+            options->isDiff = true;
+        else if (argument == "--all")
+            options->isAll = true;
+        else if (argument == "--serial" && hasValue)
+            options->serialNumbers.push_back(argv[++i]);
+        else if (argument == "--location" && hasValue)
+            options->locationIds.push_back((DWORD)std::stoul(argv[++i], nullptr, 0));
+        else if (argument == "--sim-boards" && hasValue)
+            options->simulatedBoardCount = std::max(1, std::stoi(argv[++i]));
+        else if (argument == "--async")
+            options->isAsync = true;
+        else if (argument == "--chips" && hasValue)
+        {
+            options->chipCount = std::stoi(argv[++i]);
+            if (options->chipCount < 1 || options->chipCount > MAX_CHIP_COUNT)
+                return false;
+        }
+        else if (argument == "--report" && hasValue)
+            options->reportPath = argv[++i];
+        else if (argument == "--trace" && hasValue)
+            options->tracePath = argv[++i];
+        else if (argument == "--usb-latency-timer" && hasValue)
+        {
+            const int latencyTimerMs = std::stoi(argv[++i]);
+            if (latencyTimerMs < 2 || latencyTimerMs > 255)
+                return false;
+            options->usbTuning.latencyTimerMs = (uint8)latencyTimerMs;
+        }
+        else if (argument == "--usb-transfer-size" && hasValue)
+        {
+            const int inTransferSize = std::stoi(argv[++i]);
+            if (inTransferSize < 64 || inTransferSize > 65536 || inTransferSize % 64 != 0)
+                return false;
+            options->usbTuning.inTransferSize = (DWORD)inTransferSize;
+        }
+        else if (argument == "--sram")
+            options->isSram = true;
+        else if ((argument == "--creset-gpio" || argument == "--cdone-gpio") && hasValue)
+        {
+            const int port = std::stoi(argv[++i]);
+            if (port < GPIO_PORT0 || port > GPIO_PORT3)
+                return false;
+            // The simulated board is wired as given
+            if (argument == "--creset-gpio")
+                options->cresetPort = options->simulatedFlash.cresetPort = (GPIO_Port)port;
+            else
+                options->cdonePort = options->simulatedFlash.cdonePort = (GPIO_Port)port;
+        }
+        else if (argument == "--flash-part" && hasValue && FindKnownFlashPart(std::string(argv[i + 1])) != nullptr)
+            options->flashPart = FindKnownFlashPart(std::string(argv[++i]));
+        else if (argument.compare(0, 2, "--") != 0 && options->filePath.empty())
+            options->filePath = argument;
+        else
+            return false;
+    }
+
+    // The coroutine engine programs one flash per board
+    if (options->isAsync && options->chipCount > 1)
+        return false;
+
+    // The manifest describes the image on one flash
+    if (options->isManifest && (options->isAsync || options->chipCount > 1))
+        return false;
+
+    // Loading the SRAM does not touch the flash, and the GPIO pins are only free with a single slave select
+    if (options->isSram && (options->isDiff || options->isManifest || options->isAutotune || options->isAsync || options->chipCount > 1))
+        return false;
+    if (options->cresetPort == options->cdonePort)
+        return false;
+
+    return !options->filePath.empty();
+}
+
+/*
+* Result of programming one board, filled in by the worker thread of the board
+*/
+struct BoardReport
+{
+    std::ostringstream log;     // Messages of the board, printed once all boards are done
+    int status = FT4222_OK;     // First error, FT4222_OK if the board was programmed and validated
+};
+
+// Serializes access to the profile file, which the workers of all boards read and may write
+std::mutex profileFileMutex;
+
+/*
+* Returns the sector that holds the manifest of the image, the last sector of the flash unless --manifest-sector is given
+*/
+int ManifestSectorIndex(IceBoard* board, const ProgrammerOptions& options)
+{
+    const FlashDescriptor& flashDescriptor = GetFlashDescriptor(board);
+    return options.manifestSectorIndex < 0 ? flashDescriptor.size / flashDescriptor.sectorSize - 1 : options.manifestSectorIndex;
+}
+
+/*
+* Gets one initialized board ready to program an image of imageSize bytes: wakes up and identifies the flash, selects the read and program modes and the SPI clock
+* imageSize is 0 for a stream, whose size is checked against the flash while it arrives
+* Writes its messages to log and returns the status of the first step that failed
+*/
+FT4222_STATUS PrepareBoard(IceBoard* board, const ProgrammerOptions& options, size_t imageSize, std::ostream& log)
+{
+    FT4222_STATUS status;
+
+    SetVerifyPolicy(board, options.verifyPolicy);
+
+    for (int chip = 0; chip < options.chipCount; chip++)
+    {
+        status = SelectChipFlash(board, chip);
+        if (status != FT4222_OK)
+            return status;
+
+        status = WakeUpFlash(board);
+        if (status != FT4222_OK)
+            return status;
+    }
+
+    status = SelectChipFlash(board, 0);
+    if (status != FT4222_OK)
+        return status;
+
+    FlashDescriptor flashDescriptor;
+    if (options.flashPart != nullptr)
+        flashDescriptor = *options.flashPart;
+    else
+    {
+        status = DetectFlash(board, &flashDescriptor);
+        if (status != FT4222_OK)
+            return status;
+    }
+    SetFlashDescriptor(board, flashDescriptor);
+    log << "Flash " << flashDescriptor.name << ", " << flashDescriptor.size << " Bytes" << std::endl;
+
+    // The flashes on the other slave selects are programmed with the descriptor of the first, they must be the same part
+    for (int chip = 1; chip < options.chipCount && options.flashPart == nullptr; chip++)
+    {
+        status = SelectChipFlash(board, chip);
+        if (status != FT4222_OK)
+            return status;
+
+        uint8 jedecId[3];
+        status = ReadJedecIdFlash(board, jedecId);
+        if (status != FT4222_OK)
+            return status;
+
+        if (!std::equal(jedecId, jedecId + 3, flashDescriptor.jedecId))
+            return FT4222_FLASH_MISMATCH;
+    }
+
+    if (imageSize > (size_t)flashDescriptor.size)
+    {
+        log << "Too large file" << std::endl;
+        return FT4222_INVALID_PARAMETER;
+    }
+    const int scratchSectorIndex = options.scratchSectorIndex < 0 ? flashDescriptor.size / flashDescriptor.sectorSize - 1 : options.scratchSectorIndex;
+
+    // The Quad Enable bit is set in every flash, a mode one of them does not support is not used for any
+    const QuadEnableMethod quadEnable = options.isQuadEnableSet ? options.quadEnable : flashDescriptor.quadEnable;
+    FlashReadMode readMode = options.readMode;
+    FlashProgramMode programMode = options.programMode;
+    for (int chip = 0; chip < options.chipCount; chip++)
+    {
+        status = SelectChipFlash(board, chip);
+        if (status != FT4222_OK)
+            return status;
+
+        status = SetFlashReadMode(board, readMode, quadEnable);
+        if (status == FT4222_FUN_NOT_SUPPORT)
+        {
+            log << "Flash does not support the selected read mode, reading in fast mode" << std::endl;
+            readMode = FastReadMode;
+            status = SetFlashReadMode(board, readMode, quadEnable);
+        }
+        if (status != FT4222_OK)
+            return status;
+        if (SetFlashProgramMode(board, programMode, quadEnable) != FT4222_OK)
+        {
+            log << "Flash does not support quad page program, programming in single mode" << std::endl;
+            programMode = SingleProgramMode;
+        }
+    }
+
+    status = SelectChipFlash(board, 0);
+    if (status != FT4222_OK)
+        return status;
+
+    SpiClockSetting clockSetting;
+    if (options.isAutotune)
+    {
+        status = AutotuneSpiClock(board, scratchSectorIndex, &clockSetting);
+        if (status != FT4222_OK)
+            return status;
+
+        std::lock_guard<std::mutex> lock(profileFileMutex);
+        SaveClockProfile(options.profilePath, GetBoardSerialNumber(board), clockSetting);
+        log << "Tuned SPI clock to " << SpiClockHz(clockSetting) << " Hz" << std::endl;
+    }
+    else
+    {
+        std::unique_lock<std::mutex> lock(profileFileMutex);
+        bool isProfileFound = LoadClockProfile(options.profilePath, GetBoardSerialNumber(board), &clockSetting);
+        lock.unlock();
+
+        if (isProfileFound)
+        {
+            status = SetSpiClock(board, clockSetting);
+            if (status != FT4222_OK)
+                return status;
+            log << "Using tuned SPI clock of " << SpiClockHz(clockSetting) << " Hz" << std::endl;
+        }
+    }
+
+    // Without --manifest the image is changed without a new manifest, one left by an earlier run would describe the old image
+    // An image that covers the manifest sector erases it anyway, a stream may end anywhere so it is always checked
+    const int manifestSectorIndex = ManifestSectorIndex(board, options);
+    if (!options.isManifest && imageSize <= (size_t)manifestSectorIndex * flashDescriptor.sectorSize)
+    {
+        for (int chip = 0; chip < options.chipCount; chip++)
+        {
+            status = SelectChipFlash(board, chip);
+            if (status != FT4222_OK)
+                return status;
+
+            status = InvalidateManifestFlash(board, manifestSectorIndex);
+            if (status != FT4222_OK)
+                return status;
+        }
+
+        status = SelectChipFlash(board, 0);
+        if (status != FT4222_OK)
+            return status;
+    }
+
+    return status;
+}
+
+/*
+* Writes the result of a successful upload that started at uploadStart to log
+* isProgrammed is false if the flash already held the image and nothing was written, otherwise the verify policy that ran is named
+*/
+void LogUploadResult(IceBoard* board, const ProgrammerOptions& options, std::chrono::steady_clock::time_point uploadStart, bool isProgrammed, std::ostream& log)
+{
+    auto uploadTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - uploadStart).count();
+    if (isProgrammed)
+    {
+        std::string verifyPolicyName;
+        for (const auto& [name, verifyPolicy] : verifyPolicyNames)
+        {
+            if (verifyPolicy == options.verifyPolicy)
+                verifyPolicyName = name;
+        }
+
+        if (options.programMode == QuadInputProgramMode && GetFlashProgramMode(board) != QuadInputProgramMode)
+            log << "Quad page program did not verify, fell back to single mode" << std::endl;
+        log << "Success! Flash is programmed" << std::endl;
+        log << "Programmed (verify: " << verifyPolicyName << ") in " << uploadTimeMs << " ms using " << GetUsbTransferCount(board) << " USB transfers" << std::endl;
+    }
+    else
+    {
+        log << "Success! Nothing was programmed" << std::endl;
+        log << "Checked in " << uploadTimeMs << " ms using " << GetUsbTransferCount(board) << " USB transfers" << std::endl;
+    }
+    log << "Read back " << GetVerifyBytesRead(board) << " Bytes to verify" << std::endl;
+    for (const SectorRetry& retry : GetSectorRetries(board))
+        log << "Sector " << retry.sectorIndex << " retried: " << retry.pageReprogramCount << " pages programmed again, " << retry.eraseCount << " erases" << std::endl;
+}
+
+/*
+* Programs and validates fileBuffer on one initialized board and writes its messages to log
+* Returns the status of the first step that failed
+*/
+int ProgramBoard(IceBoard* board, const ProgrammerOptions& options, std::span<const uint8> fileBuffer, std::ostream& log)
+{
+    FT4222_STATUS status;
+
+    status = PrepareBoard(board, options, fileBuffer.size(), log);
+    if (status != FT4222_OK)
+        return status;
+
+    const int sectorSize = GetFlashDescriptor(board).sectorSize;
+    const int manifestSectorIndex = ManifestSectorIndex(board, options);
+    auto uploadStart = std::chrono::steady_clock::now();
+
+    // With a manifest on the flash the image is compared by its hashes, the flash is not read beyond the manifest sector
+    ImageManifest imageManifest;
+    std::vector<int> changedSectors;
+    bool isManifestDiff = false;
+    if (options.isManifest)
+    {
+        if (fileBuffer.size() > (size_t)manifestSectorIndex * sectorSize)
+        {
+            log << "The image overlaps the manifest sector" << std::endl;
+            return FT4222_INVALID_PARAMETER;
+        }
+
+        BuildManifest(fileBuffer, sectorSize, &imageManifest);
+
+        ImageManifest flashManifest;
+        bool isManifestFound;
+        status = ReadManifestFlash(board, manifestSectorIndex, &flashManifest, &isManifestFound);
+        if (status != FT4222_OK)
+            return status;
+
+        if (isManifestFound && IsManifestMatching(flashManifest, imageManifest))
+        {
+            bool isConfirmed;
+            status = ConfirmManifestFlash(board, fileBuffer, &isConfirmed);
+            if (status != FT4222_OK)
+                return status;
+
+            if (isConfirmed)
+            {
+                log << "Flash already holds the image according to its manifest" << std::endl;
+                LogUploadResult(board, options, uploadStart, false, log);
+                return status;
+            }
+
+            // The flash was changed behind the back of the manifest, none of its hashes can be trusted
+            log << "Flash does not hold the image its manifest describes, ignoring the manifest" << std::endl;
+            isManifestFound = false;
+        }
+        isManifestDiff = isManifestFound && FindChangedSectorsManifest(flashManifest, imageManifest, &changedSectors);
+
+        // The manifest no longer describes the flash once the first sector changes, an upload that is cut short must not leave it behind
+        status = EraseSector(board, manifestSectorIndex);
+        if (status != FT4222_OK)
+            return status;
+    }
+
+    log << "Uploading " << fileBuffer.size() << " Bytes" << std::endl;
+    if (isManifestDiff)
+    {
+        status = ProgramChangedSectorsFlash(board, fileBuffer, changedSectors);
+        if (status != FT4222_OK)
+            return status;
+        log << changedSectors.size() << " of " << 1 + (fileBuffer.size() - 1) / sectorSize << " sectors changed according to the manifest" << std::endl;
+    }
+    else if (options.isDiff)
+    {
+        for (int chip = 0; chip < options.chipCount; chip++)
+        {
+            status = SelectChipFlash(board, chip);
+            if (status != FT4222_OK)
+                return status;
+
+            int changedSectorCount;
+            status = DiffProgramFlash(board, fileBuffer, &changedSectorCount);
+            if (status != FT4222_OK)
+                return status;
+            log << (options.chipCount > 1 ? "SS" + std::to_string(chip) + ": " : "");
+            log << changedSectorCount << " of " << 1 + (fileBuffer.size() - 1) / sectorSize << " sectors changed" << std::endl;
+        }
+    }
+    else if (options.chipCount > 1)
+    {
+        status = InterleavedProgramFlash(board, fileBuffer);
+        if (status != FT4222_OK)
+            return status;
+    }
+    else
+    {
+        status = EraseRangeFlash(board, 0, (int)fileBuffer.size(), true);
+        if (status != FT4222_OK)
+            return status;
+
+        status = ProgramFlash(board, fileBuffer);
+        if (status != FT4222_OK)
+            return status;
+    }
+
+    for (int chip = 0; chip < options.chipCount; chip++)
+    {
+        status = SelectChipFlash(board, chip);
+        if (status != FT4222_OK)
+            return status;
+
+        status = VerifyFlash(board, fileBuffer);
+        if (status != FT4222_OK)
+            return status;
+    }
+
+    if (options.isManifest)
+    {
+        status = WriteManifestFlash(board, manifestSectorIndex, imageManifest);
+        if (status != FT4222_OK)
+            return status;
+    }
+
+    LogUploadResult(board, options, uploadStart, true, log);
+
+    return status;
+}
+
+/*
+* Programs and validates the image from stream on one initialized board while the image is still arriving and writes its messages to log
+* Returns the status of the first step that failed
+*/
+int StreamProgramBoard(IceBoard* board, const ProgrammerOptions& options, ImageStream* stream, std::ostream& log)
+{
+    FT4222_STATUS status;
+
+    status = PrepareBoard(board, options, 0, log);
+    if (status != FT4222_OK)
+        return status;
+
+    const int sectorSize = GetFlashDescriptor(board).sectorSize;
+    log << "Uploading stream" << std::endl;
+    auto uploadStart = std::chrono::steady_clock::now();
+
+    int changedSectorCount;
+    status = StreamProgramFlash(board, stream, options.isDiff, &changedSectorCount);
+    if (status != FT4222_OK)
+        return status;
+
+    const std::span<const uint8> fileBuffer = stream->Data();
+    if (fileBuffer.empty())
+    {
+        log << "Empty file" << std::endl;
+        return FT4222_INVALID_PARAMETER;
+    }
+    log << "Received " << fileBuffer.size() << " Bytes" << std::endl;
+    if (options.isDiff)
+        log << changedSectorCount << " of " << 1 + (fileBuffer.size() - 1) / sectorSize << " sectors changed" << std::endl;
+
+    status = VerifyFlash(board, fileBuffer);
+    if (status != FT4222_OK)
+        return status;
+
+    LogUploadResult(board, options, uploadStart, true, log);
+
+    return status;
+}
+
+/*
+* Configures the iCE40 of one initialized board from fileBuffer without writing the flash and writes its messages to log
+* The time is measured the same way as the upload of ProgramBoard, so both can be compared
+* Returns the status of the first step that failed
+*/
+int SramLoadBoard(IceBoard* board, const ProgrammerOptions& options, std::span<const uint8> fileBuffer, std::ostream& log)
+{
+    FT4222_STATUS status;
+
+    log << "Loading " << fileBuffer.size() << " Bytes into the SRAM of the FPGA" << std::endl;
+    auto loadStart = std::chrono::steady_clock::now();
+
+    status = LoadSramFpga(board, fileBuffer, options.cresetPort, options.cdonePort);
+    if (status != FT4222_OK)
+        return status;
+
+    auto loadTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - loadStart).count();
+    log << "Success! FPGA is configured" << std::endl;
+    log << "Configured in " << loadTimeMs << " ms using " << GetUsbTransferCount(board) << " USB transfers" << std::endl;
+
+    return status;
+}
+
+/*
+* Coroutine version of the upload in ProgramBoard for a board that PrepareBoard got ready, run by the scheduler of --async
+*/
+ProgramTask AsyncProgramBoard(ProgramScheduler* scheduler, IceBoard* board, const ProgrammerOptions& options, std::span<const uint8> fileBuffer, std::ostream& log)
+{
+    FT4222_STATUS status;
+
+    const int sectorSize = GetFlashDescriptor(board).sectorSize;
+    log << "Uploading " << fileBuffer.size() << " Bytes" << std::endl;
+    auto uploadStart = std::chrono::steady_clock::now();
+    if (options.isDiff)
+    {
+        int changedSectorCount;
+        status = co_await AsyncDiffProgramFlash(scheduler, board, fileBuffer, &changedSectorCount);
+        if (status != FT4222_OK)
+            co_return status;
+        log << changedSectorCount << " of " << 1 + (fileBuffer.size() - 1) / sectorSize << " sectors changed" << std::endl;
+    }
+    else
+    {
+        status = co_await AsyncEraseRangeFlash(scheduler, board, 0, (int)fileBuffer.size(), true);
+        if (status != FT4222_OK)
+            co_return status;
+
+        status = co_await AsyncProgramFlash(scheduler, board, fileBuffer);
+        if (status != FT4222_OK)
+            co_return status;
+    }
+
+    status = co_await AsyncVerifyFlash(scheduler, board, fileBuffer);
+    if (status != FT4222_OK)
+        co_return status;
+
+    LogUploadResult(board, options, uploadStart, true, log);
+
+    co_return status;
+}
+
+/*
+* Returns the serial numbers of the boards to program as selected by the options
+* Without --serial, --location or --all the first board found is programmed
+*/
+std::vector<std::string> SelectBoards(const ProgrammerOptions& options)
+{
+    std::vector<std::string> serialNumbers;
+
+    if (options.isSimulated)
+    {
+        for (int i = 0; i < options.simulatedBoardCount; i++)
+            serialNumbers.push_back(options.simulatedBoardCount == 1 ? "SIMULATED" : "SIMULATED" + std::to_string(i));
+        return serialNumbers;
+    }
+
+    std::vector<IceBoardInfo> boards;
+    HandleStatus(FindBoards(&boards));
+
+    for (const IceBoardInfo& board : boards)
+    {
+        bool isSelected = options.isAll ||
+            std::find(options.serialNumbers.begin(), options.serialNumbers.end(), board.serialNumber) != options.serialNumbers.end() ||
+            std::find(options.locationIds.begin(), options.locationIds.end(), board.locationId) != options.locationIds.end();
+        if (isSelected)
+            serialNumbers.push_back(board.serialNumber);
+    }
+
+    if (!options.isAll && options.serialNumbers.empty() && options.locationIds.empty())
+        serialNumbers.push_back(boards[0].serialNumber);
+
+    if (serialNumbers.size() < options.serialNumbers.size() + options.locationIds.size())
+    {
+        std::cout << "Not all selected boards are connected" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    return serialNumbers;
+}
+
+/*
+* Returns text as a JSON string literal
+*/
+std::string JsonString(const std::string& text)
+{
+    std::string literal = "\"";
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+            literal += '\\';
+        literal += c;
+    }
+    return literal + "\"";
+}
+
+/*
+* Writes the result and the metrics of every board to the file at reportPath as JSON
+* Returns false if the file could not be written
+*/
+bool WriteReport(const std::string& reportPath, std::vector<IceBoard>& boards, const std::vector<std::string>& serialNumbers, const std::vector<BoardReport>& reports)
+{
+    std::ofstream report(reportPath);
+
+    report << "{" << std::endl;
+    report << "  \"boards\": [" << std::endl;
+    for (size_t i = 0; i < boards.size(); i++)
+    {
+        report << "    {" << std::endl;
+        report << "      \"serial\": " << JsonString(serialNumbers[i]) << "," << std::endl;
+        report << "      \"status\": " << reports[i].status << "," << std::endl;
+        report << "      \"message\": " << JsonString(reports[i].status == FT4222_OK ? "" : statusMessages[reports[i].status]) << "," << std::endl;
+        report << "      \"usbTransfers\": " << GetUsbTransferCount(&boards[i]) << "," << std::endl;
+        report << "      \"verifyBytesRead\": " << GetVerifyBytesRead(&boards[i]) << "," << std::endl;
+        report << "      \"retriedSectors\": " << GetSectorRetries(&boards[i]).size() << "," << std::endl;
+        report << "      \"metrics\": ";
+        WriteMetricsJson(report, GetBoardMetrics(&boards[i]), "      ");
+        report << std::endl;
+        report << "    }" << (i + 1 < boards.size() ? "," : "") << std::endl;
+    }
+    report << "  ]" << std::endl;
+    report << "}" << std::endl;
+
+    return report.good();
+}
+
 int main(int argc, char const* argv[])
 {
-    if (argc != 2)
+    ProgrammerOptions options;
+    if (!ParseArguments(argc, argv, &options))
     {
-        std::cout << "Usage: ./IceBoard-Programmer.exe <Filename>.bin" << std::endl;
+        PrintUsage();
         return EXIT_FAILURE;
     }
 
-    std::vector<uint8> fileBuffer;
-    fileBuffer = OpenFile(argv[1]);
-    
-    HandleStatus(InitBoard());
-    std::cout << "Connection established with Ice Board" << std::endl;
-    HandleStatus(WakeUpFlash());
-    HandleStatus(EraseFlash());
-    std::cout << "Uploading " << fileBuffer.size() << " Bytes" << std::endl;
-    HandleStatus(ProgramFlash(fileBuffer));
-    HandleStatus(ValidateFlash(fileBuffer));
-    std::cout << "Success! Flash is programmed" << std::endl;
-    
-    return EXIT_SUCCESS;
+    // A file is mapped once, a stream from stdin or a pipe is buffered as it arrives, either is shared read-only by the workers of all boards
+    const bool isStream = ImageStream::IsStream(options.filePath);
+    MappedImage image;
+    ImageStream stream;
+    if (isStream && (options.isAsync || options.chipCount > 1 || options.isManifest || options.isSram))
+    {
+        std::cout << "--async, --chips, --manifest and --sram need the whole image, they can not program a stream" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (isStream ? !stream.Open(options.filePath, MAX_FLASH_SIZE) : !image.Open(options.filePath))
+    {
+        std::cout << "Error opening file" << std::endl;
+        return EXIT_FAILURE;
+    }
+    const std::span<const uint8> fileBuffer = image.Data();
+
+    if (!options.tracePath.empty())
+        EnableTrace();
+
+    const std::vector<std::string> serialNumbers = SelectBoards(options);
+    std::vector<IceBoard> boards(serialNumbers.size());
+    std::vector<BoardReport> reports(serialNumbers.size());
+
+    // Boards are opened one after another, then every board is programmed by its own worker
+    for (size_t i = 0; i < boards.size(); i++)
+    {
+        if (options.isSimulated)
+        {
+            reports[i].status = InitSimulatedBoard(&boards[i], options.simulatedFlash, serialNumbers[i], options.chipCount, options.usbTuning);
+            reports[i].log << "Using simulated flash" << std::endl;
+        }
+        else
+        {
+            reports[i].status = InitBoard(&boards[i], serialNumbers[i], options.chipCount, options.usbTuning);
+            reports[i].log << "Connection established with Ice Board" << std::endl;
+        }
+
+        if (reports[i].status == FT4222_OK)
+            reports[i].log << "USB packets of " << GetUsbPacketSize(&boards[i]) << " Bytes, reads in chunks of " << GetReadChunkSize(&boards[i]) << " Bytes" << std::endl;
+    }
+
+    if (options.isAsync)
+    {
+        // Boards are got ready one after another, then this thread uploads to all of them
+        ProgramScheduler scheduler;
+        std::vector<ProgramTask> tasks;
+        std::vector<size_t> taskBoards;
+        tasks.reserve(boards.size());
+        for (size_t i = 0; i < boards.size(); i++)
+        {
+            if (reports[i].status == FT4222_OK)
+                reports[i].status = PrepareBoard(&boards[i], options, fileBuffer.size(), reports[i].log);
+            if (reports[i].status != FT4222_OK)
+                continue;
+
+            tasks.push_back(AsyncProgramBoard(&scheduler, &boards[i], options, fileBuffer, reports[i].log));
+            taskBoards.push_back(i);
+            scheduler.Spawn(tasks.back());
+        }
+        scheduler.Run();
+
+        for (size_t i = 0; i < tasks.size(); i++)
+            reports[taskBoards[i]].status = tasks[i].Result();
+    }
+    else
+    {
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < boards.size(); i++)
+        {
+            if (reports[i].status != FT4222_OK)
+                continue;
+            if (options.isSram)
+                workers.emplace_back([&, i]() { reports[i].status = SramLoadBoard(&boards[i], options, fileBuffer, reports[i].log); });
+            else if (isStream)
+                workers.emplace_back([&, i]() { reports[i].status = StreamProgramBoard(&boards[i], options, &stream, reports[i].log); });
+            else
+                workers.emplace_back([&, i]() { reports[i].status = ProgramBoard(&boards[i], options, fileBuffer, reports[i].log); });
+        }
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    // With several boards every line is prefixed by the serial number of its board, followed by a summary
+    int failedBoardCount = 0;
+    for (size_t i = 0; i < boards.size(); i++)
+    {
+        const std::string prefix = boards.size() > 1 ? "[" + serialNumbers[i] + "] " : "";
+        std::istringstream log(reports[i].log.str());
+        std::string line;
+        while (std::getline(log, line))
+            std::cout << prefix << line << std::endl;
+
+        if (reports[i].status != FT4222_OK)
+        {
+            std::cout << prefix << statusMessages[reports[i].status] << std::endl;
+            failedBoardCount++;
+        }
+    }
+    if (boards.size() > 1)
+        std::cout << boards.size() - failedBoardCount << " of " << boards.size() << " boards programmed" << std::endl;
+
+    if (!options.reportPath.empty() && !WriteReport(options.reportPath, boards, serialNumbers, reports))
+    {
+        std::cout << "Error writing the report" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    size_t droppedEventCount = 0;
+    if (!options.tracePath.empty() && !WriteTrace(options.tracePath, &droppedEventCount))
+    {
+        std::cout << "Error writing the trace" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (droppedEventCount > 0)
+        std::cout << "The trace is missing its first " << droppedEventCount << " events, the rings only keep the last " << TRACE_RING_CAPACITY << " of every thread" << std::endl;
+
+    return failedBoardCount == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,191 @@
+#include <filesystem>
+#include <algorithm>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+#include "ImageStream.h"
+
+const size_t STREAM_READ_SIZE = 4096;   // Bytes the reader thread waits for before it hands them to the workers
+
+ImageStream::~ImageStream()
+{
+    // The reader only stops at the end of the stream, so a producer that is still writing is drained first
+    if (reader.joinable())
+        reader.join();
+    if (file != nullptr && !isStdin)
+        fclose(file);
+}
+
+bool ImageStream::IsStream(const std::string& filePath)
+{
+    std::error_code error;
+    return filePath == "-" || (std::filesystem::exists(filePath, error) && !std::filesystem::is_regular_file(filePath, error));
+}
+
+bool ImageStream::Open(const std::string& filePath, size_t maxSize)
+{
+    if (filePath == "-")
+    {
+#ifdef _WIN32
+        // stdin is opened in text mode, which would translate line endings in the bitstream
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        file = stdin;
+        isStdin = true;
+    }
+    else
+        file = fopen(filePath.c_str(), "rb");
+    if (file == nullptr)
+        return false;
+
+    // The workers get the bytes as soon as fread returns them, not when a stdio buffer is full
+    setvbuf(file, nullptr, _IONBF, 0);
+
+    capacity = maxSize;
+    buffer.reset(new uint8[capacity]);
+    reader = std::thread(&ImageStream::Read, this);
+    return true;
+}
+
+/*
+* Runs on the reader thread until the stream ends, fails or exceeds the capacity of the buffer
+* The bytes are written beyond receivedSize without the lock, the workers only look at them once receivedSize covers them
+*/
+void ImageStream::Read()
+{
+    size_t size = 0;
+    bool isTooLong = false;
+
+    while (size < capacity)
+    {
+        size_t bytesRead = fread(&buffer[size], 1, std::min(STREAM_READ_SIZE, capacity - size), file);
+        if (bytesRead == 0)
+            break;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        size += bytesRead;
+        receivedSize = size;
+        arrived.notify_all();
+    }
+
+    // A full buffer is only too small if the stream has more to give
+    if (size == capacity)
+    {
+        uint8 extraByte;
+        isTooLong = fread(&extraByte, 1, 1, file) == 1;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    isFailed = ferror(file) != 0;
+    isTooLarge = isTooLong;
+    isEnded = true;
+    arrived.notify_all();
+}
+
+size_t ImageStream::WaitForBytes(size_t count)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    arrived.wait(lock, [&]() { return receivedSize >= count || isEnded; });
+    return receivedSize;
+}
+
+bool ImageStream::IsTooLarge()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return isTooLarge;
+}
+
+bool ImageStream::IsFailed()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return isFailed;
+}
+
+std::span<const uint8> ImageStream::Data()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return std::span<const uint8>(buffer.get(), receivedSize);
+}
+
+/*
+* Programs the image from stream to the flash while it is arriving
+* Every sector is erased and programmed as soon as all of its bytes have arrived, only the last sector of the image may be shorter
+* The sectors that arrived together while the previous ones were programmed are erased together with the fewest erase operations PlanEraseFlash finds
+* With isDiff set each arrived sector is read back first and erased and programmed only if it differs, changedSectorCount receives the number of sectors that were
+* The size of the flash is checked with every sector, so a stream that is too large fails with FT4222_IMAGE_TOO_LARGE before the flash is overrun,
+* but after the sectors before have been programmed
+*/
+FT4222_STATUS StreamProgramFlash(IceBoard* board, ImageStream* stream, bool isDiff, int* changedSectorCount)
+{
+    FT4222_STATUS status = FT4222_OK;
+
+    const FlashDescriptor& flashDescriptor = GetFlashDescriptor(board);
+    const size_t sectorSize = flashDescriptor.sectorSize;
+    const size_t flashSize = flashDescriptor.size;
+    size_t programmedSize = 0;     // Bytes of the image that are on the flash, a whole number of sectors until the end of the stream
+
+    *changedSectorCount = 0;
+
+    for (;;)
+    {
+        const size_t receivedSize = stream->WaitForBytes(programmedSize + sectorSize);
+        if (stream->IsFailed())
+            return FT4222_IMAGE_READ_FAILED;
+        if (receivedSize > flashSize || stream->IsTooLarge())
+            return FT4222_IMAGE_TOO_LARGE;
+
+        // All complete sectors that have arrived, and the short last sector once the stream has ended
+        const bool isEnded = receivedSize < programmedSize + sectorSize;
+        const size_t endSize = isEnded ? receivedSize : receivedSize - receivedSize % sectorSize;
+        if (endSize == programmedSize)
+            return status;
+
+        const std::span<const uint8> image = stream->Data().first(endSize);
+        const int firstSector = (int)(programmedSize / sectorSize);
+        const int endSector = (int)((endSize + sectorSize - 1) / sectorSize);
+
+        if (isDiff)
+        {
+            for (int i = firstSector; i < endSector; i++)
+            {
+                const std::span<const uint8> sectorBuffer = ExtractSector(board, image, i);
+
+                size_t firstMismatch;
+                status = CompareFlash(board, (int)(i * sectorSize), sectorBuffer, sectorSize, board->arena.mismatchPages, &firstMismatch);
+                if (status != FT4222_OK)
+                    return status;
+                if (firstMismatch == sectorBuffer.size())
+                    continue;
+
+                status = EraseRangeFlash(board, (int)(i * sectorSize), (int)((i + 1) * sectorSize), false);
+                if (status != FT4222_OK)
+                    return status;
+
+                status = VerifiedSectorProgramFlash(board, i, sectorBuffer);
+                if (status != FT4222_OK)
+                    return status;
+
+                (*changedSectorCount)++;
+            }
+        }
+        else
+        {
+            status = EraseRangeFlash(board, (int)programmedSize, (int)endSize, false);
+            if (status != FT4222_OK)
+                return status;
+
+            for (int i = firstSector; i < endSector; i++)
+            {
+                status = VerifiedSectorProgramFlash(board, i, ExtractSector(board, image, i));
+                if (status != FT4222_OK)
+                    return status;
+            }
+            *changedSectorCount = endSector;
+        }
+
+        programmedSize = endSize;
+        if (isEnded)
+            return status;
+    }
+}
@@ -0,0 +1,67 @@
+/*
+* Bitstream read from stdin or a pipe while the programming is already running
+* A reader thread appends the arriving bytes to a buffer, the workers of all boards wait until the sectors they program next are complete
+* This overlaps writing the image out of place and route with erasing and programming the flash
+*/
+
+#pragma once
+#include <string>
+#include <span>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdio.h>
+#include "IceBoard.h"
+
+class ImageStream
+{
+public:
+    ImageStream() {}
+    ~ImageStream();
+
+    ImageStream(const ImageStream&) = delete;
+    ImageStream& operator=(const ImageStream&) = delete;
+
+    /*
+    * Returns true if filePath is "-" for stdin or names a pipe, anything that is not a regular file with a known size
+    */
+    static bool IsStream(const std::string& filePath);
+
+    /*
+    * Opens filePath, or stdin for "-", and starts reading it on the reader thread
+    * At most maxSize bytes are buffered, a longer stream is reported by IsTooLarge
+    */
+    bool Open(const std::string& filePath, size_t maxSize);
+
+    /*
+    * Blocks until count bytes have arrived or the stream has ended
+    * Returns the number of bytes that have arrived, less than count only at the end of the stream
+    */
+    size_t WaitForBytes(size_t count);
+
+    bool IsTooLarge();
+    bool IsFailed();
+
+    // Bytes that have arrived so far, they are never moved or changed
+    std::span<const uint8> Data();
+
+private:
+    void Read();
+
+    FILE* file = nullptr;
+    bool isStdin = false;
+    std::unique_ptr<uint8[]> buffer;
+    size_t capacity = 0;
+
+    std::mutex mutex;                   // Guards the members below
+    std::condition_variable arrived;    // Notified whenever bytes have arrived or the stream has ended
+    size_t receivedSize = 0;
+    bool isEnded = false;
+    bool isTooLarge = false;
+    bool isFailed = false;
+
+    std::thread reader;
+};
+
+FT4222_STATUS StreamProgramFlash(IceBoard* board, ImageStream* stream, bool isDiff, int* changedSectorCount);
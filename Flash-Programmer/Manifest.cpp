@@ -0,0 +1,176 @@
+#include <algorithm>
+#include "Manifest.h"
+
+static void PutWord(std::span<uint8> buffer, size_t offset, unsigned long long value, int size)
+{
+    for (int i = 0; i < size; i++)
+        buffer[offset + i] = (uint8)(value >> (8 * i));
+}
+
+static unsigned long long GetWord(std::span<const uint8> buffer, size_t offset, int size)
+{
+    unsigned long long value = 0;
+    for (int i = 0; i < size; i++)
+        value |= (unsigned long long)buffer[offset + i] << (8 * i);
+    return value;
+}
+
+/*
+* Returns the number of sector hashes that fit in a manifest sector of sectorSize bytes
+*/
+static size_t ManifestCapacity(int sectorSize)
+{
+    return (sectorSize - MANIFEST_HEADER_SIZE - MANIFEST_HASH_SIZE) / MANIFEST_HASH_SIZE;
+}
+
+/*
+* Fills manifest with the size and hashes of image, divided in sectors of sectorSize bytes
+*/
+void BuildManifest(std::span<const uint8> image, int sectorSize, ImageManifest* manifest)
+{
+    const size_t sectorCount = (image.size() + sectorSize - 1) / sectorSize;
+
+    manifest->imageSize = (uint32)image.size();
+    manifest->sectorSize = sectorSize;
+    manifest->imageHash = HashImage(image, IMAGE_HASH_SEED);
+    manifest->sectorHashes.clear();
+
+    if (sectorCount > ManifestCapacity(sectorSize))
+        return;
+
+    for (size_t i = 0; i < sectorCount; i++)
+    {
+        const size_t first = i * sectorSize;
+        manifest->sectorHashes.push_back(HashImage(image.subspan(first, std::min((size_t)sectorSize, image.size() - first)), IMAGE_HASH_SEED));
+    }
+}
+
+/*
+* Returns true if the image described by flashManifest is the one described by imageManifest
+*/
+bool IsManifestMatching(const ImageManifest& flashManifest, const ImageManifest& imageManifest)
+{
+    return flashManifest.imageSize == imageManifest.imageSize && flashManifest.imageHash == imageManifest.imageHash;
+}
+
+/*
+* Stores the indices of the sectors of the image of imageManifest that differ from the image on the flash in changedSectors, judged by their hashes
+* A sector beyond the end of the image on the flash counts as changed, a last sector that got shorter or longer has a different hash
+* Returns false if the manifests have no sector hashes of the same sector size to compare
+*/
+bool FindChangedSectorsManifest(const ImageManifest& flashManifest, const ImageManifest& imageManifest, std::vector<int>* changedSectors)
+{
+    if (flashManifest.sectorSize != imageManifest.sectorSize || flashManifest.sectorHashes.empty() || imageManifest.sectorHashes.empty())
+        return false;
+
+    changedSectors->clear();
+    for (size_t i = 0; i < imageManifest.sectorHashes.size(); i++)
+    {
+        if (i >= flashManifest.sectorHashes.size() || flashManifest.sectorHashes[i] != imageManifest.sectorHashes[i])
+            changedSectors->push_back((int)i);
+    }
+
+    return true;
+}
+
+/*
+* Reads the manifest in the sector at sectorIndex
+* isFound is false if the sector does not hold a complete manifest for sectors of the size of the flash, e.g. because it is erased
+*/
+FT4222_STATUS ReadManifestFlash(IceBoard* board, int sectorIndex, ImageManifest* manifest, bool* isFound)
+{
+    FT4222_STATUS status;
+
+    const int sectorSize = GetFlashDescriptor(board).sectorSize;
+    std::vector<uint8> sectorBuffer(sectorSize);
+
+    *isFound = false;
+
+    status = ReadSectorFlash(board, sectorIndex, sectorBuffer);
+    if (status != FT4222_OK)
+        return status;
+
+    const std::span<const uint8> buffer(sectorBuffer);
+    if (GetWord(buffer, 0, 4) != MANIFEST_MAGIC || GetWord(buffer, 4, 4) != MANIFEST_VERSION || GetWord(buffer, 12, 4) != (uint32)sectorSize)
+        return status;
+
+    const size_t hashCount = GetWord(buffer, 16, 4);
+    if (hashCount > ManifestCapacity(sectorSize))
+        return status;
+
+    // A manifest whose programming was cut short does not match its own hash
+    const size_t manifestSize = MANIFEST_HEADER_SIZE + hashCount * MANIFEST_HASH_SIZE;
+    if (GetWord(buffer, manifestSize, MANIFEST_HASH_SIZE) != HashImage(buffer.first(manifestSize), IMAGE_HASH_SEED))
+        return status;
+
+    manifest->imageSize = (uint32)GetWord(buffer, 8, 4);
+    manifest->sectorSize = (uint32)sectorSize;
+    manifest->imageHash = GetWord(buffer, 20, MANIFEST_HASH_SIZE);
+    manifest->sectorHashes.resize(hashCount);
+    for (size_t i = 0; i < hashCount; i++)
+        manifest->sectorHashes[i] = GetWord(buffer, MANIFEST_HEADER_SIZE + i * MANIFEST_HASH_SIZE, MANIFEST_HASH_SIZE);
+
+    *isFound = true;
+    return status;
+}
+
+/*
+* Reads the first sector of image back from the flash and compares it, a cheap check that the flash still holds the image a matching manifest describes
+* It catches an image written by another tool that left the manifest sector alone
+*/
+FT4222_STATUS ConfirmManifestFlash(IceBoard* board, std::span<const uint8> image, bool* isConfirmed)
+{
+    FT4222_STATUS status;
+
+    std::vector<uint8> readBuffer(std::min(image.size(), (size_t)GetFlashDescriptor(board).sectorSize));
+
+    *isConfirmed = false;
+
+    status = ReadFlash(board, 0, readBuffer);
+    if (status != FT4222_OK)
+        return status;
+
+    *isConfirmed = std::equal(readBuffer.begin(), readBuffer.end(), image.begin());
+    return status;
+}
+
+/*
+* Erases the sector at sectorIndex if it holds a manifest, the sector is only read if it does not
+* Must be called before the flash is changed without writing a new manifest, a later run with a manifest would trust the old one
+*/
+FT4222_STATUS InvalidateManifestFlash(IceBoard* board, int sectorIndex)
+{
+    FT4222_STATUS status;
+
+    ImageManifest manifest;
+    bool isFound;
+    status = ReadManifestFlash(board, sectorIndex, &manifest, &isFound);
+    if (status != FT4222_OK || !isFound)
+        return status;
+
+    return EraseSector(board, sectorIndex);
+}
+
+/*
+* Programs manifest into the sector at sectorIndex, all values are stored little endian
+* The sector must be erased, ProgramBoard erases it before it changes the image
+*/
+FT4222_STATUS WriteManifestFlash(IceBoard* board, int sectorIndex, const ImageManifest& manifest)
+{
+    const int sectorSize = GetFlashDescriptor(board).sectorSize;
+    const size_t manifestSize = MANIFEST_HEADER_SIZE + manifest.sectorHashes.size() * MANIFEST_HASH_SIZE;
+    std::vector<uint8> sectorBuffer(manifestSize + MANIFEST_HASH_SIZE);
+    const std::span<uint8> buffer(sectorBuffer);
+
+    PutWord(buffer, 0, MANIFEST_MAGIC, 4);
+    PutWord(buffer, 4, MANIFEST_VERSION, 4);
+    PutWord(buffer, 8, manifest.imageSize, 4);
+    PutWord(buffer, 12, sectorSize, 4);
+    PutWord(buffer, 16, manifest.sectorHashes.size(), 4);
+    PutWord(buffer, 20, manifest.imageHash, MANIFEST_HASH_SIZE);
+    for (size_t i = 0; i < manifest.sectorHashes.size(); i++)
+        PutWord(buffer, MANIFEST_HEADER_SIZE + i * MANIFEST_HASH_SIZE, manifest.sectorHashes[i], MANIFEST_HASH_SIZE);
+    PutWord(buffer, manifestSize, HashImage(buffer.first(manifestSize), IMAGE_HASH_SEED), MANIFEST_HASH_SIZE);
+
+    return VerifiedSectorProgramFlash(board, sectorIndex, buffer);
+}
@@ -0,0 +1,32 @@
+/*
+* Manifest of the image on the flash, kept in a sector of its own
+* It holds the length and hash of the image and a hash of every sector, so the next upload can tell from this one sector
+* whether the flash already holds an image, or which of its sectors changed, without reading the image back
+* The manifest is only trustworthy if nothing else writes the flash, anything that does must erase the manifest sector
+*/
+
+#pragma once
+#include <vector>
+#include <span>
+#include "IceBoard.h"
+
+const uint32 MANIFEST_MAGIC = 0x4D454349;       // "ICEM" as a little endian 32-bit word
+const uint32 MANIFEST_VERSION = 1;
+const int MANIFEST_HEADER_SIZE = 28;            // Magic, version, image size, sector size, sector hash count and image hash
+const int MANIFEST_HASH_SIZE = 8;               // Size of every hash, the image and sector hashes are followed by a hash of the manifest itself
+
+struct ImageManifest
+{
+    uint32 imageSize = 0;
+    uint32 sectorSize = 0;                          // Size of the sectors the sector hashes cover
+    unsigned long long imageHash = IMAGE_HASH_SEED;
+    std::vector<unsigned long long> sectorHashes;   // Empty if the image has more sectors than fit in the manifest sector
+};
+
+void BuildManifest(std::span<const uint8> image, int sectorSize, ImageManifest* manifest);
+bool IsManifestMatching(const ImageManifest& flashManifest, const ImageManifest& imageManifest);
+bool FindChangedSectorsManifest(const ImageManifest& flashManifest, const ImageManifest& imageManifest, std::vector<int>* changedSectors);
+FT4222_STATUS ReadManifestFlash(IceBoard* board, int sectorIndex, ImageManifest* manifest, bool* isFound);
+FT4222_STATUS ConfirmManifestFlash(IceBoard* board, std::span<const uint8> image, bool* isConfirmed);
+FT4222_STATUS InvalidateManifestFlash(IceBoard* board, int sectorIndex);
+FT4222_STATUS WriteManifestFlash(IceBoard* board, int sectorIndex, const ImageManifest& manifest);
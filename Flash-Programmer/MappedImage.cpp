@@ -0,0 +1,112 @@
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "MappedImage.h"
+
+MappedImage::~MappedImage()
+{
+    Close();
+}
+
+#ifdef _WIN32
+
+bool MappedImage::Open(const std::string& filePath)
+{
+    LARGE_INTEGER fileSize;
+
+    Close();
+
+    file = CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    // A mapping of an empty file can not be created
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+    {
+        Close();
+        return false;
+    }
+
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL)
+    {
+        Close();
+        return false;
+    }
+
+    data = (const uint8*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data == nullptr)
+    {
+        Close();
+        return false;
+    }
+
+    size = (size_t)fileSize.QuadPart;
+    return true;
+}
+
+void MappedImage::Close()
+{
+    if (data != nullptr)
+        UnmapViewOfFile(data);
+    if (mapping != NULL)
+        CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+
+    data = nullptr;
+    size = 0;
+    mapping = NULL;
+    file = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+bool MappedImage::Open(const std::string& filePath)
+{
+    struct stat fileStatus;
+
+    Close();
+
+    file = open(filePath.c_str(), O_RDONLY);
+    if (file < 0)
+        return false;
+
+    // A mapping of an empty file can not be created
+    if (fstat(file, &fileStatus) != 0 || fileStatus.st_size == 0)
+    {
+        Close();
+        return false;
+    }
+
+    void* mapping = mmap(nullptr, (size_t)fileStatus.st_size, PROT_READ, MAP_SHARED, file, 0);
+    if (mapping == MAP_FAILED)
+    {
+        Close();
+        return false;
+    }
+
+    // The image is read front to back, once per sector pass
+    madvise(mapping, (size_t)fileStatus.st_size, MADV_SEQUENTIAL);
+
+    data = (const uint8*)mapping;
+    size = (size_t)fileStatus.st_size;
+    return true;
+}
+
+void MappedImage::Close()
+{
+    if (data != nullptr)
+        munmap((void*)data, size);
+    if (file >= 0)
+        close(file);
+
+    data = nullptr;
+    size = 0;
+    file = -1;
+}
+
+#endif
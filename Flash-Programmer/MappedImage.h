@@ -0,0 +1,41 @@
+/*
+* Read-only memory mapping of the bitstream file
+* The pages of the image are sent straight out of the mapping, so the file is never copied into a buffer
+* and the workers of all boards share the same pages of the OS file cache
+*/
+
+#pragma once
+#include <string>
+#include <span>
+#include "ftd2xx.h"
+#include "LibFT4222.h"
+
+class MappedImage
+{
+public:
+    MappedImage() {}
+    ~MappedImage();
+
+    MappedImage(const MappedImage&) = delete;
+    MappedImage& operator=(const MappedImage&) = delete;
+
+    /*
+    * Maps the whole file at filePath read-only
+    * Returns false if the file can not be opened or mapped, or is empty
+    */
+    bool Open(const std::string& filePath);
+
+    std::span<const uint8> Data() const { return std::span<const uint8>(data, size); }
+
+private:
+    void Close();
+
+    const uint8* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#else
+    int file = -1;
+#endif
+};
@@ -0,0 +1,148 @@
+#include <bit>
+#include <algorithm>
+#include "Metrics.h"
+
+// Indexed by Phase
+static const char* const phaseNames[PHASE_COUNT] = { "other", "init", "detect", "autotune", "erase", "program", "waitReady", "readBack", "compare", "retry", "validate", "sram", "queued" };
+
+// Indexed by TransferType
+static const char* const transferTypeNames[TRANSFER_TYPE_COUNT] = { "write", "read", "readWrite", "multi", "control" };
+
+/*
+* Charges the time since the last switch to the current phase and makes phase the current one
+*/
+static void SwitchPhase(BoardMetrics* metrics, Phase phase)
+{
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    metrics->phases[metrics->phase].time += now - metrics->phaseStart;
+    metrics->phase = phase;
+    metrics->phaseStart = now;
+}
+
+/*
+* Makes phase the current one until LeavePhase is called with the returned phase, inside RetryPhase nothing changes
+*/
+Phase EnterPhase(BoardMetrics* metrics, Phase phase)
+{
+    const Phase previousPhase = metrics->phase;
+    if (previousPhase == RetryPhase)
+        return previousPhase;
+
+    metrics->phases[phase].entryCount++;
+    SwitchPhase(metrics, phase);
+    return previousPhase;
+}
+
+/*
+* Returns the board to previousPhase, as returned by the EnterPhase that is left
+*/
+void LeavePhase(BoardMetrics* metrics, Phase previousPhase)
+{
+    if (previousPhase == RetryPhase)
+        return;
+
+    SwitchPhase(metrics, previousPhase);
+}
+
+/*
+* Charges the time since deadline to QueuedPhase instead of the current phase, called when a coroutine that was suspended until deadline is resumed
+* The time after deadline went to the transfers of other boards, the current phase stays the same
+*/
+void ChargeQueuedTime(BoardMetrics* metrics, std::chrono::steady_clock::time_point deadline)
+{
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    const std::chrono::steady_clock::time_point queuedStart = std::max(deadline, metrics->phaseStart);
+    if (queuedStart >= now)
+        return;
+
+    metrics->phases[metrics->phase].time += queuedStart - metrics->phaseStart;
+    metrics->phases[QueuedPhase].entryCount++;
+    metrics->phases[QueuedPhase].time += now - queuedStart;
+    metrics->phaseStart = now;
+}
+
+PhaseTimer::PhaseTimer(BoardMetrics* metrics, Phase phase) :
+    metrics(metrics),
+    previousPhase(EnterPhase(metrics, phase))
+{
+}
+
+PhaseTimer::~PhaseTimer()
+{
+    LeavePhase(metrics, previousPhase);
+}
+
+/*
+* Counts one transfer of byteCount bytes from transferStart to transferEnd, for its type and for the current phase
+*/
+void RecordTransfer(BoardMetrics* metrics, TransferType type, size_t byteCount, std::chrono::steady_clock::time_point transferStart, std::chrono::steady_clock::time_point transferEnd)
+{
+    const std::chrono::nanoseconds latency = transferEnd - transferStart;
+    const unsigned long long latencyUs = (unsigned long long)std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+
+    TransferStats& transfer = metrics->transfers[type];
+    transfer.count++;
+    transfer.byteCount += byteCount;
+    transfer.time += latency;
+    transfer.latencyBuckets[std::min((int)std::bit_width(latencyUs), LATENCY_BUCKET_COUNT - 1)]++;
+
+    PhaseStats& phase = metrics->phases[metrics->phase];
+    phase.transferCount++;
+    phase.byteCount += byteCount;
+}
+
+static long long Microseconds(std::chrono::nanoseconds time)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(time).count();
+}
+
+/*
+* Writes metrics as a JSON object, every line after the first is preceded by indent
+* The phase the board is in is charged up to now, every time is given in us
+* Only the latency buckets that counted a transfer are listed, each with the latency all its transfers were below
+*/
+void WriteMetricsJson(std::ostream& out, const BoardMetrics& metrics, const std::string& indent)
+{
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    out << "{" << std::endl;
+    out << indent << "  \"wallTimeUs\": " << Microseconds(now - metrics.start) << "," << std::endl;
+    out << indent << "  \"statusPolls\": " << metrics.statusPollCount << "," << std::endl;
+    out << indent << "  \"statusReads\": " << metrics.statusReadCount << "," << std::endl;
+
+    out << indent << "  \"phases\": {" << std::endl;
+    for (int i = 0; i < PHASE_COUNT; i++)
+    {
+        const PhaseStats& phase = metrics.phases[i];
+        const std::chrono::nanoseconds time = phase.time + (i == metrics.phase ? now - metrics.phaseStart : std::chrono::nanoseconds(0));
+        out << indent << "    \"" << phaseNames[i] << "\": { \"entries\": " << phase.entryCount << ", \"timeUs\": " << Microseconds(time);
+        out << ", \"transfers\": " << phase.transferCount << ", \"bytes\": " << phase.byteCount << " }" << (i + 1 < PHASE_COUNT ? "," : "") << std::endl;
+    }
+    out << indent << "  }," << std::endl;
+
+    out << indent << "  \"transfers\": {" << std::endl;
+    for (int i = 0; i < TRANSFER_TYPE_COUNT; i++)
+    {
+        const TransferStats& transfer = metrics.transfers[i];
+        out << indent << "    \"" << transferTypeNames[i] << "\": { \"count\": " << transfer.count << ", \"bytes\": " << transfer.byteCount;
+        out << ", \"timeUs\": " << Microseconds(transfer.time) << ", \"latencyHistogram\": [";
+        const char* separator = "";
+        for (int bucket = 0; bucket < LATENCY_BUCKET_COUNT; bucket++)
+        {
+            if (transfer.latencyBuckets[bucket] == 0)
+                continue;
+            out << separator << " { \"belowUs\": ";
+            if (bucket + 1 < LATENCY_BUCKET_COUNT)
+                out << (1ULL << bucket);
+            else
+                out << "null";
+            out << ", \"count\": " << transfer.latencyBuckets[bucket] << " }";
+            separator = ",";
+        }
+        out << " ] }" << (i + 1 < TRANSFER_TYPE_COUNT ? "," : "") << std::endl;
+    }
+    out << indent << "  }" << std::endl;
+
+    out << indent << "}";
+}
@@ -0,0 +1,94 @@
+/*
+* Instrumentation of one board: wall time per phase of the programming, and count, bytes and latency of every kind of USB transfer
+* Phase times are exclusive, time spent in a phase entered from another one only counts for the inner phase,
+* so the times of all phases add up to the time since the board was initialized
+* Written as JSON, so test stations can collect it
+*/
+
+#pragma once
+#include <chrono>
+#include <ostream>
+#include <string>
+#include "ftd2xx.h"
+#include "LibFT4222.h"
+
+enum Phase
+{
+    OtherPhase,         // Time outside the phases below, e.g. setting up read modes and the manifest
+    InitPhase,          // Opening the FT4222 and initializing the SPI master
+    DetectPhase,        // Reading the JEDEC ID and SFDP tables of the flash
+    AutotunePhase,      // Finding the fastest stable SPI clock
+    ErasePhase,         // Sending erase commands, without the wait for the flash to complete them
+    ProgramPhase,       // Sending page program commands, without the wait for the flash to complete them
+    WaitReadyPhase,     // Polling the status register until a program or erase completes
+    ReadBackPhase,      // Reading the flash back to compare it with the image, after programming a sector or to find changed sectors
+    ComparePhase,       // Comparing read back data with the image on the host
+    RetryPhase,         // Everything done to fix a sector that did not verify, including its erases, programs and waits
+    ValidatePhase,      // Reading back and checking the whole image after programming
+    SramPhase,          // Loading a bitstream into the SRAM of the FPGA
+    QueuedPhase,        // With --async, waiting for the thread while other boards use it, after a deadline of the board passed or it gave them a turn
+    PHASE_COUNT
+};
+
+enum TransferType
+{
+    WriteTransfer,      // WriteSPI
+    ReadTransfer,       // ReadSPI
+    ReadWriteTransfer,  // ReadWriteSPI
+    MultiTransfer,      // MultiReadWriteSPI in dual or quad mode
+    ControlTransfer,    // Clock, line and slave select changes of the SPI master and GPIO accesses
+    TRANSFER_TYPE_COUNT
+};
+
+const int LATENCY_BUCKET_COUNT = 26;    // Bucket i counts transfers that took less than 2^i us and at least half of that, the last one all longer ones
+
+struct PhaseStats
+{
+    size_t entryCount = 0;              // Number of times the phase was entered
+    std::chrono::nanoseconds time{ 0 }; // Wall time spent in the phase, without the phases entered from it
+    size_t transferCount = 0;           // USB transfers made during the phase
+    size_t byteCount = 0;               // Bytes clocked over SPI during the phase
+};
+
+struct TransferStats
+{
+    size_t count = 0;
+    size_t byteCount = 0;
+    std::chrono::nanoseconds time{ 0 };
+    size_t latencyBuckets[LATENCY_BUCKET_COUNT] = {};
+};
+
+struct BoardMetrics
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    Phase phase = OtherPhase;           // Phase the board is in, only changed through PhaseTimer
+    std::chrono::steady_clock::time_point phaseStart = start;
+    PhaseStats phases[PHASE_COUNT];
+    TransferStats transfers[TRANSFER_TYPE_COUNT];
+    size_t statusPollCount = 0;         // Transfers that read the status register
+    size_t statusReadCount = 0;         // Status register values read by those transfers
+};
+
+/*
+* Charges the time from its construction to its destruction to phase, and returns the board to the phase it was in before
+* Inside RetryPhase every other phase keeps counting as a retry
+* Must not live across a co_await, the coroutines use EnterPhase and LeavePhase with ChargeQueuedTime instead
+*/
+class PhaseTimer
+{
+public:
+    PhaseTimer(BoardMetrics* metrics, Phase phase);
+    ~PhaseTimer();
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+private:
+    BoardMetrics* metrics;
+    Phase previousPhase;
+};
+
+Phase EnterPhase(BoardMetrics* metrics, Phase phase);
+void LeavePhase(BoardMetrics* metrics, Phase previousPhase);
+void ChargeQueuedTime(BoardMetrics* metrics, std::chrono::steady_clock::time_point deadline);
+void RecordTransfer(BoardMetrics* metrics, TransferType type, size_t byteCount, std::chrono::steady_clock::time_point transferStart, std::chrono::steady_clock::time_point transferEnd);
+void WriteMetricsJson(std::ostream& out, const BoardMetrics& metrics, const std::string& indent);
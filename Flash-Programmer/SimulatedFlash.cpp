@@ -0,0 +1,667 @@
+#include <thread>
+#include <algorithm>
+#include "SimulatedFlash.h"
+
+// Number of opcode and address bytes that precede the data of read, program and erase commands
+const int COMMAND_HEADER_SIZE = 4;
+
+// Synchronization word that starts every iCE40 bitstream
+const uint32 ICE40_PREAMBLE = 0x7EAA997E;
+
+/*
+* Returns the number of opcode, address, mode and dummy bytes that precede the data of a command
+*/
+static int CommandHeaderSize(uint8 command)
+{
+    switch (command)
+    {
+    case ReadCmd:
+    case PageProgramCmd:
+    case QuadPageProgramCmd:
+    case SectorEraseCmd:
+    case BlockErase32Cmd:
+    case BlockErase64Cmd:
+        return COMMAND_HEADER_SIZE;
+    case FastReadCmd:
+    case DualOutputReadCmd:
+    case QuadOutputReadCmd:
+        return COMMAND_HEADER_SIZE + 1;
+    case QuadIOReadCmd:
+        return COMMAND_HEADER_SIZE + 3;
+    case ReadSfdpCmd:
+        return COMMAND_HEADER_SIZE + 1;
+    default:
+        return 1;
+    }
+}
+
+SimulatedFlash::SimulatedFlash(const SimulatedFlashConfig& config) :
+    config(config),
+    memory(config.flashSize, 0xFF),
+    pageLatch(FLASH_PAGE_SIZE, 0xFF),
+    statusRegister(0x00),
+    statusRegister2(0x00),
+    busyUntil(Clock::now()),
+    simulatedTime(Clock::now()),
+    byteDuration(0),
+    spiLines(SPI_IO_SINGLE),
+    misoByteCount(0),
+    usbInTransferSize(DEFAULT_USB_IN_TRANSFER_SIZE),
+    isCommandIgnored(false),
+    opcode(DummyCmd),
+    address(0),
+    bytePosition(0),
+    isGpioInitialized(false),
+    gpioDirections{ GPIO_INPUT, GPIO_INPUT, GPIO_INPUT, GPIO_INPUT },
+    gpioOutputs{ true, true, true, true },
+    isFpgaSpiSlave(false),
+    fpgaReadyTime(Clock::now()),
+    fpgaShiftRegister(0),
+    isPreambleFound(false),
+    isCdoneHigh(false)
+{
+    std::copy(config.initialContents.begin(), config.initialContents.begin() + std::min(config.initialContents.size(), memory.size()), memory.begin());
+    BuildSfdp();
+}
+
+/*
+* Encodes a typical time as an SFDP time field: a 5-bit count followed by the index of the smallest of units that fits
+*/
+static uint32 EncodeSfdpTime(int timeUs, const int* units, int unitCount)
+{
+    int unit = 0;
+    while (unit < unitCount - 1 && (timeUs + units[unit] - 1) / units[unit] > 32)
+        unit++;
+
+    int count = std::min(std::max((timeUs + units[unit] - 1) / units[unit], 1), 32);
+    return (uint32)(count - 1) | (unit << 5);
+}
+
+/*
+* Builds the SFDP header and a JESD216B Basic Flash Parameter Table of 16 DWORDs that describe this flash
+* Max times are given as 8 times the typical time
+*/
+void SimulatedFlash::BuildSfdp()
+{
+    const int eraseUnitsUs[] = { 1000, 16000, 128000, 1000000 };
+    const int programUnitsUs[] = { 8, 64 };
+    const int chipEraseUnitsUs[] = { 16000, 256000, 4000000, 64000000 };
+    const uint32 maxTimeMultiplier = 3;
+
+    uint32 table[16] = {};
+    table[0] = 0xFF800001 | (SectorEraseCmd << 8) | (config.supportsDualOutput ? 1 << 16 : 0) | (config.supportsQuadOutput ? 3 << 21 : 0);
+    table[1] = (uint32)config.flashSize * 8 - 1;
+    if (config.supportsQuadOutput)
+        table[2] = 4 | (2 << 5) | (QuadIOReadCmd << 8) | (8 << 16) | ((uint32)QuadOutputReadCmd << 24);
+    if (config.supportsDualOutput)
+        table[3] = 8 | (DualOutputReadCmd << 8);
+    table[7] = 12 | (SectorEraseCmd << 8) | (15 << 16) | (BlockErase32Cmd << 24);
+    table[8] = 16 | (BlockErase64Cmd << 8);
+    table[9] = maxTimeMultiplier | (EncodeSfdpTime(config.sectorEraseTimeUs, eraseUnitsUs, 4) << 4) |
+        (EncodeSfdpTime(config.blockErase32TimeUs, eraseUnitsUs, 4) << 11) | (EncodeSfdpTime(config.blockErase64TimeUs, eraseUnitsUs, 4) << 18);
+    table[10] = maxTimeMultiplier | (8 << 4) | (EncodeSfdpTime(config.pageProgramTimeUs, programUnitsUs, 2) << 8) |
+        (EncodeSfdpTime(config.chipEraseTimeUs, chipEraseUnitsUs, 4) << 24);
+
+    // Quad Enable requirements: none, bit 6 of status register 1 or bit 1 of status register 2 written with a 2-byte write status register
+    const uint32 quadEnableRequirements[] = { 0, 2, 4 };
+    table[14] = quadEnableRequirements[config.quadEnableMethod] << 20;
+
+    // Header with one parameter header pointing to the table right behind it
+    sfdp = { 'S', 'F', 'D', 'P', 0x06, 0x01, 0x00, 0xFF, 0x00, 0x06, 0x01, 16, 0x10, 0x00, 0x00, 0xFF };
+    for (uint32 dword : table)
+    {
+        for (int i = 0; i < 4; i++)
+            sfdp.push_back((uint8)(dword >> (8 * i)));
+    }
+}
+
+FT4222_STATUS SimulatedFlash::SetClock(FT4222_ClockRate systemClock, FT4222_SPIClock divider)
+{
+    SimulateTransferTime(0, 0, 0, 0);
+
+    config.spiClockHz = SpiClockHz({ systemClock, divider });
+    spiLines = SPI_IO_SINGLE;
+    return FT4222_OK;
+}
+
+/*
+* A single simulated flash sits on SS0
+*/
+FT4222_STATUS SimulatedFlash::SelectChip(int chipIndex)
+{
+    SimulateTransferTime(0, 0, 0, 0);
+
+    spiLines = SPI_IO_SINGLE;
+    return chipIndex == 0 ? FT4222_OK : FT4222_INVALID_PARAMETER;
+}
+
+FT4222_STATUS SimulatedFlash::SingleWrite(const uint8* buffer, uint16 bytesToWrite, uint16* bytesTransferred, bool isEndTransaction)
+{
+    if (spiLines != SPI_IO_SINGLE)
+        return FT4222_IS_NOT_SPI_SINGLE_MODE;
+
+    SimulateTransferTime(bytesToWrite, 0, 0, bytesToWrite);
+
+    for (int i = 0; i < bytesToWrite; i++)
+        ClockByte(buffer[i]);
+
+    if (isEndTransaction)
+        EndTransaction();
+
+    *bytesTransferred = bytesToWrite;
+    return FT4222_OK;
+}
+
+FT4222_STATUS SimulatedFlash::SingleRead(uint8* buffer, uint16 bytesToRead, uint16* bytesRead, bool isEndTransaction)
+{
+    if (spiLines != SPI_IO_SINGLE)
+        return FT4222_IS_NOT_SPI_SINGLE_MODE;
+
+    SimulateTransferTime(bytesToRead, 0, bytesToRead, bytesToRead);
+
+    for (int i = 0; i < bytesToRead; i++)
+        buffer[i] = SampleMiso(ClockByte(DummyCmd));
+
+    if (isEndTransaction)
+        EndTransaction();
+
+    *bytesRead = bytesToRead;
+    return FT4222_OK;
+}
+
+FT4222_STATUS SimulatedFlash::SingleReadWrite(uint8* readBuffer, const uint8* writeBuffer, uint16 bufferSize, uint16* bytesTransferred, bool isEndTransaction)
+{
+    if (spiLines != SPI_IO_SINGLE)
+        return FT4222_IS_NOT_SPI_SINGLE_MODE;
+
+    SimulateTransferTime(bufferSize, 0, bufferSize, bufferSize);
+
+    for (int i = 0; i < bufferSize; i++)
+        readBuffer[i] = SampleMiso(ClockByte(writeBuffer[i]));
+
+    if (isEndTransaction)
+        EndTransaction();
+
+    *bytesTransferred = bufferSize;
+    return FT4222_OK;
+}
+
+FT4222_STATUS SimulatedFlash::SetLines(FT4222_SPIMode spiLines)
+{
+    SimulateTransferTime(0, 0, 0, 0);
+
+    this->spiLines = spiLines;
+    return FT4222_OK;
+}
+
+/*
+* The flash does not know how many lines the master uses, it only sees the byte stream
+* Data bytes read while the flash does not support or has not enabled the command read back as 0xFF
+* Commands without a multi-line output (e.g. read status register) only drive IO1, the other lines are pulled high
+*/
+FT4222_STATUS SimulatedFlash::MultiReadWrite(uint8* readBuffer, const uint8* writeBuffer, uint8 singleWriteBytes, uint16 multiWriteBytes, uint16 multiReadBytes, uint32* bytesRead)
+{
+    if (spiLines == SPI_IO_SINGLE)
+        return FT4222_IS_NOT_SPI_MULTI_MODE;
+
+    const uint8 commandOpcode = singleWriteBytes + multiWriteBytes > 0 ? writeBuffer[0] : opcode;
+    const bool isMultiLineOutput = commandOpcode == DualOutputReadCmd || commandOpcode == QuadOutputReadCmd || commandOpcode == QuadIOReadCmd;
+    const int clocksPerByte = 8 / spiLines;
+
+    // Output on IO1 only shifts one byte out of the flash for every 8 clocks, not for every byte of readBuffer
+    const size_t clockedReadBytes = isMultiLineOutput ? multiReadBytes : ((size_t)multiReadBytes * clocksPerByte + 7) / 8;
+    SimulateTransferTime(singleWriteBytes, multiWriteBytes + multiReadBytes, multiReadBytes, singleWriteBytes + multiWriteBytes + clockedReadBytes);
+
+    for (int i = 0; i < singleWriteBytes + multiWriteBytes; i++)
+        ClockByte(writeBuffer[i]);
+
+    uint8 outputByte = 0xFF;
+    int outputBit = 8;
+
+    for (int i = 0; i < multiReadBytes; i++)
+    {
+        if (isMultiLineOutput)
+        {
+            readBuffer[i] = SampleMiso(ClockByte(DummyCmd));
+            continue;
+        }
+
+        readBuffer[i] = 0xFF;
+        for (int clock = 0; clock < clocksPerByte; clock++)
+        {
+            if (outputBit == 8)
+            {
+                outputByte = SampleMiso(ClockByte(DummyCmd));
+                outputBit = 0;
+            }
+            if (((outputByte >> (7 - outputBit++)) & 0x01) == 0)
+                readBuffer[i] &= ~(1 << (9 - (clock + 1) * spiLines));
+        }
+    }
+
+    EndTransaction();
+
+    *bytesRead = multiReadBytes;
+    return FT4222_OK;
+}
+
+/*
+* Outputs start high, so CRESET_B does not reset the FPGA until it is driven low
+*/
+FT4222_STATUS SimulatedFlash::InitGpio(const GPIO_Dir directions[4])
+{
+    SimulateTransferTime(0, 0, 0, 0);
+
+    isGpioInitialized = true;
+    std::copy(directions, directions + 4, gpioDirections);
+    return FT4222_OK;
+}
+
+/*
+* CRESET_B low holds the FPGA in reset and clears its configuration
+* When it goes high the FPGA samples SS: if SS is low it waits for a bitstream on the bus, otherwise it would load one from the flash,
+* which is not simulated and leaves CDONE low
+*/
+FT4222_STATUS SimulatedFlash::WriteGpio(GPIO_Port port, bool isHigh)
+{
+    SimulateTransferTime(0, 0, 0, 0);
+
+    if (!isGpioInitialized)
+        return FT4222_GPIO_NOT_SUPPORTED_IN_THIS_MODE;
+    if (gpioDirections[port] != GPIO_OUTPUT)
+        return FT4222_GPIO_WRITE_NOT_SUPPORTED;
+
+    if (port == config.cresetPort && !isHigh)
+    {
+        isFpgaSpiSlave = false;
+        isCdoneHigh = false;
+    }
+    else if (port == config.cresetPort && !gpioOutputs[port])
+    {
+        isFpgaSpiSlave = bytePosition > 0;
+        fpgaReadyTime = simulatedTime + std::chrono::microseconds(config.fpgaClearTimeUs);
+        fpgaShiftRegister = 0;
+        isPreambleFound = false;
+    }
+
+    gpioOutputs[port] = isHigh;
+    return FT4222_OK;
+}
+
+/*
+* An output reads back the level it drives, an unconnected input is pulled high
+*/
+FT4222_STATUS SimulatedFlash::ReadGpio(GPIO_Port port, bool* isHigh)
+{
+    SimulateTransferTime(0, 0, 0, 0);
+
+    if (!isGpioInitialized)
+        return FT4222_GPIO_NOT_SUPPORTED_IN_THIS_MODE;
+
+    if (gpioDirections[port] == GPIO_OUTPUT)
+        *isHigh = gpioOutputs[port];
+    else
+        *isHigh = port == config.cdonePort ? isCdoneHigh : true;
+    return FT4222_OK;
+}
+
+FT4222_STATUS SimulatedFlash::GetMaxTransferSize(uint16* maxTransferSize)
+{
+    *maxTransferSize = config.maxTransferSize;
+    return FT4222_OK;
+}
+
+FT4222_STATUS SimulatedFlash::SetUsbParameters(uint8 latencyTimerMs, DWORD inTransferSize)
+{
+    SimulateTransferTime(0, 0, 0, 0);
+
+    usbInTransferSize = inTransferSize;
+    return FT4222_OK;
+}
+
+/*
+* Blocks for as long as the real transfer would take: one USB round trip plus the time to clock the bytes out on SPI
+* The readBytes returned to the host take one USB request per usbInTransferSize bytes, every request after the first adds usbRequestUs
+* Bytes sent in dual or quad mode take 4 or 2 clocks instead of 8
+* The clockedBytes the flash shifts are placed at the end of that time, spread evenly, so a long status read sees the flash become ready part way through
+*/
+void SimulatedFlash::SimulateTransferTime(size_t singleLineBytes, size_t multiLineBytes, size_t readBytes, size_t clockedBytes)
+{
+    long long clockCycles = (long long)singleLineBytes * 8 + (long long)multiLineBytes * 8 / spiLines;
+    std::chrono::nanoseconds wireTime(clockCycles * 1000000000 / config.spiClockHz);
+    const size_t extraUsbRequests = readBytes > 0 ? (readBytes - 1) / usbInTransferSize : 0;
+    std::this_thread::sleep_for(std::chrono::microseconds(config.usbLatencyUs + extraUsbRequests * config.usbRequestUs) + wireTime);
+
+    byteDuration = std::chrono::nanoseconds(0);
+    if (clockedBytes > 0)
+        byteDuration = wireTime / clockedBytes;
+    simulatedTime = Clock::now() - wireTime;
+}
+
+/*
+* Returns the byte the master actually samples
+* Above maxStableSpiClockHz one bit of every 61st byte is flipped
+*/
+uint8 SimulatedFlash::SampleMiso(uint8 value)
+{
+    if (config.spiClockHz > config.maxStableSpiClockHz && ++misoByteCount % 61 == 0)
+        return value ^ 0x10;
+
+    return value;
+}
+
+/*
+* Shifts one byte into the flash and returns the byte the flash shifts out at the same time
+* The first byte after SS goes low is the opcode, for read, program and erase commands it is followed by a 24-bit address
+* While a program or erase is in progress every command except read status register is ignored
+*/
+uint8 SimulatedFlash::ClockByte(uint8 mosi)
+{
+    int position = bytePosition++;
+
+    simulatedTime += byteDuration;
+
+    if (isFpgaSpiSlave)
+        ClockFpgaByte(mosi);
+
+    if (position == 0)
+    {
+        opcode = mosi;
+        address = 0;
+        isCommandIgnored = (IsBusy() && opcode != ReadStatusRegisterCmd) || !IsCommandSupported(opcode);
+        std::fill(pageLatch.begin(), pageLatch.end(), 0xFF);
+        return 0xFF;
+    }
+
+    if (isCommandIgnored)
+        return 0xFF;
+
+    switch (opcode)
+    {
+    case ReadStatusRegisterCmd:
+        IsBusy();
+        return statusRegister;
+
+    case ReadStatusRegister2Cmd:
+        return statusRegister2;
+
+    case WriteStatusRegisterCmd:
+        if (position <= 2)
+            statusWriteBuffer[position - 1] = mosi;
+        return 0xFF;
+
+    case ReadJedecIdCmd:
+        return position <= 3 ? config.jedecId[position - 1] : 0x00;
+
+    case ReadCmd:
+    case FastReadCmd:
+    case DualOutputReadCmd:
+    case QuadOutputReadCmd:
+    case QuadIOReadCmd:
+    case PageProgramCmd:
+    case QuadPageProgramCmd:
+    case SectorEraseCmd:
+    case BlockErase32Cmd:
+    case BlockErase64Cmd:
+    case ReadSfdpCmd:
+        break;
+
+    default:
+        return 0xFF;
+    }
+
+    if (position < COMMAND_HEADER_SIZE)
+    {
+        address = (address << 8) | mosi;
+        return 0xFF;
+    }
+
+    int offset = position - CommandHeaderSize(opcode);
+    if (offset < 0 || opcode == SectorEraseCmd || opcode == BlockErase32Cmd || opcode == BlockErase64Cmd)
+        return 0xFF;
+
+    // A page program wraps around to the start of the page if more than a page of data is sent
+    if (opcode == PageProgramCmd || opcode == QuadPageProgramCmd)
+    {
+        pageLatch[(address + offset) % FLASH_PAGE_SIZE] = mosi;
+        return 0xFF;
+    }
+
+    if (opcode == ReadSfdpCmd)
+        return address + offset < (int)sfdp.size() ? sfdp[address + offset] : 0xFF;
+
+    return memory[(address + offset) % config.flashSize];
+}
+
+/*
+* Shifts one byte into the FPGA while it waits for its bitstream
+* Bytes that arrive while it still clears its configuration memory are lost, so a preamble sent too early is never found
+* The bitstream itself is not decoded
+*/
+void SimulatedFlash::ClockFpgaByte(uint8 mosi)
+{
+    if (simulatedTime < fpgaReadyTime || isPreambleFound)
+        return;
+
+    fpgaShiftRegister = (fpgaShiftRegister << 8) | mosi;
+    isPreambleFound = fpgaShiftRegister == ICE40_PREAMBLE;
+}
+
+/*
+* SS goes high, program and erase commands take effect here, as they do on a real flash
+* Programming can only clear bits (1 -> 0), only an erase sets them back to 1
+* An FPGA that received the preamble of a bitstream starts its design and raises CDONE
+*/
+void SimulatedFlash::EndTransaction()
+{
+    int byteCount = bytePosition;
+
+    bytePosition = 0;
+
+    if (isFpgaSpiSlave && isPreambleFound)
+    {
+        isCdoneHigh = true;
+        isFpgaSpiSlave = false;
+    }
+
+    if (isCommandIgnored || byteCount == 0)
+        return;
+
+    bool isWriteEnabled = (statusRegister & WriteEnableLatchBit) != 0;
+
+    switch (opcode)
+    {
+    case WriteEnableCmd:
+        statusRegister |= WriteEnableLatchBit;
+        break;
+
+    // The busy and write enable bits of status register 1 are read-only
+    case WriteStatusRegisterCmd:
+        if (!isWriteEnabled || byteCount < 2)
+            break;
+        statusRegister = (statusRegister & (WriteInProgressBit | WriteEnableLatchBit)) | (statusWriteBuffer[0] & 0xFC);
+        if (byteCount >= 3 && config.quadEnableMethod == QuadEnableStatus2Bit1)
+            statusRegister2 = statusWriteBuffer[1];
+        StartBusy(config.writeStatusTimeUs);
+        break;
+
+    case ChipEraseCmd:
+        if (!isWriteEnabled || byteCount != 1)
+            break;
+        std::fill(memory.begin(), memory.end(), 0xFF);
+        StartBusy(config.chipEraseTimeUs);
+        break;
+
+    case SectorEraseCmd:
+    case BlockErase32Cmd:
+    case BlockErase64Cmd:
+    {
+        if (!isWriteEnabled || byteCount != COMMAND_HEADER_SIZE)
+            break;
+        int eraseSize = opcode == SectorEraseCmd ? FLASH_SECTOR_SIZE : opcode == BlockErase32Cmd ? FLASH_BLOCK32_SIZE : FLASH_BLOCK64_SIZE;
+        int eraseStart = (address % config.flashSize) & ~(eraseSize - 1);
+        std::fill(memory.begin() + eraseStart, memory.begin() + std::min(eraseStart + eraseSize, config.flashSize), 0xFF);
+        StartBusy(opcode == SectorEraseCmd ? config.sectorEraseTimeUs : opcode == BlockErase32Cmd ? config.blockErase32TimeUs : config.blockErase64TimeUs);
+        break;
+    }
+
+    case PageProgramCmd:
+    case QuadPageProgramCmd:
+    {
+        if (!isWriteEnabled || byteCount <= COMMAND_HEADER_SIZE)
+            break;
+        int pageStart = (address % config.flashSize) & ~(FLASH_PAGE_SIZE - 1);
+        for (int i = 0; i < FLASH_PAGE_SIZE; i++)
+            memory[pageStart + i] &= pageLatch[i];
+        StartBusy(config.pageProgramTimeUs);
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+/*
+* Returns true while a program or erase is in progress
+* Clears the busy and write enable bits once the operation time has passed
+*/
+bool SimulatedFlash::IsBusy()
+{
+    if ((statusRegister & WriteInProgressBit) != 0 && simulatedTime >= busyUntil)
+        statusRegister &= ~(WriteInProgressBit | WriteEnableLatchBit);
+
+    return (statusRegister & WriteInProgressBit) != 0;
+}
+
+void SimulatedFlash::StartBusy(int busyTimeUs)
+{
+    statusRegister |= WriteInProgressBit;
+    busyUntil = simulatedTime + std::chrono::microseconds(busyTimeUs);
+}
+
+/*
+* Returns false for commands the simulated part does not implement or has not enabled, the flash ignores those
+*/
+bool SimulatedFlash::IsCommandSupported(uint8 command) const
+{
+    switch (command)
+    {
+    case ReadStatusRegister2Cmd:
+        return config.quadEnableMethod == QuadEnableStatus2Bit1;
+    case DualOutputReadCmd:
+        return config.supportsDualOutput;
+    case QuadOutputReadCmd:
+    case QuadIOReadCmd:
+        return config.supportsQuadOutput && IsQuadEnabled();
+    case QuadPageProgramCmd:
+        return config.supportsQuadInput && IsQuadEnabled();
+    case ReadSfdpCmd:
+        return config.supportsSfdp;
+    default:
+        return true;
+    }
+}
+
+bool SimulatedFlash::IsQuadEnabled() const
+{
+    switch (config.quadEnableMethod)
+    {
+    case QuadEnableStatus1Bit6:
+        return (statusRegister & 0x40) != 0;
+    case QuadEnableStatus2Bit1:
+        return (statusRegister2 & 0x02) != 0;
+    default:
+        return true;
+    }
+}
+
+SimulatedSpiBus::SimulatedSpiBus(const SimulatedFlashConfig& config, int chipCount) :
+    chipSelect(0),
+    systemClock(SYS_CLK_60),
+    divider(CLK_DIV_2)
+{
+    for (int i = 0; i < chipCount; i++)
+        flashes.emplace_back(new SimulatedFlash(config));
+}
+
+FT4222_STATUS SimulatedSpiBus::SetClock(FT4222_ClockRate systemClock, FT4222_SPIClock divider)
+{
+    this->systemClock = systemClock;
+    this->divider = divider;
+    return flashes[chipSelect]->SetClock(systemClock, divider);
+}
+
+/*
+* Re-initializing the SPI master for another slave select costs a USB round trip and leaves it in single mode, as setting the clock does
+*/
+FT4222_STATUS SimulatedSpiBus::SelectChip(int chipIndex)
+{
+    if (chipIndex < 0 || chipIndex >= (int)flashes.size())
+        return FT4222_INVALID_PARAMETER;
+
+    chipSelect = chipIndex;
+    return flashes[chipSelect]->SetClock(systemClock, divider);
+}
+
+FT4222_STATUS SimulatedSpiBus::SingleWrite(const uint8* buffer, uint16 bytesToWrite, uint16* bytesTransferred, bool isEndTransaction)
+{
+    return flashes[chipSelect]->SingleWrite(buffer, bytesToWrite, bytesTransferred, isEndTransaction);
+}
+
+FT4222_STATUS SimulatedSpiBus::SingleRead(uint8* buffer, uint16 bytesToRead, uint16* bytesRead, bool isEndTransaction)
+{
+    return flashes[chipSelect]->SingleRead(buffer, bytesToRead, bytesRead, isEndTransaction);
+}
+
+FT4222_STATUS SimulatedSpiBus::SingleReadWrite(uint8* readBuffer, const uint8* writeBuffer, uint16 bufferSize, uint16* bytesTransferred, bool isEndTransaction)
+{
+    return flashes[chipSelect]->SingleReadWrite(readBuffer, writeBuffer, bufferSize, bytesTransferred, isEndTransaction);
+}
+
+FT4222_STATUS SimulatedSpiBus::SetLines(FT4222_SPIMode spiLines)
+{
+    return flashes[chipSelect]->SetLines(spiLines);
+}
+
+FT4222_STATUS SimulatedSpiBus::MultiReadWrite(uint8* readBuffer, const uint8* writeBuffer, uint8 singleWriteBytes, uint16 multiWriteBytes, uint16 multiReadBytes, uint32* bytesRead)
+{
+    return flashes[chipSelect]->MultiReadWrite(readBuffer, writeBuffer, singleWriteBytes, multiWriteBytes, multiReadBytes, bytesRead);
+}
+
+/*
+* With several slave selects the FT4222 uses its GPIO pins as SS1 to SS3
+*/
+FT4222_STATUS SimulatedSpiBus::InitGpio(const GPIO_Dir directions[4])
+{
+    return FT4222_GPIO_NOT_SUPPORTED_IN_THIS_MODE;
+}
+
+FT4222_STATUS SimulatedSpiBus::WriteGpio(GPIO_Port port, bool isHigh)
+{
+    return FT4222_GPIO_NOT_SUPPORTED_IN_THIS_MODE;
+}
+
+FT4222_STATUS SimulatedSpiBus::ReadGpio(GPIO_Port port, bool* isHigh)
+{
+    return FT4222_GPIO_NOT_SUPPORTED_IN_THIS_MODE;
+}
+
+FT4222_STATUS SimulatedSpiBus::GetMaxTransferSize(uint16* maxTransferSize)
+{
+    return flashes[chipSelect]->GetMaxTransferSize(maxTransferSize);
+}
+
+/*
+* The flashes share the USB connection of the FT4222, all of them get the settings
+*/
+FT4222_STATUS SimulatedSpiBus::SetUsbParameters(uint8 latencyTimerMs, DWORD inTransferSize)
+{
+    for (std::unique_ptr<SimulatedFlash>& flash : flashes)
+    {
+        FT4222_STATUS status = flash->SetUsbParameters(latencyTimerMs, inTransferSize);
+        if (status != FT4222_OK)
+            return status;
+    }
+    return FT4222_OK;
+}
@@ -0,0 +1,138 @@
+/*
+* SPI transport that simulates a NOR flash in-process, together with the SRAM configuration of the iCE40 that shares its SPI bus
+* Makes it possible to run and time the programming algorithms without an Ice Board connected
+*/
+
+#pragma once
+#include <vector>
+#include <chrono>
+#include <memory>
+#include "SpiTransport.h"
+#include "IceBoard.h"
+
+// All times below are given in units of microseconds
+struct SimulatedFlashConfig
+{
+    int flashSize = FLASH_SIZE;             // Size of the simulated flash in bytes
+    int spiClockHz = 30000000;              // SPI clock, used to compute how long the bytes of a transfer take on the wire
+    int usbLatencyUs = 1000;                // Time every transfer call spends on USB regardless of its size
+    int usbRequestUs = 250;                 // Time every further USB request takes when a transfer returns more bytes than the USB transfer size
+    uint16 maxTransferSize = 512;           // Bytes in one USB packet, a high speed bulk packet
+    int maxStableSpiClockHz = 30000000;     // Above this SPI clock some bits read from the flash are wrong, as on a board with poor signal integrity
+    int pageProgramTimeUs = 700;            // tPP, time the flash is busy after a page program
+    int sectorEraseTimeUs = 45000;          // tSE, time the flash is busy after a sector erase
+    int blockErase32TimeUs = 120000;        // tBE1, time the flash is busy after a 32 KB block erase
+    int blockErase64TimeUs = 150000;        // tBE2, time the flash is busy after a 64 KB block erase
+    int chipEraseTimeUs = 500000;           // tCE, time the flash is busy after a chip erase
+    int writeStatusTimeUs = 10000;          // tW, time the flash is busy after a write status register
+    bool supportsDualOutput = true;         // Flash understands the dual output read command
+    bool supportsQuadOutput = true;         // Flash understands the quad output and quad I/O read commands
+    bool supportsQuadInput = true;          // Flash understands the quad input page program command
+    QuadEnableMethod quadEnableMethod = QuadEnableStatus2Bit1;
+    uint8 jedecId[3] = { 0xEF, 0x40, 0x12 };  // Manufacturer, memory type and capacity returned by the JEDEC ID command
+    bool supportsSfdp = true;               // Flash answers the SFDP command with tables describing the settings above
+    std::vector<uint8> initialContents;     // Content of the start of the flash before programming, the rest is erased
+    int fpgaClearTimeUs = ICE40_CLEAR_TIME_US;  // Time the iCE40 ignores the bus after CRESET_B goes high
+    GPIO_Port cresetPort = DEFAULT_CRESET_PORT; // GPIO wired to CRESET_B of the iCE40
+    GPIO_Port cdonePort = DEFAULT_CDONE_PORT;   // GPIO wired to CDONE of the iCE40
+};
+
+class SimulatedFlash : public SpiTransport
+{
+public:
+    explicit SimulatedFlash(const SimulatedFlashConfig& config);
+
+    FT4222_STATUS SetClock(FT4222_ClockRate systemClock, FT4222_SPIClock divider) override;
+    FT4222_STATUS SelectChip(int chipIndex) override;
+    FT4222_STATUS SingleWrite(const uint8* buffer, uint16 bytesToWrite, uint16* bytesTransferred, bool isEndTransaction) override;
+    FT4222_STATUS SingleRead(uint8* buffer, uint16 bytesToRead, uint16* bytesRead, bool isEndTransaction) override;
+    FT4222_STATUS SingleReadWrite(uint8* readBuffer, const uint8* writeBuffer, uint16 bufferSize, uint16* bytesTransferred, bool isEndTransaction) override;
+    FT4222_STATUS SetLines(FT4222_SPIMode spiLines) override;
+    FT4222_STATUS MultiReadWrite(uint8* readBuffer, const uint8* writeBuffer, uint8 singleWriteBytes, uint16 multiWriteBytes, uint16 multiReadBytes, uint32* bytesRead) override;
+    FT4222_STATUS InitGpio(const GPIO_Dir directions[4]) override;
+    FT4222_STATUS WriteGpio(GPIO_Port port, bool isHigh) override;
+    FT4222_STATUS ReadGpio(GPIO_Port port, bool* isHigh) override;
+    FT4222_STATUS GetMaxTransferSize(uint16* maxTransferSize) override;
+    FT4222_STATUS SetUsbParameters(uint8 latencyTimerMs, DWORD inTransferSize) override;
+
+    const std::vector<uint8>& Memory() const { return memory; }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    enum StatusBits
+    {
+        WriteInProgressBit = 0x01,
+        WriteEnableLatchBit = 0x02
+    };
+
+    void SimulateTransferTime(size_t singleLineBytes, size_t multiLineBytes, size_t readBytes, size_t clockedBytes);
+    uint8 SampleMiso(uint8 value);
+    uint8 ClockByte(uint8 mosi);
+    void ClockFpgaByte(uint8 mosi);
+    void EndTransaction();
+    bool IsBusy();
+    void StartBusy(int busyTimeUs);
+    bool IsCommandSupported(uint8 command) const;
+    bool IsQuadEnabled() const;
+    void BuildSfdp();
+
+    SimulatedFlashConfig config;
+    std::vector<uint8> memory;
+    std::vector<uint8> pageLatch;
+    std::vector<uint8> sfdp;
+    uint8 statusRegister;
+    uint8 statusRegister2;
+    Clock::time_point busyUntil;
+    Clock::time_point simulatedTime;        // Time the byte currently being clocked is on the wire
+    std::chrono::nanoseconds byteDuration;  // Time one byte the flash shifts in the current transfer takes on the wire
+    FT4222_SPIMode spiLines;
+    size_t misoByteCount;
+    DWORD usbInTransferSize;                // Size of the USB requests the driver reads with
+
+    // State of the transaction currently selected by SS
+    bool isCommandIgnored;
+    uint8 opcode;
+    int address;
+    int bytePosition;
+    uint8 statusWriteBuffer[2];
+
+    // State of the iCE40, its SPI slave select is SS0 of the flash
+    bool isGpioInitialized;
+    GPIO_Dir gpioDirections[4];
+    bool gpioOutputs[4];
+    bool isFpgaSpiSlave;                    // SS was low when CRESET_B went high, the FPGA takes the bytes on the bus as its bitstream
+    Clock::time_point fpgaReadyTime;        // End of the clearing of the configuration memory
+    uint32 fpgaShiftRegister;               // Last 4 bytes the FPGA received, to find the preamble
+    bool isPreambleFound;
+    bool isCdoneHigh;
+};
+
+/*
+* Several simulated flashes on the slave select lines of one FT4222
+* Transfers go to the selected flash only, while the others keep running any program or erase they were given
+*/
+class SimulatedSpiBus : public SpiTransport
+{
+public:
+    SimulatedSpiBus(const SimulatedFlashConfig& config, int chipCount);
+
+    FT4222_STATUS SetClock(FT4222_ClockRate systemClock, FT4222_SPIClock divider) override;
+    FT4222_STATUS SelectChip(int chipIndex) override;
+    FT4222_STATUS SingleWrite(const uint8* buffer, uint16 bytesToWrite, uint16* bytesTransferred, bool isEndTransaction) override;
+    FT4222_STATUS SingleRead(uint8* buffer, uint16 bytesToRead, uint16* bytesRead, bool isEndTransaction) override;
+    FT4222_STATUS SingleReadWrite(uint8* readBuffer, const uint8* writeBuffer, uint16 bufferSize, uint16* bytesTransferred, bool isEndTransaction) override;
+    FT4222_STATUS SetLines(FT4222_SPIMode spiLines) override;
+    FT4222_STATUS MultiReadWrite(uint8* readBuffer, const uint8* writeBuffer, uint8 singleWriteBytes, uint16 multiWriteBytes, uint16 multiReadBytes, uint32* bytesRead) override;
+    FT4222_STATUS InitGpio(const GPIO_Dir directions[4]) override;
+    FT4222_STATUS WriteGpio(GPIO_Port port, bool isHigh) override;
+    FT4222_STATUS ReadGpio(GPIO_Port port, bool* isHigh) override;
+    FT4222_STATUS GetMaxTransferSize(uint16* maxTransferSize) override;
+    FT4222_STATUS SetUsbParameters(uint8 latencyTimerMs, DWORD inTransferSize) override;
+
+private:
+    std::vector<std::unique_ptr<SimulatedFlash>> flashes;
+    int chipSelect;
+    FT4222_ClockRate systemClock;
+    FT4222_SPIClock divider;
+};
@@ -0,0 +1,86 @@
+/*
+* Interface between the flash programming functions in IceBoard.cpp and whatever drives the SPI bus
+* WriteSPI and ReadSPI forward every transfer to the transport that is currently active
+* This makes it possible to run the programming algorithms against real hardware or against a simulated flash
+*/
+
+#pragma once
+#include "ftd2xx.h"
+#include "LibFT4222.h"
+
+class SpiTransport
+{
+public:
+    virtual ~SpiTransport() {}
+
+    /*
+    * Sets the FT4222 system clock and the divider that derives the SPI clock from it
+    * The SPI master is (re)initialized in single mode
+    */
+    virtual FT4222_STATUS SetClock(FT4222_ClockRate systemClock, FT4222_SPIClock divider) = 0;
+
+    /*
+    * Routes the following transactions to the flash on slave select chipIndex (SS0 to SS3)
+    * The SPI master is (re)initialized at the current clock, which leaves it in single mode
+    */
+    virtual FT4222_STATUS SelectChip(int chipIndex) = 0;
+
+    /*
+    * Clocks out bytesToWrite bytes from buffer
+    * If isEndTransaction is true the SS signal will go high after the last byte
+    */
+    virtual FT4222_STATUS SingleWrite(const uint8* buffer, uint16 bytesToWrite, uint16* bytesTransferred, bool isEndTransaction) = 0;
+
+    /*
+    * Clocks in bytesToRead bytes and stores them in buffer
+    * If isEndTransaction is true the SS signal will go high after the last byte
+    */
+    virtual FT4222_STATUS SingleRead(uint8* buffer, uint16 bytesToRead, uint16* bytesRead, bool isEndTransaction) = 0;
+
+    /*
+    * Clocks out bufferSize bytes from writeBuffer and stores the bytes clocked in at the same time in readBuffer
+    * If isEndTransaction is true the SS signal will go high after the last byte
+    */
+    virtual FT4222_STATUS SingleReadWrite(uint8* readBuffer, const uint8* writeBuffer, uint16 bufferSize, uint16* bytesTransferred, bool isEndTransaction) = 0;
+
+    /*
+    * Selects how many data lines (1, 2 or 4) are used
+    * Single* transfers require SPI_IO_SINGLE and MultiReadWrite requires SPI_IO_DUAL or SPI_IO_QUAD
+    */
+    virtual FT4222_STATUS SetLines(FT4222_SPIMode spiLines) = 0;
+
+    /*
+    * Performs one complete transaction in dual or quad mode
+    * The first singleWriteBytes of writeBuffer are sent on one line, the following multiWriteBytes on all lines
+    * Then multiReadBytes are read on all lines and stored in readBuffer
+    */
+    virtual FT4222_STATUS MultiReadWrite(uint8* readBuffer, const uint8* writeBuffer, uint8 singleWriteBytes, uint16 multiWriteBytes, uint16 multiReadBytes, uint32* bytesRead) = 0;
+
+    /*
+    * Makes the GPIO ports GPIO0 to GPIO3 inputs or outputs as given by directions
+    * Only possible while a single slave select is used, the other FT4222 modes use the GPIO pins for slave selects
+    * In that mode the pins belong to a USB interface of their own next to the SPI one
+    */
+    virtual FT4222_STATUS InitGpio(const GPIO_Dir directions[4]) = 0;
+
+    /*
+    * Drives the output port high or low
+    */
+    virtual FT4222_STATUS WriteGpio(GPIO_Port port, bool isHigh) = 0;
+
+    /*
+    * Reads the level of the port into isHigh
+    */
+    virtual FT4222_STATUS ReadGpio(GPIO_Port port, bool* isHigh) = 0;
+
+    /*
+    * Receives the largest number of bytes the FT4222 moves in one USB packet in the current mode
+    */
+    virtual FT4222_STATUS GetMaxTransferSize(uint16* maxTransferSize) = 0;
+
+    /*
+    * Sets the time the FT4222 holds back a partly filled USB packet, and the size of the USB requests the driver reads with
+    * A transfer that returns more bytes than inTransferSize takes several USB requests
+    */
+    virtual FT4222_STATUS SetUsbParameters(uint8 latencyTimerMs, DWORD inTransferSize) = 0;
+};
@@ -47,5 +47,11 @@ std::map<int, std::string> statusMessages =
     {FT4222_FUN_NOT_SUPPORT, "FUN Not supported",},
     {FT4222_INORRECT_TRANSFER_SIZE, "The number of bytes sent was not equal to the number of bytes in the data to send",},
     {FT4222_TIME_OUT_ERROR, "Time out error while waiting for flash device to get ready",},
-    {FT4222_CORRUPTED_UPLOAD, "The read data bits from the flash are not the same data bits that were programmed",}
+    {FT4222_CORRUPTED_UPLOAD, "The read data bits from the flash are not the same data bits that were programmed",},
+    {FT4222_QUAD_ENABLE_FAILED, "Could not set the Quad Enable bit in the flash status register",},
+    {FT4222_FLASH_NOT_DETECTED, "No flash answered the JEDEC ID command",},
+    {FT4222_FLASH_MISMATCH, "The flashes on the slave select lines of the board are not the same part",},
+    {FT4222_IMAGE_TOO_LARGE, "The image is larger than the flash",},
+    {FT4222_IMAGE_READ_FAILED, "Error reading the image stream",},
+    {FT4222_FPGA_NOT_CONFIGURED, "The FPGA did not raise CDONE after the bitstream was loaded, the image may not be a bitstream for this iCE40",}
 };
\ No newline at end of file
@@ -0,0 +1,166 @@
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include "Trace.h"
+#include "IceBoard.h"
+
+/*
+* Events of one thread, only that thread writes them
+* written only grows, the event with sequence number n is stored at n % TRACE_RING_CAPACITY
+*/
+struct TraceRing
+{
+    std::vector<TraceEvent> events = std::vector<TraceEvent>(TRACE_RING_CAPACITY);
+    std::atomic<size_t> written = 0;
+};
+
+static std::atomic<bool> isTraceEnabled = false;
+static std::chrono::steady_clock::time_point traceStart;
+
+// The rings outlive their threads, so the trace can be written after the workers of the boards have finished
+static std::mutex traceRegistryMutex;
+static std::vector<std::unique_ptr<TraceRing>> traceRings;
+static std::vector<std::string> traceBoards;
+
+static thread_local TraceRing* threadTraceRing = nullptr;
+
+/*
+* Starts recording, must be called before the boards are initialized and the worker threads are started
+*/
+void EnableTrace()
+{
+    traceStart = std::chrono::steady_clock::now();
+    isTraceEnabled = true;
+}
+
+bool IsTraceEnabled()
+{
+    return isTraceEnabled.load(std::memory_order_relaxed);
+}
+
+/*
+* Adds a board to the trace, its events are shown as a process named after serialNumber
+* Returns the id the events of the board are recorded with
+*/
+int RegisterTraceBoard(const std::string& serialNumber)
+{
+    std::lock_guard<std::mutex> lock(traceRegistryMutex);
+
+    traceBoards.push_back(serialNumber);
+    return (int)traceBoards.size() - 1;
+}
+
+/*
+* Appends event to the ring of the calling thread, only its first event takes the registry lock to create the ring
+*/
+void RecordTraceEvent(const TraceEvent& event)
+{
+    if (threadTraceRing == nullptr)
+    {
+        std::lock_guard<std::mutex> lock(traceRegistryMutex);
+        traceRings.emplace_back(new TraceRing());
+        threadTraceRing = traceRings.back().get();
+    }
+
+    const size_t sequence = threadTraceRing->written.load(std::memory_order_relaxed);
+    threadTraceRing->events[sequence % TRACE_RING_CAPACITY] = event;
+    threadTraceRing->written.store(sequence + 1, std::memory_order_release);
+}
+
+/*
+* Returns the name an SPI transaction is shown with
+*/
+static const char* OpcodeName(uint8 opcode)
+{
+    switch (opcode)
+    {
+    case ReadStatusRegisterCmd: return "Read Status";
+    case ReadStatusRegister2Cmd: return "Read Status 2";
+    case WriteStatusRegisterCmd: return "Write Status";
+    case WakeUpCmd: return "Wake Up";
+    case WriteEnableCmd: return "Write Enable";
+    case ChipEraseCmd: return "Chip Erase";
+    case SectorEraseCmd: return "Sector Erase";
+    case BlockErase32Cmd: return "Block Erase 32K";
+    case BlockErase64Cmd: return "Block Erase 64K";
+    case ReadCmd: return "Read";
+    case FastReadCmd: return "Fast Read";
+    case DualOutputReadCmd: return "Dual Output Read";
+    case QuadOutputReadCmd: return "Quad Output Read";
+    case QuadIOReadCmd: return "Quad I/O Read";
+    case ReadJedecIdCmd: return "Read JEDEC ID";
+    case ReadSfdpCmd: return "Read SFDP";
+    case PageProgramCmd: return "Page Program";
+    case QuadPageProgramCmd: return "Quad Page Program";
+    default: return nullptr;
+    }
+}
+
+static double TraceTimeUs(std::chrono::steady_clock::time_point time)
+{
+    return std::chrono::duration<double, std::micro>(time - traceStart).count();
+}
+
+/*
+* Writes the events of all threads to the file at tracePath in the Chrome trace event format
+* Every board is a process with a track for its SPI transfers and one for the busy time of its flashes
+* droppedEventCount receives the number of events that were overwritten because a ring was full
+* Must only be called once the threads that record events have finished, returns false if the file could not be written
+*/
+bool WriteTrace(const std::string& tracePath, size_t* droppedEventCount)
+{
+    std::lock_guard<std::mutex> lock(traceRegistryMutex);
+    std::ofstream trace(tracePath);
+
+    *droppedEventCount = 0;
+
+    trace << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[" << std::endl;
+    const char* separator = "";
+    for (size_t i = 0; i < traceBoards.size(); i++)
+    {
+        trace << separator << "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":" << i << ",\"args\":{\"name\":\"" << traceBoards[i] << "\"}}," << std::endl;
+        trace << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << i << ",\"tid\":0,\"args\":{\"name\":\"SPI\"}}," << std::endl;
+        trace << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << i << ",\"tid\":1,\"args\":{\"name\":\"Flash busy\"}}";
+        separator = ",\n";
+    }
+
+    trace.setf(std::ios::fixed);
+    trace.precision(3);
+    for (const std::unique_ptr<TraceRing>& ring : traceRings)
+    {
+        const size_t written = ring->written.load(std::memory_order_acquire);
+        const size_t first = written > TRACE_RING_CAPACITY ? written - TRACE_RING_CAPACITY : 0;
+        *droppedEventCount += first;
+
+        for (size_t sequence = first; sequence < written; sequence++)
+        {
+            const TraceEvent& event = ring->events[sequence % TRACE_RING_CAPACITY];
+            const char* name = event.name;
+            if (name == nullptr)
+                name = OpcodeName(event.opcode);
+
+            trace << separator << "{\"ph\":\"X\",\"pid\":" << event.boardId << ",\"tid\":" << (event.kind == BusyTraceEvent ? 1 : 0);
+            trace << ",\"ts\":" << TraceTimeUs(event.start) << ",\"dur\":" << TraceTimeUs(event.end) - TraceTimeUs(event.start) << ",\"name\":\"";
+            if (name != nullptr)
+                trace << name;
+            else
+                trace << "Opcode 0x" << std::hex << (int)event.opcode << std::dec;
+            trace << "\",\"args\":{\"chip\":" << (int)event.chip;
+            if (event.kind == SpiTraceEvent)
+            {
+                trace << ",\"opcode\":" << (int)event.opcode << ",\"length\":" << event.length;
+                if (event.address >= 0)
+                    trace << ",\"address\":" << event.address;
+                trace << ",\"endTransaction\":" << (event.isEndTransaction ? "true" : "false") << ",\"continuation\":" << (event.isContinuation ? "true" : "false");
+            }
+            trace << "}}";
+            separator = ",\n";
+        }
+    }
+    trace << std::endl << "]}" << std::endl;
+
+    return trace.good();
+}
@@ -0,0 +1,41 @@
+/*
+* Opt-in timeline of every SPI transfer and of the time the flash is busy, written as a Chrome trace that Perfetto and chrome://tracing load
+* Every thread records into a ring buffer of its own, so recording takes no lock and never waits for the threads of other boards
+* Once a ring is full its oldest events are overwritten, the trace then starts later for that thread
+*/
+
+#pragma once
+#include <chrono>
+#include <string>
+#include "ftd2xx.h"
+#include "LibFT4222.h"
+
+const size_t TRACE_RING_CAPACITY = 131072;     // Events every thread keeps, about 6 MB
+
+enum TraceEventKind
+{
+    SpiTraceEvent,          // A transfer of an SPI transaction
+    ControlTraceEvent,      // A clock, line or slave select change of the SPI master or a GPIO access
+    BusyTraceEvent          // The flash was busy with a program or erase
+};
+
+struct TraceEvent
+{
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+    const char* name;       // A string literal, nullptr for SPI transfers named after their opcode
+    int boardId;            // As returned by RegisterTraceBoard
+    int address;            // Address sent with the opcode of the transaction, -1 if it has none
+    uint32 length;          // Bytes clocked by the transfer
+    uint8 opcode;           // First byte of the transaction the transfer belongs to
+    uint8 chip;             // Slave select the transfer went to
+    TraceEventKind kind;
+    bool isEndTransaction;  // SS went high after the transfer
+    bool isContinuation;    // The transfer continues a transaction an earlier transfer started
+};
+
+void EnableTrace();
+bool IsTraceEnabled();
+int RegisterTraceBoard(const std::string& serialNumber);
+void RecordTraceEvent(const TraceEvent& event);
+bool WriteTrace(const std::string& tracePath, size_t* droppedEventCount);